@@ -0,0 +1,56 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AgentStats.h"
+
+
+
+LatencyHistogram::LatencyHistogram()
+{
+	for (auto& bucket : m_buckets)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Record(uint64_t microseconds)
+{
+	// index of the highest set bit, i.e., floor(log2(microseconds))
+	unsigned int bucketIndex = 0;
+	while (bucketIndex + 1 < HAGR_HISTOGRAM_BUCKETS && (microseconds >> (bucketIndex + 1)) != 0)
+		++bucketIndex;
+
+	m_buckets[bucketIndex].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::CopyTo(__out DWORD (&result)[HAGR_HISTOGRAM_BUCKETS]) const
+{
+	for (unsigned int i = 0; i < HAGR_HISTOGRAM_BUCKETS; ++i)
+		result[i] = m_buckets[i].load(std::memory_order_relaxed);
+}
+
+
+void AgentStats::CopyTo(__out HAGR_STATS& result) const
+{
+	result.reportsReceived = reportsReceived.load(std::memory_order_relaxed);
+	result.reportsDropped = reportsDropped.load(std::memory_order_relaxed);
+	result.reportsCoalesced = reportsCoalesced.load(std::memory_order_relaxed);
+	result.reattachCount = reattachCount.load(std::memory_order_relaxed);
+	result.initDeviceCount = initDeviceCount.load(std::memory_order_relaxed);
+	result.initDeviceTotalMicroseconds = initDeviceTotalMicroseconds.load(std::memory_order_relaxed);
+	publishLatency.CopyTo(result.publishLatency);
+	cacheAge.CopyTo(result.cacheAge);
+}
@@ -0,0 +1,56 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "hagr.h"
+
+
+
+// lock-free histogram; samples may be recorded from any thread
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void Record(uint64_t microseconds);
+	void CopyTo(__out DWORD (&result)[HAGR_HISTOGRAM_BUCKETS]) const;
+
+private:
+	std::atomic<uint32_t> m_buckets[HAGR_HISTOGRAM_BUCKETS];
+};
+
+
+// always-on counters of a single agent. everything is relaxed atomics so that recording costs next to nothing
+// and readers may see counters that are slightly out of sync with each other.
+struct AgentStats
+{
+	std::atomic<uint64_t> reportsReceived { 0 };
+	std::atomic<uint64_t> reportsDropped { 0 };
+	std::atomic<uint64_t> reportsCoalesced { 0 };
+	std::atomic<uint64_t> reattachCount { 0 };
+	std::atomic<uint64_t> initDeviceCount { 0 };
+	std::atomic<uint64_t> initDeviceTotalMicroseconds { 0 };
+	LatencyHistogram publishLatency;
+	LatencyHistogram cacheAge;
+
+	void CopyTo(__out HAGR_STATS& result) const;  // dwSize is left untouched
+};
@@ -0,0 +1,372 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// hagrBench.exe measures the hot paths of Hagr so that a change can be compared before and after.
+//   hagrBench micro                      translation, motion decoding, cached state reads and buffer iteration on generated packets
+//   hagrBench hammer [threads] [seconds] XInputGetState() called from 1 to N threads; calls/sec and latency percentiles
+//   hagrBench age [seconds]              histogram of how old the states returned by HagrGetStateEx() are
+// the last two load xinput1_4.dll from the folder of the EXE, i.e., the Hagr DLL built along with it.
+
+#define NOMINMAX
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+#include <xinput.h>
+
+#include "../DeviceIoEngine.h"
+#include "../Motion.h"
+#include "../PacketAdaptor.h"
+#include "../Pipes.h"
+#include "../Pro.h"
+#include "../ProInternals.h"
+#include "../SteadyTimer.h"
+#include "../hagr.h"
+
+
+
+namespace
+{
+
+
+constexpr std::chrono::milliseconds k_microDuration(500);  // per micro-benchmark
+constexpr unsigned int k_microBatchSize = 1024;  // calls between two clock reads
+constexpr unsigned int k_packetCount = 1024;
+
+
+volatile uint64_t s_sink;  // keeps the optimizer from dropping the work being measured
+
+
+double TicksToNanoseconds(uint64_t ticks)
+{
+	return static_cast<double>(ticks) * 1e9 / static_cast<double>(HighResClock::GetFrequency());
+}
+
+
+// per-tick latency histogram for a single thread. the resolution is that of QueryPerformanceCounter(), typically 100 ns
+class TickHistogram
+{
+public:
+	static constexpr uint64_t k_maxTicks = 100000;  // slower samples are counted in the last bucket
+
+
+	TickHistogram()
+		: m_buckets(k_maxTicks + 1, 0)
+		, m_count(0)
+		, m_max(0)
+	{ }
+
+	void Record(uint64_t ticks)
+	{
+		++m_buckets[std::min(ticks, k_maxTicks)];
+		++m_count;
+		m_max = std::max(m_max, ticks);
+	}
+
+	void Merge(const TickHistogram& other)
+	{
+		for (size_t i = 0; i < m_buckets.size(); ++i)
+			m_buckets[i] += other.m_buckets[i];
+		m_count += other.m_count;
+		m_max = std::max(m_max, other.m_max);
+	}
+
+	uint64_t GetCount() const { return m_count; }
+	uint64_t GetMax() const { return m_max; }
+
+	// smallest value at or below which the given fraction of the samples are
+	uint64_t GetPercentile(double fraction) const
+	{
+		const uint64_t rank = static_cast<uint64_t>(static_cast<double>(m_count) * fraction);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < m_buckets.size(); ++i)
+		{
+			seen += m_buckets[i];
+			if (seen > rank)
+				return i;
+		}
+		return k_maxTicks;
+	}
+
+private:
+	std::vector<uint64_t> m_buckets;
+	uint64_t m_count;
+	uint64_t m_max;
+};
+
+
+// full-states packets with random buttons and sticks; the same ones on every run
+std::vector<Packet> GeneratePackets()
+{
+	std::mt19937 random(0x48414752);
+	std::vector<Packet> packets(k_packetCount);
+	for (Packet& packet : packets)
+	{
+		ZeroMemory(&packet, sizeof(packet));
+		packet.type = PacketType::Device_FullStates;
+
+		auto& fullStates = packet.GetSubPacket<PacketType::Device_FullStates>();
+		auto* bytes = reinterpret_cast<uint8_t*>(&fullStates);
+		for (size_t i = 0; i < sizeof(fullStates); ++i)
+			bytes[i] = static_cast<uint8_t>(random());
+	}
+	return packets;
+}
+
+
+// call func() in batches for about k_microDuration and print the average time of a call
+template <typename F>
+void RunMicro(const char* name, const F& func)
+{
+	for (unsigned int i = 0; i < k_microBatchSize; ++i)
+		func(i);  // warm up
+
+	uint64_t callCount = 0;
+	const SteadyTimer timer;
+	std::chrono::microseconds elapsed;
+	do
+	{
+		for (unsigned int i = 0; i < k_microBatchSize; ++i)
+			func(i);
+		callCount += k_microBatchSize;
+		elapsed = timer.GetElapsed();
+	} while (elapsed < k_microDuration);
+
+	const double nanosecondsPerCall = static_cast<double>(elapsed.count()) * 1000.0 / static_cast<double>(callCount);
+	printf("%-32s %10.2f ns/call %14.0f calls/s\n", name, nanosecondsPerCall, 1e9 / nanosecondsPerCall);
+}
+
+
+int RunMicroBenchmarks()
+{
+	std::vector<Packet> packets = GeneratePackets();
+	const PacketAdaptor packetAdaptor;
+
+	RunMicro("PacketAdaptor::Translate", [&](unsigned int i) {
+		XINPUT_STATE state;
+		XINPUT_BATTERY_INFORMATION battery;
+		packetAdaptor.Translate(packets[i % k_packetCount], state, battery);
+		s_sink = state.Gamepad.wButtons + state.Gamepad.sThumbLX;
+	});
+	RunMicro("PacketAdaptor::TranslateReference", [&](unsigned int i) {
+		XINPUT_STATE state;
+		XINPUT_BATTERY_INFORMATION battery;
+		PacketAdaptor::TranslateReference(PacketAdaptor::k_defaultCalibration, PacketAdaptor::k_defaultProfile, packets[i % k_packetCount], state, battery);
+		s_sink = state.Gamepad.wButtons + state.Gamepad.sThumbLX;
+	});
+	RunMicro("PacketAdaptor::MapKeys", [&](unsigned int i) {
+		s_sink = packetAdaptor.MapKeys(packets[i % k_packetCount]);
+	});
+
+	const MotionDecoder motionDecoder;
+	RunMicro("MotionDecoder::Decode", [&](unsigned int i) {
+		HAGR_MOTION_SAMPLE samples[MotionDecoder::k_framesPerPacket];
+		motionDecoder.Decode(packets[i % k_packetCount], samples);
+		s_sink = static_cast<uint64_t>(samples[0].acceleration[0] + samples[2].angularVelocity[2]);
+	});
+	RunMicro("MotionDecoder::DecodeReference", [&](unsigned int i) {
+		HAGR_MOTION_SAMPLE samples[MotionDecoder::k_framesPerPacket];
+		MotionDecoder::DecodeReference(MotionDecoder::k_defaultCalibration, packets[i % k_packetCount], samples);
+		s_sink = static_cast<uint64_t>(samples[0].acceleration[0] + samples[2].angularVelocity[2]);
+	});
+
+	// a whole buffer of packets per call, the way a report of several packets is walked through
+	Buffer buffer(reinterpret_cast<uint8_t*>(packets.data()), static_cast<uint32_t>(packets.size() * sizeof(Packet)));
+	RunMicro("IterateBuffer (1024 packets)", [&](unsigned int) {
+		uint32_t keys = 0;
+		IterateBuffer<Packet>(buffer, [&keys, &packetAdaptor](const Packet& packet) {
+			keys |= packetAdaptor.MapKeys(packet);
+			return true;
+		});
+		s_sink = keys;
+	});
+
+	// an agent without a device still goes through the full seqlock read and staleness check
+	DeviceIoEngine ioEngine;
+	const ProAgent proAgent(0, ioEngine);
+	RunMicro("ProAgent::GetCachedState", [&](unsigned int) {
+		XINPUT_STATE state;
+		s_sink = proAgent.GetCachedState(state) + state.dwPacketNumber;
+	});
+
+	return 0;
+}
+
+
+// the entry points of the Hagr DLL next to the EXE
+struct HagrFuncs
+{
+	decltype(XInputGetState)* getState;
+	PFN_HAGR_GET_STATE_EX getStateEx;
+};
+
+bool LoadHagr(__out HagrFuncs& result)
+{
+	HMODULE module = LoadLibraryW(L"xinput1_4.dll");
+	result.getState = module ? reinterpret_cast<decltype(XInputGetState)*>(GetProcAddress(module, "XInputGetState")) : nullptr;
+	result.getStateEx = module ? reinterpret_cast<PFN_HAGR_GET_STATE_EX>(GetProcAddress(module, "HagrGetStateEx")) : nullptr;
+
+	if (result.getState == nullptr || result.getStateEx == nullptr)
+	{
+		printf("Unable to find Hagr's xinput1_4.dll next to hagrBench.exe.\n");
+		return false;
+	}
+	return true;
+}
+
+
+int RunHammer(unsigned int maxThreadCount, std::chrono::seconds duration)
+{
+	HagrFuncs hagr;
+	if (!LoadHagr(hagr))
+		return 1;
+
+	// the first call starts Hagr and waits for the device; it shouldn't count
+	XINPUT_STATE state;
+	const DWORD firstResult = hagr.getState(0, &state);
+	printf("XInputGetState(0) returned %08X%s\n", firstResult, firstResult == NO_ERROR ? "" : "; measuring the disconnected path");
+	printf("%7s %14s %10s %10s %10s %10s\n", "threads", "calls/s", "p50 ns", "p99 ns", "p999 ns", "max ns");
+
+	for (unsigned int threadCount = 1; threadCount <= maxThreadCount; ++threadCount)
+	{
+		std::atomic<bool> isStopping(false);
+		std::vector<TickHistogram> histograms(threadCount);
+		std::vector<std::thread> threads;
+		for (unsigned int i = 0; i < threadCount; ++i)
+		{
+			threads.emplace_back([&hagr, &isStopping, &histogram = histograms[i]] () {
+				XINPUT_STATE threadState;
+				while (!isStopping.load(std::memory_order_relaxed))
+				{
+					const uint64_t start = HighResClock::Now();
+					hagr.getState(0, &threadState);
+					histogram.Record(HighResClock::Now() - start);
+				}
+			});
+		}
+
+		const SteadyTimer timer;
+		std::this_thread::sleep_for(duration);
+		isStopping = true;
+		for (std::thread& thread : threads)
+			thread.join();
+		const auto elapsed = timer.GetElapsed();
+
+		TickHistogram total;
+		for (const TickHistogram& histogram : histograms)
+			total.Merge(histogram);
+
+		printf("%7u %14.0f %10.0f %10.0f %10.0f %10.0f\n",
+			threadCount,
+			static_cast<double>(total.GetCount()) * 1e6 / static_cast<double>(elapsed.count()),
+			TicksToNanoseconds(total.GetPercentile(0.5)),
+			TicksToNanoseconds(total.GetPercentile(0.99)),
+			TicksToNanoseconds(total.GetPercentile(0.999)),
+			TicksToNanoseconds(total.GetMax()));
+	}
+
+	return 0;
+}
+
+
+int RunAgeHistogram(std::chrono::seconds duration)
+{
+	constexpr unsigned int k_bucketMicroseconds = 500;
+	constexpr unsigned int k_bucketCount = 40;  // the last one takes everything older
+
+	HagrFuncs hagr;
+	if (!LoadHagr(hagr))
+		return 1;
+
+	// the polls fall at random points between two reports, the same way a game's frames do,
+	// so the histogram doesn't depend on how long Sleep() actually sleeps
+	unsigned int buckets[k_bucketCount] = { };
+	unsigned int sampleCount = 0;
+	unsigned int disconnectedCount = 0;
+	const SteadyTimer timer;
+	while (timer.GetElapsed() < duration)
+	{
+		HAGR_STATE_EX state;
+		state.dwSize = sizeof(state);
+		if (hagr.getStateEx(0, &state) == NO_ERROR && state.timestampMicroseconds != 0)
+		{
+			++buckets[std::min(static_cast<unsigned int>(state.ageMicroseconds / k_bucketMicroseconds), k_bucketCount - 1)];
+			++sampleCount;
+		}
+		else
+			++disconnectedCount;
+
+		Sleep(1);
+	}
+
+	printf("%u samples, %u while disconnected\n", sampleCount, disconnectedCount);
+	for (unsigned int i = 0; i < k_bucketCount && sampleCount != 0; ++i)
+	{
+		if (buckets[i] == 0)
+			continue;
+
+		const unsigned int barLength = buckets[i] * 60 / sampleCount;
+		printf("%5u-%s%5u us %8u %5.1f%% ", i * k_bucketMicroseconds, i + 1 < k_bucketCount ? "" : ">", (i + 1) * k_bucketMicroseconds, buckets[i], buckets[i] * 100.0 / sampleCount);
+		for (unsigned int j = 0; j < barLength; ++j)
+			putchar('#');
+		putchar('\n');
+	}
+
+	return 0;
+}
+
+
+void PrintUsage()
+{
+	printf("Usage:\n"
+		"    hagrBench micro\n"
+		"    hagrBench hammer [max threads = number of cores] [seconds per thread count = 2]\n"
+		"    hagrBench age [seconds = 10]\n");
+}
+
+
+}  // unnamed namespace
+
+
+
+int main(int argc, char* argv[])
+{
+	if (argc >= 2 && strcmp(argv[1], "micro") == 0)
+		return RunMicroBenchmarks();
+
+	if (argc >= 2 && strcmp(argv[1], "hammer") == 0)
+	{
+		const unsigned int maxThreadCount = argc >= 3 ? static_cast<unsigned int>(atoi(argv[2])) : std::max(std::thread::hardware_concurrency(), 1u);
+		const std::chrono::seconds duration(argc >= 4 ? atoi(argv[3]) : 2);
+		return RunHammer(std::max(maxThreadCount, 1u), duration);
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "age") == 0)
+		return RunAgeHistogram(std::chrono::seconds(argc >= 3 ? atoi(argv[2]) : 10));
+
+	PrintUsage();
+	return 1;
+}
@@ -0,0 +1,118 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+
+// single-producer ring that any number of consumers read at their own pace. each consumer keeps its own cursor,
+// so nobody consumes entries on behalf of others. the producer never waits; a consumer that falls behind by more
+// than the capacity loses the oldest entries.
+template <typename T>
+class BroadcastRing
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+	explicit BroadcastRing(unsigned int capacity)  // rounded up to a power of 2
+		: m_slots()
+		, m_capacity(1)
+		, m_head(0)
+	{
+		while (m_capacity < capacity)
+			m_capacity <<= 1;
+		m_slots = std::make_unique<Slot[]>(m_capacity);
+	}
+
+	// only one thread may push at a time
+	void Push(const T& value)
+	{
+		const uint64_t index = m_head.load(std::memory_order_relaxed);
+		Slot& slot = m_slots[index & (m_capacity - 1)];
+
+		// the same odd/even protocol as SeqLock, except that the sequence also tells which entry the slot holds
+		slot.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.value = value;
+		slot.sequence.store(index * 2 + 2, std::memory_order_release);
+
+		m_head.store(index + 1, std::memory_order_release);
+	}
+
+	// copy up to maxCount entries pushed after cursor, oldest first, and advance cursor past them.
+	// a cursor of 0 starts from the oldest entry still in the ring.
+	unsigned int Read(uint64_t& cursor, T* result, unsigned int maxCount) const
+	{
+		// std::max is parenthesized for includers of windows.h that don't define NOMINMAX
+		const uint64_t head = m_head.load(std::memory_order_acquire);
+		cursor = (std::max)(cursor, head > m_capacity ? head - m_capacity : 0);
+
+		unsigned int count = 0;
+		while (cursor < head && count < maxCount)
+		{
+			const Slot& slot = m_slots[cursor & (m_capacity - 1)];
+			const uint64_t expected = cursor * 2 + 2;
+
+			const uint64_t sequenceBefore = slot.sequence.load(std::memory_order_acquire);
+			memcpy(&result[count], &slot.value, sizeof(T));  // may be torn; validated by the sequence check below
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const uint64_t sequenceAfter = slot.sequence.load(std::memory_order_relaxed);
+
+			if (sequenceBefore == expected && sequenceAfter == expected)
+			{
+				++count;
+				++cursor;
+			}
+			else
+			{
+				// the producer lapped us; skip to the oldest entry that can still be intact
+				const uint64_t newHead = m_head.load(std::memory_order_acquire);
+				cursor = (std::max)(cursor + 1, newHead > m_capacity ? newHead - m_capacity : 0);
+			}
+		}
+
+		return count;
+	}
+
+	uint64_t GetHead() const  // cursor value after all entries pushed so far
+	{
+		return m_head.load(std::memory_order_acquire);
+	}
+
+	BroadcastRing(const BroadcastRing&) = delete;
+	BroadcastRing& operator = (const BroadcastRing&) = delete;
+
+private:
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence;  // 2 * (entry index + 1) once the entry is complete; odd while it's written
+		T value;
+	};
+
+
+	std::unique_ptr<Slot[]> m_slots;
+	uint64_t m_capacity;
+	std::atomic<uint64_t> m_head;  // number of entries ever pushed
+};
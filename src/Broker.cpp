@@ -0,0 +1,281 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Broker.h"
+
+#include <chrono>
+#include <new>
+
+#include "Pro.h"
+#include "ProRegistry.h"
+#include "SteadyTimer.h"
+
+
+
+namespace
+{
+
+
+std::chrono::microseconds GetAge(uint64_t publishTicks)
+{
+	return std::chrono::microseconds(HighResClock::ToMicroseconds(HighResClock::Now() - publishTicks));
+}
+
+
+// a broker that hasn't published anything yet hasn't measured anything either
+std::chrono::microseconds GetPacketTimeout(const Broker::PadStates& padStates)
+{
+	return padStates.packetTimeoutMicroseconds != 0 ? std::chrono::microseconds(padStates.packetTimeoutMicroseconds) : ProAgent::k_packetTimeout;
+}
+
+
+}  // unnamed namespace
+
+
+
+// ----------------------------------------------------------------------------
+// BrokerServer definitions ---------------------------------------------------
+
+BrokerServer::BrokerServer()
+	: m_instanceMutex(CreateMutexW(nullptr, FALSE, Broker::k_instanceMutexName))
+	, m_mapping()
+	, m_block(nullptr)
+	, m_publishedTicks()
+	, m_publishedDeviceValid()
+{
+	// there's room for one broker only. the mutex goes away with the process that holds it, however it exits,
+	// unlike the mapping, which game processes keep open
+	if (!m_instanceMutex || GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		m_instanceMutex.Close();
+		return;
+	}
+
+	// a mapping that already exists is a previous broker's. a block of another size is of another version too,
+	// and fails to map until its games are gone
+	m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(Broker::SharedBlock), Broker::k_mappingName);
+	const bool isTakenOver = GetLastError() == ERROR_ALREADY_EXISTS;
+	void* view = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Broker::SharedBlock)) : nullptr;
+	if (view == nullptr)
+	{
+		m_mapping.Close();
+		m_instanceMutex.Close();
+		return;
+	}
+
+	// fresh mappings are zero-filled, which isn't the same as constructed. a previous broker's block is built anew
+	// as well, since it may have died halfway through a write. its games have seen it exit and no longer read the
+	// block, while new ones wait for the magic
+	auto* block = static_cast<Broker::SharedBlock*>(view);
+	if (isTakenOver)
+	{
+		block->magic.store(0, std::memory_order_relaxed);
+		block->~SharedBlock();
+	}
+	m_block = new (view) Broker::SharedBlock();
+	m_block->brokerProcessId = GetCurrentProcessId();
+	m_block->magic.store(Broker::k_magic, std::memory_order_release);
+}
+
+BrokerServer::~BrokerServer()
+{
+	if (m_block == nullptr)
+		return;
+
+	// readers that keep the mapping open see disconnected pads rather than frozen ones
+	for (auto& states : m_block->states)
+		states.Write([](Broker::PadStates& padStates) { padStates.isDeviceValid = false; } );
+
+	m_block->~SharedBlock();
+	UnmapViewOfFile(m_block);
+}
+
+bool BrokerServer::IsValid() const
+{
+	return m_block != nullptr;
+}
+
+void BrokerServer::Publish(ProRegistry& registry)
+{
+	for (unsigned int i = 0; i < XUSER_MAX_COUNT; ++i)
+	{
+		ProAgent* agent = registry.GetAgent(i);
+		if (agent == nullptr)
+			continue;
+
+		// only write when something changed so readers' cache lines stay put in between
+		XINPUT_STATE gamepad;
+		XINPUT_BATTERY_INFORMATION battery;
+		uint64_t publishTicks;
+		agent->PeekCachedStates(gamepad, battery, publishTicks);
+		const bool isDeviceValid = agent->IsDeviceValid();
+		if (publishTicks != m_publishedTicks[i] || isDeviceValid != m_publishedDeviceValid[i])
+		{
+			// clients judge staleness by the same adaptive timeout the agent does
+			const uint32_t packetTimeoutMicroseconds = static_cast<uint32_t>(agent->GetPacketTimeout().count());
+			m_block->states[i].Write([&gamepad, &battery, publishTicks, packetTimeoutMicroseconds, isDeviceValid](Broker::PadStates& padStates) {
+				padStates.publishTicks = publishTicks;
+				padStates.packetTimeoutMicroseconds = packetTimeoutMicroseconds;
+				padStates.gamepad = gamepad;
+				padStates.battery = battery;
+				padStates.isDeviceValid = isDeviceValid;
+			} );
+			m_publishedTicks[i] = publishTicks;
+			m_publishedDeviceValid[i] = isDeviceValid;
+		}
+
+		const uint32_t vibration = m_block->requests[i].vibration.load(std::memory_order_relaxed);
+		XINPUT_VIBRATION requested;
+		requested.wLeftMotorSpeed = static_cast<WORD>(vibration >> 16);
+		requested.wRightMotorSpeed = static_cast<WORD>(vibration & 0xFFFF);
+		agent->SetVibration(requested);
+	}
+}
+
+
+
+// ----------------------------------------------------------------------------
+// BrokerClient definitions ---------------------------------------------------
+
+BrokerClient::BrokerClient()
+	: m_mapping(OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, Broker::k_mappingName))
+	, m_block(nullptr)
+	, m_brokerProcess()
+	, m_nextExitCheckTicks(0)
+	, m_hasBrokerExited(false)
+{
+	if (!m_mapping)
+		return;
+
+	void* view = MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(Broker::SharedBlock));
+	if (view == nullptr)
+		return;
+
+	auto* block = static_cast<Broker::SharedBlock*>(view);
+	if (block->magic.load(std::memory_order_acquire) != Broker::k_magic)
+	{
+		UnmapViewOfFile(view);  // a broker of another version, or one still starting up
+		return;
+	}
+
+	m_brokerProcess = OpenProcess(SYNCHRONIZE, FALSE, block->brokerProcessId);
+	if (!m_brokerProcess)
+	{
+		UnmapViewOfFile(view);
+		return;
+	}
+
+	m_block = block;
+}
+
+BrokerClient::~BrokerClient()
+{
+	if (m_block != nullptr)
+		UnmapViewOfFile(m_block);
+}
+
+bool BrokerClient::IsValid() const
+{
+	return m_block != nullptr;
+}
+
+bool BrokerClient::HasBrokerExited() const
+{
+	if (m_hasBrokerExited.load(std::memory_order_relaxed))
+		return true;
+
+	// every XInput call asks, so the kernel is only bothered a few times a second. concurrent callers may all
+	// look at once when the interval is up, which is harmless
+	const uint64_t now = HighResClock::Now();
+	if (now < m_nextExitCheckTicks.load(std::memory_order_relaxed))
+		return false;
+	m_nextExitCheckTicks.store(now + HighResClock::GetFrequency() * k_exitCheckInterval.count() / 1000, std::memory_order_relaxed);
+
+	if (IsBrokerAlive())
+		return false;
+	m_hasBrokerExited.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+bool BrokerClient::IsDeviceValid(DWORD userIndex) const
+{
+	if (userIndex >= XUSER_MAX_COUNT)
+		return false;
+
+	// a broker that died without cleaning up leaves the flag set, but its states go stale too.
+	// the process check is only paid for when they do.
+	Broker::PadStates padStates;
+	if (!ReadPadStates(userIndex, padStates))
+		return false;
+	return padStates.isDeviceValid && (GetAge(padStates.publishTicks) < GetPacketTimeout(padStates) || IsBrokerAlive());
+}
+
+bool BrokerClient::GetCachedState(DWORD userIndex, __out XINPUT_STATE& result, __out uint64_t& publishTicks) const
+{
+	Broker::PadStates padStates;
+	if (!ReadPadStates(userIndex, padStates))
+	{
+		ZeroMemory(&result, sizeof(result));
+		publishTicks = 0;
+		return false;
+	}
+
+	result = padStates.gamepad;
+	publishTicks = padStates.publishTicks;
+	return GetAge(padStates.publishTicks) < GetPacketTimeout(padStates);
+}
+
+bool BrokerClient::GetBatteryInfo(DWORD userIndex, __out XINPUT_BATTERY_INFORMATION& result) const
+{
+	Broker::PadStates padStates;
+	if (!ReadPadStates(userIndex, padStates))
+	{
+		ZeroMemory(&result, sizeof(result));
+		return false;
+	}
+
+	result = padStates.battery;
+	return GetAge(padStates.publishTicks) < GetPacketTimeout(padStates);
+}
+
+void BrokerClient::SetVibration(DWORD userIndex, const XINPUT_VIBRATION& vibration)
+{
+	const uint32_t packed = (static_cast<uint32_t>(vibration.wLeftMotorSpeed) << 16) | vibration.wRightMotorSpeed;
+	m_block->requests[userIndex].vibration.store(packed, std::memory_order_relaxed);
+}
+
+bool BrokerClient::ReadPadStates(DWORD userIndex, __out Broker::PadStates& result) const
+{
+	// a game must never hang in here, so a write that doesn't end reads as a disconnected pad
+	const auto& states = m_block->states[userIndex];
+	for (unsigned int round = 0; round < k_maxReadRounds; ++round)
+	{
+		if (states.TryRead(result, k_maxReadAttempts))
+			return true;
+		if (!IsBrokerAlive())
+			return false;
+		SwitchToThread();
+	}
+	return false;
+}
+
+bool BrokerClient::IsBrokerAlive() const
+{
+	return WaitForSingleObject(m_brokerProcess, 0) == WAIT_TIMEOUT;
+}
@@ -0,0 +1,132 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <new>
+
+#include <windows.h>
+#include <xinput.h>
+
+#include "AutoHandle.h"
+#include "SeqLock.h"
+
+class ProRegistry;
+
+
+
+// shared memory through which hagrBroker.exe serves every game process of the desktop session.
+// the broker is the only one that talks to the devices and the only writer of the states; game processes
+// merely read them and leave the vibration they want. the layout is the same for x86 and x64 processes.
+namespace Broker
+{
+	constexpr wchar_t k_mappingName[] = L"Local\\HagrBroker";
+	constexpr wchar_t k_instanceMutexName[] = L"Local\\HagrBrokerInstance";  // held by the running broker
+	constexpr uint32_t k_magic = 0x32424748;  // "HGB2"; bump whenever the layout changes
+
+	struct PadStates
+	{
+		uint64_t publishTicks;  // HighResClock; QueryPerformanceCounter() agrees across processes
+		uint32_t packetTimeoutMicroseconds;  // ProAgent::GetPacketTimeout() at the time of publishing
+		XINPUT_STATE gamepad;
+		XINPUT_BATTERY_INFORMATION battery;
+		bool isDeviceValid;
+	};
+	static_assert(sizeof(SeqLock<PadStates>) == std::hardware_destructive_interference_size);
+
+#pragma warning(push)
+#pragma warning(disable: 4324)  // structure was padded due to alignment specifier; every pad's data has cache lines of its own
+	struct alignas(std::hardware_destructive_interference_size) PadRequests
+	{
+		std::atomic<uint32_t> vibration;  // left motor speed in the high word; written by game processes
+	};
+
+	struct SharedBlock
+	{
+		std::atomic<uint32_t> magic;  // written last by the broker once everything else is in place
+		DWORD brokerProcessId;
+		SeqLock<PadStates> states[XUSER_MAX_COUNT];
+		PadRequests requests[XUSER_MAX_COUNT];
+	};
+#pragma warning(pop)
+}
+
+
+
+// the broker's side. creating it fails if another broker already runs. game processes may keep the mapping of a
+// broker that has exited open, in which case the next broker takes it over.
+class BrokerServer
+{
+public:
+	BrokerServer();
+	~BrokerServer();  // every pad reads as disconnected afterwards
+
+	bool IsValid() const;
+	void Publish(ProRegistry& registry);  // on the registry's service thread; mirror states and pass on vibration
+
+
+private:
+	AutoHandle m_instanceMutex;
+	AutoHandle m_mapping;
+	Broker::SharedBlock* m_block;  // null if not valid
+	uint64_t m_publishedTicks[XUSER_MAX_COUNT];
+	bool m_publishedDeviceValid[XUSER_MAX_COUNT];
+};
+
+
+
+// the game's side. it owns no device, no thread, and no more than a mapped page.
+class BrokerClient
+{
+public:
+	BrokerClient();  // not valid unless a broker is running
+	~BrokerClient();
+
+	bool IsValid() const;
+	// false for good once the broker has exited, so that the process can open the controllers itself instead.
+	// the broker's process is looked at no more often than every k_exitCheckInterval
+	bool HasBrokerExited() const;
+	// the rest must only be called if valid. only IsDeviceValid() accepts out of range user indices.
+	bool IsDeviceValid(DWORD userIndex) const;
+	bool GetCachedState(DWORD userIndex, __out XINPUT_STATE& result, __out uint64_t& publishTicks) const;  // result is always written
+	bool GetBatteryInfo(DWORD userIndex, __out XINPUT_BATTERY_INFORMATION& result) const;  // result is always written
+	void SetVibration(DWORD userIndex, const XINPUT_VIBRATION& vibration);
+
+
+private:
+	// a write of the broker normally takes a few dozen nanoseconds. if reading keeps overlapping one for longer than
+	// this, either the broker was preempted halfway through, or it died there, in which case it never ends
+	static constexpr unsigned int k_maxReadAttempts = 1024;
+	static constexpr unsigned int k_maxReadRounds = 4;  // of k_maxReadAttempts each; the broker is yielded to in between
+	static constexpr std::chrono::milliseconds k_exitCheckInterval = std::chrono::milliseconds(250);
+
+
+	bool ReadPadStates(DWORD userIndex, __out Broker::PadStates& result) const;  // false if the broker left the states half-written
+	bool IsBrokerAlive() const;
+
+
+	AutoHandle m_mapping;
+	Broker::SharedBlock* m_block;  // null if not valid
+	AutoHandle m_brokerProcess;  // waitable; signaled once the broker has exited
+	mutable std::atomic<uint64_t> m_nextExitCheckTicks;  // HighResClock
+	mutable std::atomic<bool> m_hasBrokerExited;
+};
@@ -0,0 +1,73 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+// hagrBroker.exe owns every Pro controller on behalf of all game processes of the desktop session.
+// Hagr DLLs loaded afterwards find its shared memory and read the controllers from there.
+
+#include <cstdio>
+
+#include <windows.h>
+
+#include "../Broker.h"
+#include "../ProRegistry.h"
+
+
+
+namespace
+{
+
+
+HANDLE s_stopEvent = nullptr;
+
+
+BOOL WINAPI OnConsoleControl(DWORD ctrlType)
+{
+	if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT || ctrlType == CTRL_CLOSE_EVENT)
+	{
+		SetEvent(s_stopEvent);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+
+}  // unnamed namespace
+
+
+
+int main()
+{
+	AutoHandle stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	s_stopEvent = stopEvent;
+	SetConsoleCtrlHandler(&OnConsoleControl, TRUE);
+
+	BrokerServer brokerServer;
+	if (!brokerServer.IsValid())
+	{
+		printf("Another Hagr broker is already running, or games still use one of another version.\n");
+		return 1;
+	}
+
+	// the registry goes first on the way out, so the broker marks the pads disconnected once nothing writes to them
+	ProRegistry proRegistry([&brokerServer](ProRegistry& registry) { brokerServer.Publish(registry); } );
+	printf("Hagr broker is running. Press Ctrl+C to stop.\n");
+
+	WaitForSingleObject(stopEvent, INFINITE);
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define NOMINMAX
+
+#include "Calibration.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cwchar>
+#include <iterator>
+#include <string>
+
+#include <windows.h>
+
+#include "AutoHandle.h"
+#include "Config.h"
+#include "ProInternals.h"
+
+
+
+namespace
+{
+
+
+constexpr uint32_t k_cacheMagic = 0x32434748;  // "HGC2"; bump the digit whenever the file layout changes
+constexpr uint8_t k_userCalibrationMagic[] = { 0xB2, 0xA1 };
+constexpr uint16_t k_unsetValue = 0xFFF;  // erased flash
+
+
+struct CacheFile
+{
+	uint32_t magic;
+	StickCalibration stickCalibration;
+	MotionCalibration motionCalibration;
+};
+
+
+// what AxisTable relies on: a range on either side of neutral, all within 12 bits. checked the same way for
+// calibrations decoded from flash and for those loaded from the cache
+bool IsValidAxis(const AxisCalibration& axis)
+{
+	return 0 <= axis.min && axis.min < axis.neutral && axis.neutral < axis.max && axis.max <= static_cast<int16_t>(k_unsetValue);
+}
+
+bool IsValidStickCalibration(const StickCalibration& calibration)
+{
+	return IsValidAxis(calibration.leftX) && IsValidAxis(calibration.leftY) && IsValidAxis(calibration.rightX) && IsValidAxis(calibration.rightY);
+}
+
+// a stick is stored as three pairs of 12-bit values, packed the same way as in input reports.
+// the order of the pairs differs between the sticks.
+struct StickPairs
+{
+	UInt24 pairs[3];
+};
+
+bool DecodeStick(const StickPairs& stick, bool isLeft, __out AxisCalibration& resultX, __out AxisCalibration& resultY)
+{
+	const auto [aboveX, aboveY] = stick.pairs[isLeft ? 0 : 2].Split();  // max above center
+	const auto [centerX, centerY] = stick.pairs[isLeft ? 1 : 0].Split();
+	const auto [belowX, belowY] = stick.pairs[isLeft ? 2 : 1].Split();  // min below center
+
+	const auto& isSet = [](uint16_t value) { return value != k_unsetValue && value != 0; };
+	if (!isSet(aboveX) || !isSet(aboveY) || !isSet(centerX) || !isSet(centerY) || !isSet(belowX) || !isSet(belowY))
+		return false;
+
+	const auto& toAxis = [](uint16_t center, uint16_t above, uint16_t below) {
+		return AxisCalibration {
+			static_cast<int16_t>(std::min(center + above, static_cast<int>(k_unsetValue))),
+			static_cast<int16_t>(std::max(center - below, 0)),
+			static_cast<int16_t>(center)
+		};
+	};
+	const AxisCalibration axisX = toAxis(centerX, aboveX, belowX);
+	const AxisCalibration axisY = toAxis(centerY, aboveY, belowY);
+	if (!IsValidAxis(axisX) || !IsValidAxis(axisY))
+		return false;
+
+	resultX = axisX;
+	resultY = axisY;
+	return true;
+}
+
+std::wstring GetCachePath(const DeviceId& deviceId, bool createFolder)
+{
+	const std::wstring path = GetCacheFolder(createFolder);
+	if (path.empty())
+		return path;
+
+	wchar_t fileName[32];
+	swprintf_s(fileName, L"\\%02X%02X%02X%02X%02X%02X.cal", deviceId[0], deviceId[1], deviceId[2], deviceId[3], deviceId[4], deviceId[5]);
+	return path + fileName;
+}
+
+
+}  // unnamed namespace
+
+
+
+bool DecodeFactoryStickCalibration(const uint8_t (&data)[k_factoryStickCalibrationSize], __out StickCalibration& result)
+{
+	static_assert(sizeof(data) == 2 * sizeof(StickPairs));
+	const auto* sticks = reinterpret_cast<const StickPairs*>(data);
+
+	const bool isLeftDecoded = DecodeStick(sticks[0], true, result.leftX, result.leftY);
+	const bool isRightDecoded = DecodeStick(sticks[1], false, result.rightX, result.rightY);
+	return isLeftDecoded || isRightDecoded;
+}
+
+bool DecodeUserStickCalibration(const uint8_t (&data)[k_userStickCalibrationSize], __out StickCalibration& result)
+{
+	constexpr size_t k_stickSize = sizeof(k_userCalibrationMagic) + sizeof(StickPairs);
+	static_assert(sizeof(data) == 2 * k_stickSize);
+
+	const auto& decodeIfPresent = [&data](size_t offset, bool isLeft, AxisCalibration& resultX, AxisCalibration& resultY) {
+		if (memcmp(data + offset, k_userCalibrationMagic, sizeof(k_userCalibrationMagic)) != 0)
+			return false;
+		const auto& stick = *reinterpret_cast<const StickPairs*>(data + offset + sizeof(k_userCalibrationMagic));
+		return DecodeStick(stick, isLeft, resultX, resultY);
+	};
+
+	const bool isLeftDecoded = decodeIfPresent(0, true, result.leftX, result.leftY);
+	const bool isRightDecoded = decodeIfPresent(k_stickSize, false, result.rightX, result.rightY);
+	return isLeftDecoded || isRightDecoded;
+}
+
+bool DecodeFactoryMotionCalibration(const uint8_t (&data)[k_factoryMotionCalibrationSize], __out MotionCalibration& result)
+{
+	static_assert(sizeof(data) == sizeof(MotionCalibration));
+
+	// erased flash reads all ones
+	if (std::all_of(std::begin(data), std::end(data), [](uint8_t value) { return value == 0xFF; }))
+		return false;
+
+	memcpy(&result, data, sizeof(result));
+	return true;
+}
+
+bool DecodeUserMotionCalibration(const uint8_t (&data)[k_userMotionCalibrationSize], __out MotionCalibration& result)
+{
+	static_assert(sizeof(data) == sizeof(k_userCalibrationMagic) + sizeof(MotionCalibration));
+
+	if (memcmp(data, k_userCalibrationMagic, sizeof(k_userCalibrationMagic)) != 0)
+		return false;
+
+	memcpy(&result, data + sizeof(k_userCalibrationMagic), sizeof(result));
+	return true;
+}
+
+bool LoadCachedCalibration(const DeviceId& deviceId, __out StickCalibration& stickResult, __out MotionCalibration& motionResult)
+{
+	const std::wstring path = GetCachePath(deviceId, false);
+	if (path.empty())
+		return false;
+
+	AutoHandle file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (!file)
+		return false;
+
+	CacheFile cache;
+	DWORD bytesRead;
+	if (ReadFile(file, &cache, sizeof(cache), &bytesRead, nullptr) == FALSE || bytesRead != sizeof(cache) || cache.magic != k_cacheMagic)
+		return false;
+
+	// a damaged or tampered file is dropped, so that the flash is read again and the cache rewritten from it
+	if (!IsValidStickCalibration(cache.stickCalibration))
+	{
+		file.Close();
+		DeleteFileW(path.c_str());
+		return false;
+	}
+
+	stickResult = cache.stickCalibration;
+	motionResult = cache.motionCalibration;
+	return true;
+}
+
+void SaveCachedCalibration(const DeviceId& deviceId, const StickCalibration& stickCalibration, const MotionCalibration& motionCalibration)
+{
+	const std::wstring path = GetCachePath(deviceId, true);
+	if (path.empty())
+		return;
+
+	// another process may be saving the same file at the same time; whoever comes last wins, which is fine
+	AutoHandle file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (!file)
+		return;
+
+	const CacheFile cache { k_cacheMagic, stickCalibration, motionCalibration };
+	DWORD bytesWritten;
+	WriteFile(file, &cache, sizeof(cache), &bytesWritten, nullptr);
+}
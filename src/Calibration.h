@@ -0,0 +1,59 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "Motion.h"
+#include "PacketAdaptor.h"
+
+
+
+// identifies a controller across reconnects. Pro controllers share the same USB serial string so we use
+// the MAC address reported by the status command instead.
+using DeviceId = std::array<uint8_t, 6>;
+
+
+// SPI flash layout of stick calibration
+constexpr uint32_t k_factoryStickCalibrationAddress = 0x603D;  // left stick followed by right stick
+constexpr uint8_t k_factoryStickCalibrationSize = 18;
+constexpr uint32_t k_userStickCalibrationAddress = 0x8010;  // a 2-byte magic before each stick
+constexpr uint8_t k_userStickCalibrationSize = 22;
+
+
+// SPI flash layout of motion sensor calibration
+constexpr uint32_t k_factoryMotionCalibrationAddress = 0x6020;
+constexpr uint8_t k_factoryMotionCalibrationSize = 24;
+constexpr uint32_t k_userMotionCalibrationAddress = 0x8026;  // a 2-byte magic first
+constexpr uint8_t k_userMotionCalibrationSize = 26;
+
+
+// both return false if the flash holds no calibration, in which case result is left untouched for that stick
+bool DecodeFactoryStickCalibration(const uint8_t (&data)[k_factoryStickCalibrationSize], __out StickCalibration& result);
+bool DecodeUserStickCalibration(const uint8_t (&data)[k_userStickCalibrationSize], __out StickCalibration& result);
+
+// both return false if the flash holds no calibration, in which case result is left untouched
+bool DecodeFactoryMotionCalibration(const uint8_t (&data)[k_factoryMotionCalibrationSize], __out MotionCalibration& result);
+bool DecodeUserMotionCalibration(const uint8_t (&data)[k_userMotionCalibrationSize], __out MotionCalibration& result);
+
+// calibration cache in %LOCALAPPDATA%\Hagr so that reconnects don't need to read flash again. a cached stick
+// calibration that decoding flash could never have produced is rejected
+bool LoadCachedCalibration(const DeviceId& deviceId, __out StickCalibration& stickResult, __out MotionCalibration& motionResult);
+void SaveCachedCalibration(const DeviceId& deviceId, const StickCalibration& stickCalibration, const MotionCalibration& motionCalibration);
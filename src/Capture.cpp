@@ -0,0 +1,383 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Capture.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <functional>
+
+#include "SteadyTimer.h"
+
+
+
+namespace
+{
+
+
+constexpr unsigned int k_captureQueueSize = 4096;  // records; several seconds of four controllers at full rate
+constexpr DWORD k_captureFlushInterval = 20;  // ms; how often the writer thread empties the queue
+
+
+}  // unnamed namespace
+
+
+
+// ----------------------------------------------------------------------------
+// CaptureWriter definitions --------------------------------------------------
+
+CaptureWriter::CaptureWriter(const std::wstring& path)
+	: m_file(CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr))
+	, m_startTicks(HighResClock::Now())
+	, m_queue(k_captureQueueSize)
+	, m_droppedCount(0)
+	, m_stopEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr))
+	, m_writerThread()
+{
+	if (!m_file)
+		return;
+
+	// written up front so that a capture cut short by a crash is still readable
+	WriteHeader();
+	m_writerThread.reset(new std::thread(std::mem_fn(&CaptureWriter::WriterThreadProc), this));
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	if (m_writerThread)
+	{
+		SetEvent(m_stopEvent);
+		m_writerThread->join();
+	}
+}
+
+bool CaptureWriter::IsValid() const
+{
+	return m_file;
+}
+
+void CaptureWriter::Record(unsigned int channel, const Buffer& buffer)
+{
+	if (!m_file)
+		return;
+
+	const uint64_t timestamp = HighResClock::ToMicroseconds(HighResClock::Now() - m_startTicks);
+	IterateBuffer<Packet>(buffer, [this, channel, timestamp](const Packet& packet) {
+		const Capture::Record record = { timestamp, channel, 0, packet };
+		if (!m_queue.Push(record))
+			m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	} );
+}
+
+void CaptureWriter::WriterThreadProc()
+{
+	std::vector<Capture::Record> batch;
+	batch.reserve(k_captureQueueSize);
+
+	bool isStopping = false;
+	while (!isStopping)
+	{
+		// one last pass after the stop signal picks up whatever was queued before it
+		isStopping = WaitForSingleObject(m_stopEvent, k_captureFlushInterval) != WAIT_TIMEOUT;
+
+		batch.clear();
+		Capture::Record record;
+		while (m_queue.Pop(record))
+			batch.push_back(record);
+
+		DWORD bytesWritten;
+		if (!batch.empty())
+			WriteFile(m_file, batch.data(), static_cast<DWORD>(batch.size() * sizeof(Capture::Record)), &bytesWritten, nullptr);
+	}
+
+	// the count of dropped records is final now
+	WriteHeader();
+}
+
+void CaptureWriter::WriteHeader()
+{
+	const Capture::FileHeader header = { Capture::k_magic, Capture::k_version, sizeof(Capture::Record), m_droppedCount.load(std::memory_order_relaxed) };
+
+	LARGE_INTEGER start = { };
+	LARGE_INTEGER current;
+	SetFilePointerEx(m_file, start, &current, FILE_CURRENT);
+	SetFilePointerEx(m_file, start, nullptr, FILE_BEGIN);
+
+	DWORD bytesWritten;
+	WriteFile(m_file, &header, sizeof(header), &bytesWritten, nullptr);
+	if (current.QuadPart > 0)
+		SetFilePointerEx(m_file, current, nullptr, FILE_BEGIN);
+}
+
+
+
+// ----------------------------------------------------------------------------
+// CaptureFile definitions ----------------------------------------------------
+
+CaptureFile::CaptureFile(const std::wstring& path)
+	: m_view(nullptr)
+	, m_records(nullptr)
+	, m_recordCount(0)
+{
+	// the view keeps the file mapped after both handles are closed
+	AutoHandle file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER fileSize;
+	if (!file || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(Capture::FileHeader)))
+		return;
+
+	AutoHandle mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (view == nullptr)
+		return;
+
+	const auto* header = static_cast<const Capture::FileHeader*>(view);
+	if (header->magic != Capture::k_magic || header->version != Capture::k_version || header->recordSize != sizeof(Capture::Record))
+	{
+		UnmapViewOfFile(view);
+		return;
+	}
+
+	m_view = view;
+	m_records = reinterpret_cast<const Capture::Record*>(header + 1);
+	m_recordCount = static_cast<size_t>((fileSize.QuadPart - sizeof(Capture::FileHeader)) / sizeof(Capture::Record));  // a torn last record is ignored
+}
+
+CaptureFile::~CaptureFile()
+{
+	if (m_view != nullptr)
+		UnmapViewOfFile(m_view);
+}
+
+bool CaptureFile::IsValid() const
+{
+	return m_view != nullptr;
+}
+
+const Capture::Record* CaptureFile::GetRecords() const
+{
+	return m_records;
+}
+
+size_t CaptureFile::GetRecordCount() const
+{
+	return m_recordCount;
+}
+
+std::vector<unsigned int> CaptureFile::GetChannels() const
+{
+	std::vector<unsigned int> channels;
+	for (size_t i = 0; i < m_recordCount; ++i)
+	{
+		if (std::find(channels.begin(), channels.end(), m_records[i].channel) == channels.end())
+			channels.push_back(m_records[i].channel);
+	}
+
+	std::sort(channels.begin(), channels.end());
+	return channels;
+}
+
+
+
+// ----------------------------------------------------------------------------
+// ReplayDevice definitions ---------------------------------------------------
+
+ReplayDevice::ReplayDevice(const CaptureFile& file, unsigned int channel, bool isPaced)
+	: m_file(file)
+	, m_channel(channel)
+	, m_isPaced(isPaced)
+	, m_path()
+	, m_pipe()
+	, m_stopEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr))
+	, m_pacingTimer(CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS))
+	, m_readEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr))
+	, m_writeEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr))
+	, m_readOverlapped()
+	, m_writeOverlapped()
+	, m_isReadPending(false)
+	, m_isWritePending(false)
+	, m_playStartTicks(0)
+	, m_hostBuffer()
+	, m_isFinished(true)
+	, m_replayThread()
+{
+	// high resolution timers need Windows 10 1803 or later; otherwise the pacing is as good as the system timer
+	if (!m_pacingTimer)
+		m_pacingTimer = CreateWaitableTimerW(nullptr, FALSE, nullptr);
+	assert(m_stopEvent && m_pacingTimer && m_readEvent && m_writeEvent);
+
+	m_readOverlapped.hEvent = m_readEvent;
+	m_writeOverlapped.hEvent = m_writeEvent;
+
+	// named after the process as well, so that two processes can replay at the same time
+	wchar_t path[64];
+	swprintf_s(path, L"\\\\.\\pipe\\HagrReplay.%lu.%u", GetCurrentProcessId(), channel);
+	m_path = path;
+
+	// the pipe accepts a connection from the moment it's created, even before the replay thread gets to it
+	m_pipe = CreateNamedPipeW(
+		m_path.c_str(),
+		PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		1,  // a device can only be opened by one agent
+		sizeof(Packet),  // a small buffer so that playback as fast as possible is held back by the reader
+		sizeof(Packet),
+		0,
+		nullptr);
+	if (!m_pipe)
+		return;
+
+	m_isFinished = false;
+	m_replayThread.reset(new std::thread(std::mem_fn(&ReplayDevice::ReplayThreadProc), this));
+}
+
+ReplayDevice::~ReplayDevice()
+{
+	if (m_replayThread)
+	{
+		SetEvent(m_stopEvent);
+		m_replayThread->join();
+	}
+}
+
+const std::wstring& ReplayDevice::GetPath() const
+{
+	return m_path;
+}
+
+bool ReplayDevice::IsFinished() const
+{
+	return m_isFinished;
+}
+
+void ReplayDevice::ReplayThreadProc()
+{
+	Play();
+
+	// the overlapped structures must outlive whatever is still running on them
+	CancelIoEx(m_pipe, nullptr);
+	DWORD bytesTransferred;
+	if (m_isReadPending)
+		GetOverlappedResult(m_pipe, &m_readOverlapped, &bytesTransferred, TRUE);
+	if (m_isWritePending)
+		GetOverlappedResult(m_pipe, &m_writeOverlapped, &bytesTransferred, TRUE);
+
+	m_isFinished = true;
+}
+
+void ReplayDevice::Play()
+{
+	if (ConnectNamedPipe(m_pipe, &m_writeOverlapped) == FALSE)
+	{
+		const DWORD error = GetLastError();
+		if (error == ERROR_IO_PENDING)
+		{
+			m_isWritePending = true;
+			if (!Wait(m_writeEvent))
+				return;
+			m_isWritePending = false;
+		}
+		else if (error != ERROR_PIPE_CONNECTED)
+			return;
+	}
+
+	if (!IssueHostRead())
+		return;
+
+	m_playStartTicks = HighResClock::Now();
+	const Capture::Record* records = m_file.GetRecords();
+	const uint64_t firstTimestamp = m_file.GetRecordCount() != 0 ? records[0].timestampMicroseconds : 0;
+	for (size_t i = 0; i < m_file.GetRecordCount(); ++i)
+	{
+		if (records[i].channel != m_channel)
+			continue;
+
+		if (m_isPaced && !WaitUntil(records[i].timestampMicroseconds - firstTimestamp))
+			return;
+		if (!Send(records[i].packet))
+			return;
+	}
+
+	// silent until the agent gives up on the device and closes it, which fails the pending read
+	Wait(nullptr);
+}
+
+bool ReplayDevice::Wait(HANDLE event)
+{
+	while (true)
+	{
+		const HANDLE waitHandles[] = { m_stopEvent, m_readEvent, event };
+		const DWORD numWaitHandles = event != nullptr ? 3 : 2;
+		const DWORD waitResult = WaitForMultipleObjects(numWaitHandles, waitHandles, FALSE, INFINITE);
+		if (waitResult == WAIT_OBJECT_0 + 1)
+		{
+			if (!ReapHostRead())
+				return false;
+		}
+		else
+			return waitResult == WAIT_OBJECT_0 + 2;
+	}
+}
+
+bool ReplayDevice::WaitUntil(uint64_t elapsedMicroseconds)
+{
+	const uint64_t currentMicroseconds = HighResClock::ToMicroseconds(HighResClock::Now() - m_playStartTicks);
+	if (currentMicroseconds >= elapsedMicroseconds)
+		return true;
+
+	LARGE_INTEGER dueTime;
+	dueTime.QuadPart = -static_cast<LONGLONG>(elapsedMicroseconds - currentMicroseconds) * 10;  // relative, in 100 ns units
+	SetWaitableTimer(m_pacingTimer, &dueTime, 0, nullptr, nullptr, FALSE);
+	return Wait(m_pacingTimer);
+}
+
+bool ReplayDevice::Send(const Packet& packet)
+{
+	// the packet lives in the mapped file, so it stays put while the write is pending
+	if (WriteFile(m_pipe, &packet, sizeof(packet), nullptr, &m_writeOverlapped) == FALSE && GetLastError() != ERROR_IO_PENDING)
+		return false;
+
+	m_isWritePending = true;
+	if (!Wait(m_writeEvent))
+		return false;
+	m_isWritePending = false;
+
+	DWORD bytesWritten;
+	return GetOverlappedResult(m_pipe, &m_writeOverlapped, &bytesWritten, FALSE) != FALSE;
+}
+
+bool ReplayDevice::IssueHostRead()
+{
+	// a read which completes right away still signals the event, so the next Wait() reaps it
+	m_isReadPending = ReadFile(m_pipe, m_hostBuffer, sizeof(m_hostBuffer), nullptr, &m_readOverlapped) != FALSE ||
+		GetLastError() == ERROR_IO_PENDING ||
+		GetLastError() == ERROR_MORE_DATA;
+	return m_isReadPending;
+}
+
+bool ReplayDevice::ReapHostRead()
+{
+	// a write longer than the buffer is just cut short
+	DWORD bytesRead;
+	m_isReadPending = false;
+	if (GetOverlappedResult(m_pipe, &m_readOverlapped, &bytesRead, FALSE) == FALSE && GetLastError() != ERROR_MORE_DATA)
+		return false;  // the agent has closed the pipe
+
+	return IssueHostRead();
+}
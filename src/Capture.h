@@ -0,0 +1,173 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+
+#include "AutoHandle.h"
+#include "Pipes.h"
+#include "ProInternals.h"
+#include "SpmcQueue.h"
+
+
+
+// ----------------------------------------------------------------------------
+// capture file format --------------------------------------------------------
+
+// a capture holds the packets read from controllers, timestamped, so they can be played back without a device.
+// a FileHeader is followed by Records in the order the packets were read.
+namespace Capture
+{
+	constexpr uint32_t k_magic = 0x43524748;  // "HGRC" in little endian
+	constexpr uint32_t k_version = 1;
+
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t recordSize;  // sizeof(Record)
+		uint32_t droppedCount;  // records lost because the writer fell behind; final once the capture is closed
+	};
+
+	// one packet sent by a device
+	struct Record
+	{
+		uint64_t timestampMicroseconds;  // since the capture started
+		uint32_t channel;  // user index of the agent which read the packet
+		uint32_t reserved;
+		Packet packet;
+	};
+	static_assert(sizeof(Record) == 80);
+}  // namespace Capture
+
+
+
+// ----------------------------------------------------------------------------
+// recording ------------------------------------------------------------------
+
+// appends captured packets to a file from a thread of its own, so capturing never waits for the disk.
+// Record() must only be called from one thread at a time, i.e. ProRegistry's service thread.
+class CaptureWriter
+{
+public:
+	explicit CaptureWriter(const std::wstring& path);  // an existing file is overwritten
+	~CaptureWriter();  // whatever is still queued is written before the file is closed
+
+	bool IsValid() const;
+	void Record(unsigned int channel, const Buffer& buffer);  // never blocks; packets are dropped while the queue is full
+
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator = (const CaptureWriter&) = delete;
+
+
+private:
+	void WriterThreadProc();
+	void WriteHeader();
+
+
+	AutoHandle m_file;
+	const uint64_t m_startTicks;  // HighResClock
+	SpmcQueue<Capture::Record> m_queue;  // a single consumer: the writer thread
+	std::atomic<uint32_t> m_droppedCount;
+	AutoHandle m_stopEvent;  // manual-reset
+	std::unique_ptr<std::thread> m_writerThread;
+};
+
+
+
+// ----------------------------------------------------------------------------
+// playback -------------------------------------------------------------------
+
+// a capture file mapped into memory, read-only
+class CaptureFile
+{
+public:
+	explicit CaptureFile(const std::wstring& path);
+	~CaptureFile();
+
+	bool IsValid() const;  // false if the file is missing or isn't a capture of this version
+	const Capture::Record* GetRecords() const;
+	size_t GetRecordCount() const;
+	std::vector<unsigned int> GetChannels() const;  // every channel that has a record, in ascending order
+
+	CaptureFile(const CaptureFile&) = delete;
+	CaptureFile& operator = (const CaptureFile&) = delete;
+
+
+private:
+	const void* m_view;  // null if invalid
+	const Capture::Record* m_records;
+	size_t m_recordCount;
+};
+
+
+// plays one channel of a capture back through a named pipe, which ProAgent opens just like a device.
+// whatever the agent writes is read and thrown away. when all packets have been sent the pipe stays silent, so the
+// agent times it out the same way it would with a controller that stopped reporting; the replay then finishes
+// once the agent has closed it.
+class ReplayDevice
+{
+public:
+	// paced playback keeps the original intervals; otherwise packets are sent as soon as the agent takes them.
+	// file must outlive the device.
+	ReplayDevice(const CaptureFile& file, unsigned int channel, bool isPaced);
+	~ReplayDevice();
+
+	const std::wstring& GetPath() const;
+	bool IsFinished() const;  // also true if the pipe couldn't be created
+
+	ReplayDevice(const ReplayDevice&) = delete;
+	ReplayDevice& operator = (const ReplayDevice&) = delete;
+
+
+private:
+	void ReplayThreadProc();
+	void Play();  // return when done or told to stop
+	bool Wait(HANDLE event);  // meanwhile reap the agent's writes; return false if stopped or the agent has gone
+	bool WaitUntil(uint64_t elapsedMicroseconds);  // since the playback started
+	bool Send(const Packet& packet);
+	bool IssueHostRead();
+	bool ReapHostRead();
+
+
+	const CaptureFile& m_file;
+	const unsigned int m_channel;
+	const bool m_isPaced;
+	std::wstring m_path;
+	AutoHandle m_pipe;
+	AutoHandle m_stopEvent;  // manual-reset
+	AutoHandle m_pacingTimer;
+	AutoHandle m_readEvent;  // manual-reset; of m_readOverlapped
+	AutoHandle m_writeEvent;  // manual-reset; of m_writeOverlapped, which is also used for connecting
+	OVERLAPPED m_readOverlapped;
+	OVERLAPPED m_writeOverlapped;
+	bool m_isReadPending;  // replay thread only
+	bool m_isWritePending;  // replay thread only
+	uint64_t m_playStartTicks;  // HighResClock; replay thread only
+	uint8_t m_hostBuffer[sizeof(Packet)];  // what the agent writes lands here
+	std::atomic<bool> m_isFinished;
+	std::unique_ptr<std::thread> m_replayThread;
+};
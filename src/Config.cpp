@@ -0,0 +1,258 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define NOMINMAX
+
+#include "Config.h"
+
+#include <algorithm>
+#include <cwchar>
+#include <iterator>
+#include <string>
+
+#include <windows.h>
+
+
+
+namespace
+{
+
+
+constexpr unsigned int k_maxStateHistoryDepth = 256;
+constexpr unsigned int k_maxStickDeadzonePercent = 90;
+
+
+// [Mapping] keys, named after the Pro's buttons
+struct KeySetting
+{
+	Buttons key;
+	const wchar_t* name;
+};
+
+constexpr KeySetting k_keySettings[] = {
+	{ Buttons::A, L"A" },
+	{ Buttons::B, L"B" },
+	{ Buttons::X, L"X" },
+	{ Buttons::Y, L"Y" },
+	{ Buttons::L, L"L" },
+	{ Buttons::R, L"R" },
+	{ Buttons::ZL, L"ZL" },
+	{ Buttons::ZR, L"ZR" },
+	{ Buttons::Minus, L"Minus" },
+	{ Buttons::Plus, L"Plus" },
+	{ Buttons::TriggerL, L"LStick" },
+	{ Buttons::TriggerR, L"RStick" },
+	{ Buttons::Home, L"Home" },
+	{ Buttons::Share, L"Capture" },
+	{ Buttons::Up, L"Up" },
+	{ Buttons::Down, L"Down" },
+	{ Buttons::Left, L"Left" },
+	{ Buttons::Right, L"Right" }
+};
+
+
+// [Mapping] values, named after the Xbox controller's buttons
+struct MappingTarget
+{
+	const wchar_t* name;
+	uint32_t bits;
+};
+
+constexpr MappingTarget k_mappingTargets[] = {
+	{ L"A", XINPUT_GAMEPAD_A },
+	{ L"B", XINPUT_GAMEPAD_B },
+	{ L"X", XINPUT_GAMEPAD_X },
+	{ L"Y", XINPUT_GAMEPAD_Y },
+	{ L"LB", XINPUT_GAMEPAD_LEFT_SHOULDER },
+	{ L"RB", XINPUT_GAMEPAD_RIGHT_SHOULDER },
+	{ L"LT", PacketAdaptor::k_leftTriggerBit },
+	{ L"RT", PacketAdaptor::k_rightTriggerBit },
+	{ L"Back", XINPUT_GAMEPAD_BACK },
+	{ L"Start", XINPUT_GAMEPAD_START },
+	{ L"LS", XINPUT_GAMEPAD_LEFT_THUMB },
+	{ L"RS", XINPUT_GAMEPAD_RIGHT_THUMB },
+	{ L"Up", XINPUT_GAMEPAD_DPAD_UP },
+	{ L"Down", XINPUT_GAMEPAD_DPAD_DOWN },
+	{ L"Left", XINPUT_GAMEPAD_DPAD_LEFT },
+	{ L"Right", XINPUT_GAMEPAD_DPAD_RIGHT },
+	{ L"None", 0 }
+};
+
+
+// the ini file lives next to whichever module Hagr is built into
+std::wstring GetIniPath()
+{
+	HMODULE module = nullptr;
+	if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCWSTR>(&GetIniPath), &module))
+		return std::wstring();
+
+	wchar_t path[MAX_PATH];
+	const DWORD length = GetModuleFileNameW(module, path, MAX_PATH);
+	if (length == 0 || length >= MAX_PATH)
+		return std::wstring();
+
+	std::wstring result(path, length);
+	result.resize(result.find_last_of(L'\\') + 1);
+	return result + L"hagr.ini";
+}
+
+
+unsigned int ReadSetting(const std::wstring& iniPath, const wchar_t* section, const wchar_t* key, const wchar_t* envName, unsigned int defaultValue)
+{
+	wchar_t envValue[16];
+	const DWORD envLength = GetEnvironmentVariableW(envName, envValue, static_cast<DWORD>(std::size(envValue)));
+	if (envLength != 0 && envLength < std::size(envValue))
+		return static_cast<unsigned int>(wcstoul(envValue, nullptr, 0));
+
+	if (iniPath.empty())
+		return defaultValue;
+	return GetPrivateProfileIntW(section, key, static_cast<int>(defaultValue), iniPath.c_str());
+}
+
+
+std::wstring ReadStringSetting(const std::wstring& iniPath, const wchar_t* section, const wchar_t* key, const wchar_t* envName)
+{
+	wchar_t value[MAX_PATH];
+	const DWORD envLength = GetEnvironmentVariableW(envName, value, static_cast<DWORD>(std::size(value)));
+	if (envLength != 0 && envLength < std::size(value))
+		return std::wstring(value, envLength);
+
+	if (iniPath.empty())
+		return std::wstring();
+	const DWORD length = GetPrivateProfileStringW(section, key, L"", value, static_cast<DWORD>(std::size(value)), iniPath.c_str());
+	return std::wstring(value, length);
+}
+
+
+// for settings that may be negative, which GetPrivateProfileIntW() turns into 0. anything that isn't a whole number
+// in [minValue, maxValue] reads as defaultValue
+int ReadSignedSetting(const std::wstring& iniPath, const wchar_t* section, const wchar_t* key, const wchar_t* envName, int minValue, int maxValue, int defaultValue)
+{
+	const std::wstring value = ReadStringSetting(iniPath, section, key, envName);
+	if (value.empty())
+		return defaultValue;
+
+	wchar_t* end = nullptr;
+	const long parsed = wcstol(value.c_str(), &end, 0);
+	while (*end == L' ' || *end == L'\t')
+		++end;
+	if (end == value.c_str() || *end != L'\0' || parsed < minValue || parsed > maxValue)
+		return defaultValue;
+	return static_cast<int>(parsed);
+}
+
+
+// file name of the process's EXE, e.g. Game.exe; empty if unavailable
+std::wstring GetHostExeName()
+{
+	wchar_t path[MAX_PATH];
+	const DWORD length = GetModuleFileNameW(nullptr, path, MAX_PATH);
+	if (length == 0 || length >= MAX_PATH)
+		return std::wstring();
+
+	const std::wstring result(path, length);
+	return result.substr(result.find_last_of(L'\\') + 1);
+}
+
+
+// lay what section sets on top of profile; keys it doesn't have, or with values that aren't understood, are left alone
+void ReadMappingSection(const std::wstring& iniPath, const wchar_t* section, __inout MappingProfile& profile)
+{
+	for (const auto& setting : k_keySettings)
+	{
+		wchar_t value[16];
+		if (GetPrivateProfileStringW(section, setting.name, L"", value, static_cast<DWORD>(std::size(value)), iniPath.c_str()) == 0)
+			continue;
+
+		for (const auto& target : k_mappingTargets)
+		{
+			if (_wcsicmp(value, target.name) == 0)
+			{
+				profile.keyBits[static_cast<unsigned int>(setting.key)] = target.bits;
+				break;
+			}
+		}
+	}
+
+	const UINT deadzonePercent = GetPrivateProfileIntW(section, L"StickDeadzone", profile.stickDeadzonePercent, iniPath.c_str());
+	profile.stickDeadzonePercent = static_cast<uint8_t>(std::min(deadzonePercent, k_maxStickDeadzonePercent));
+}
+
+
+// [Mapping.<EXE name>] overrides [Mapping], which overrides the default. there are too many keys for environment
+// variables to be of much use, so only the file is read
+MappingProfile ReadMappingProfile(const std::wstring& iniPath)
+{
+	MappingProfile result = PacketAdaptor::k_defaultProfile;
+	if (iniPath.empty())
+		return result;
+
+	ReadMappingSection(iniPath, L"Mapping", result);
+	const std::wstring exeName = GetHostExeName();
+	if (!exeName.empty())
+		ReadMappingSection(iniPath, (L"Mapping." + exeName).c_str(), result);
+	return result;
+}
+
+
+Config LoadConfig()
+{
+	const std::wstring iniPath = GetIniPath();
+
+	Config result;
+	result.latchButtonPresses = ReadSetting(iniPath, L"Input", L"LatchButtonPresses", L"HAGR_LATCH_BUTTON_PRESSES", 0) != 0;
+	result.stateHistoryDepth = std::min(ReadSetting(iniPath, L"Input", L"StateHistoryDepth", L"HAGR_STATE_HISTORY_DEPTH", 0), k_maxStateHistoryDepth);
+	const unsigned int rawInputMode = ReadSetting(iniPath, L"Input", L"RawInput", L"HAGR_RAW_INPUT", static_cast<unsigned int>(Config::RawInputMode::Unregister));
+	result.rawInputMode = rawInputMode <= static_cast<unsigned int>(Config::RawInputMode::Filter) ? static_cast<Config::RawInputMode>(rawInputMode) : Config::RawInputMode::Unregister;
+	result.mappingProfile = ReadMappingProfile(iniPath);
+	result.useBroker = ReadSetting(iniPath, L"Broker", L"UseBroker", L"HAGR_USE_BROKER", 0) != 0;
+	result.mmcssTask = ReadStringSetting(iniPath, L"Service", L"MmcssTask", L"HAGR_MMCSS_TASK");
+	result.servicePriority = ReadSignedSetting(iniPath, L"Service", L"Priority", L"HAGR_PRIORITY", THREAD_PRIORITY_IDLE, THREAD_PRIORITY_TIME_CRITICAL, THREAD_PRIORITY_NORMAL);
+	result.serviceProcessor = ReadSignedSetting(iniPath, L"Service", L"Processor", L"HAGR_PROCESSOR", -1, MAXIMUM_PROCESSORS - 1, -1);
+	result.pinServiceToProcessor = ReadSetting(iniPath, L"Service", L"PinToProcessor", L"HAGR_PIN_TO_PROCESSOR", 0) != 0;
+	result.idleTimeoutSeconds = ReadSetting(iniPath, L"Service", L"IdleTimeout", L"HAGR_IDLE_TIMEOUT", 60);
+	result.captureFile = ReadStringSetting(iniPath, L"Debug", L"CaptureFile", L"HAGR_CAPTURE_FILE");
+	result.replayFile = ReadStringSetting(iniPath, L"Debug", L"ReplayFile", L"HAGR_REPLAY_FILE");
+	result.replayPaced = ReadSetting(iniPath, L"Debug", L"ReplayPaced", L"HAGR_REPLAY_PACED", 1) != 0;
+	return result;
+}
+
+
+}  // unnamed namespace
+
+
+
+const Config& Config::Get()
+{
+	static const Config s_config = LoadConfig();
+	return s_config;
+}
+
+std::wstring GetCacheFolder(bool createFolder)
+{
+	wchar_t localAppData[MAX_PATH];
+	const DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", localAppData, MAX_PATH);
+	if (length == 0 || length >= MAX_PATH)
+		return std::wstring();
+
+	std::wstring path(localAppData);
+	path += L"\\Hagr";
+	if (createFolder)
+		CreateDirectoryW(path.c_str(), nullptr);  // fails harmlessly if it already exists
+	return path;
+}
@@ -0,0 +1,87 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+
+#include "PacketAdaptor.h"
+
+
+
+// user settings, read once per process from hagr.ini next to the Hagr DLL.
+// an environment variable of the same setting takes precedence over the file, e.g. HAGR_LATCH_BUTTON_PRESSES=1.
+struct Config
+{
+	// [Input] LatchButtonPresses; buttons pressed at any point since the last XInputGetState() are reported by the
+	// next one, even if they were released again in between
+	bool latchButtonPresses;
+
+	// [Input] StateHistoryDepth; how many timestamped states per controller are kept for HagrReadStateHistory().
+	// 0 disables the history
+	unsigned int stateHistoryDepth;
+
+	// [Input] RawInput; what becomes of the game's raw input of joysticks, through which it would see the Pro
+	// controllers besides XInput. Unregister, the default, stops all of it; Filter hides just the Pro controllers
+	enum class RawInputMode { Keep = 0, Unregister = 1, Filter = 2 };
+	RawInputMode rawInputMode;
+
+	// [Mapping] A, B, ..., StickDeadzone; what every button of the controllers turns into and how much of each
+	// stick's travel from neutral reads as 0. a [Mapping.<name of the game's EXE>] section, e.g. [Mapping.Game.exe],
+	// overrides [Mapping] for that game only. PacketAdaptor::k_defaultProfile by default
+	MappingProfile mappingProfile;
+
+	// [Broker] UseBroker; if hagrBroker.exe is running when Hagr is first used, read the controllers through it
+	// instead of opening them in this process. off by default, as the broker serves states, battery and vibration only
+	bool useBroker;
+
+	// [Service] MmcssTask; register Hagr's service thread with MMCSS under this task, e.g. Games, so that it keeps
+	// being scheduled while the game saturates every core. empty by default
+	std::wstring mmcssTask;
+
+	// [Service] Priority; SetThreadPriority() value of the service thread, e.g. 2 for THREAD_PRIORITY_HIGHEST or -1 for
+	// THREAD_PRIORITY_BELOW_NORMAL. 0 by default
+	int servicePriority;
+
+	// [Service] Processor; the service thread's ideal processor. -1, the default, leaves it to Windows
+	int serviceProcessor;
+
+	// [Service] PinToProcessor; restrict the service thread to Processor instead of merely preferring it
+	bool pinServiceToProcessor;
+
+	// [Service] IdleTimeout; seconds without any XInput call after which the service thread stands by instead of
+	// handling every report. the next call wakes it up and waits for a fresh report. 0 disables it. 60 by default
+	unsigned int idleTimeoutSeconds;
+
+	// [Debug] CaptureFile; every packet read from the controllers is also written to this file. empty by default
+	std::wstring captureFile;
+
+	// [Debug] ReplayFile; a file written by CaptureFile is played back in place of the real controllers. empty by default
+	std::wstring replayFile;
+
+	// [Debug] ReplayPaced; play the packets back at their original pace rather than as fast as they're read. on by default
+	bool replayPaced;
+
+
+	static const Config& Get();
+};
+
+
+// %LOCALAPPDATA%\Hagr, where Hagr keeps what it learned about controllers across runs. empty if unavailable.
+std::wstring GetCacheFolder(bool createFolder);
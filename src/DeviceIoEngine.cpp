@@ -0,0 +1,298 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define NOMINMAX
+
+#include "DeviceIoEngine.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include "SteadyTimer.h"
+
+
+
+// ----------------------------------------------------------------------------
+// DeviceIoEngine::Operation definitions --------------------------------------
+
+DeviceIoEngine::Operation::Operation()
+	: m_context()
+	, m_isPending(false)
+	, m_completionTicks(0)
+{
+	m_context.owner = this;
+}
+
+DeviceIoEngine::Operation::~Operation()
+{
+	assert(!m_isPending);
+}
+
+OVERLAPPED* DeviceIoEngine::Operation::Begin()
+{
+	assert(!m_isPending);
+	ZeroMemory(static_cast<OVERLAPPED*>(&m_context), sizeof(OVERLAPPED));
+	m_isPending = true;
+	m_completionTicks = 0;
+	return &m_context;
+}
+
+void DeviceIoEngine::Operation::Abandon()
+{
+	m_isPending = false;
+}
+
+bool DeviceIoEngine::Operation::IsPending() const
+{
+	return m_isPending;
+}
+
+uint64_t DeviceIoEngine::Operation::GetCompletionTicks() const
+{
+	return m_completionTicks;
+}
+
+OVERLAPPED* DeviceIoEngine::Operation::GetOverlapped()
+{
+	return &m_context;
+}
+
+void DeviceIoEngine::Operation::OnComplete([[maybe_unused]] DWORD bytesTransferred)
+{
+}
+
+
+
+// ----------------------------------------------------------------------------
+// DeviceIoEngine::Timer definitions ------------------------------------------
+
+DeviceIoEngine::Timer::Timer()
+	: m_engine(nullptr)
+	, m_prev(nullptr)
+	, m_next(nullptr)
+	, m_dueTick(0)
+	, m_hasExpired(false)
+{
+}
+
+DeviceIoEngine::Timer::~Timer()
+{
+	if (m_engine != nullptr)
+		m_engine->CancelTimer(*this);
+}
+
+bool DeviceIoEngine::Timer::IsArmed() const
+{
+	return m_engine != nullptr && !HasExpired();
+}
+
+bool DeviceIoEngine::Timer::HasExpired() const
+{
+	// a waiter that never needs to pump, e.g. because its reads keep completing, still sees its deadline pass
+	return m_hasExpired || (m_engine != nullptr && DeviceIoEngine::GetCurrentTick() >= m_dueTick);
+}
+
+bool DeviceIoEngine::Timer::ConsumeExpiry()
+{
+	if (!HasExpired())
+		return false;
+
+	if (m_engine != nullptr)
+		m_engine->CancelTimer(*this);
+	m_hasExpired = false;
+	return true;
+}
+
+
+
+// ----------------------------------------------------------------------------
+// DeviceIoEngine definitions -------------------------------------------------
+
+DeviceIoEngine::DeviceIoEngine()
+	: m_port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1))  // only one thread pumps
+	, m_signals(0)
+	, m_wheel()
+	, m_currentTick(GetCurrentTick())
+	, m_numArmedTimers(0)
+{
+	assert(m_port);
+}
+
+DeviceIoEngine::~DeviceIoEngine()
+{
+	assert(m_numArmedTimers == 0);  // a timer must not outlive its engine
+}
+
+bool DeviceIoEngine::IsValid() const
+{
+	return m_port;
+}
+
+bool DeviceIoEngine::Attach(HANDLE file)
+{
+	if (CreateIoCompletionPort(file, m_port, 0, 0) == nullptr)
+		return false;
+
+	// the port is all that's waited on, so the kernel needn't signal the file as well
+	SetFileCompletionNotificationModes(file, FILE_SKIP_SET_EVENT_ON_HANDLE);
+	return true;
+}
+
+bool DeviceIoEngine::Pump(DWORD timeout)
+{
+	const DWORD waitTimeout = std::min(timeout, GetTimerWait(GetCurrentTick()));
+
+	OVERLAPPED_ENTRY entries[k_maxCompletionsPerPump];
+	ULONG numEntries = 0;
+	if (GetQueuedCompletionStatusEx(m_port, entries, k_maxCompletionsPerPump, &numEntries, waitTimeout, FALSE) == FALSE)
+	{
+		if (GetLastError() != WAIT_TIMEOUT)
+			return false;
+		numEntries = 0;
+	}
+
+	// the completions of one pump were taken off the port together; whoever handles them later can tell how long
+	// they waited from here
+	const uint64_t dispatchTicks = HighResClock::Now();
+	for (ULONG i = 0; i < numEntries; ++i)
+	{
+		// a null OVERLAPPED is the wake-up posted by Signal()
+		if (entries[i].lpOverlapped == nullptr)
+			continue;
+
+		Operation* operation = static_cast<Operation::Context*>(entries[i].lpOverlapped)->owner;
+		operation->m_isPending = false;  // first, so the callback may begin the next operation on it
+		operation->m_completionTicks = dispatchTicks;
+		operation->OnComplete(entries[i].dwNumberOfBytesTransferred);
+	}
+
+	ExpireTimers(GetCurrentTick());
+	return true;
+}
+
+void DeviceIoEngine::ArmTimer(Timer& timer, std::chrono::microseconds delay)
+{
+	if (timer.m_engine != nullptr)
+		timer.m_engine->Unlink(timer);
+
+	// never at or behind the current tick, whose slot has been visited already
+	const uint64_t delayTicks = (static_cast<uint64_t>(std::max(delay.count(), static_cast<int64_t>(0))) + k_tickMicroseconds - 1) / k_tickMicroseconds;
+	timer.m_dueTick = std::max(GetCurrentTick() + delayTicks, m_currentTick + 1);
+	timer.m_hasExpired = false;
+	timer.m_engine = this;
+
+	Timer*& head = m_wheel[timer.m_dueTick & (k_wheelSlots - 1)];
+	timer.m_prev = nullptr;
+	timer.m_next = head;
+	if (head != nullptr)
+		head->m_prev = &timer;
+	head = &timer;
+	++m_numArmedTimers;
+}
+
+void DeviceIoEngine::CancelTimer(Timer& timer)
+{
+	if (timer.m_engine == this)
+		Unlink(timer);
+	timer.m_hasExpired = false;
+}
+
+void DeviceIoEngine::Signal(uint32_t signals)
+{
+	// only the first one raised needs to wake the pump up; whoever takes them takes them all
+	if (m_signals.fetch_or(signals, std::memory_order_release) == 0)
+		PostQueuedCompletionStatus(m_port, 0, 0, nullptr);
+}
+
+bool DeviceIoEngine::HasSignals() const
+{
+	return m_signals.load(std::memory_order_relaxed) != 0;
+}
+
+uint32_t DeviceIoEngine::TakeSignals()
+{
+	return m_signals.exchange(0, std::memory_order_acquire);
+}
+
+uint64_t DeviceIoEngine::GetCurrentTick()
+{
+	return HighResClock::ToMicroseconds(HighResClock::Now()) / k_tickMicroseconds;
+}
+
+DWORD DeviceIoEngine::GetTimerWait(uint64_t now) const
+{
+	if (m_numArmedTimers == 0)
+		return INFINITE;
+
+	// the timers in a slot are due at its tick or whole revolutions later, so once the earliest due time seen
+	// is no later than the slot being looked at, none of the slots ahead can beat it
+	uint64_t nextDueTick = std::numeric_limits<uint64_t>::max();
+	for (uint64_t tick = m_currentTick + 1; tick <= m_currentTick + k_wheelSlots && nextDueTick > tick; ++tick)
+	{
+		for (const Timer* timer = m_wheel[tick & (k_wheelSlots - 1)]; timer != nullptr; timer = timer->m_next)
+			nextDueTick = std::min(nextDueTick, timer->m_dueTick);
+	}
+
+	if (nextDueTick <= now)
+		return 0;
+	return static_cast<DWORD>(std::min<uint64_t>((nextDueTick - now) * k_tickMicroseconds / 1000, INFINITE - 1));
+}
+
+void DeviceIoEngine::ExpireTimers(uint64_t now)
+{
+	if (now <= m_currentTick)
+		return;
+
+	// after a long gap every slot is visited once, which covers every timer
+	const uint64_t lastTick = std::min(now, m_currentTick + k_wheelSlots);
+	for (uint64_t tick = m_currentTick + 1; tick <= lastTick && m_numArmedTimers != 0; ++tick)
+	{
+		Timer* timer = m_wheel[tick & (k_wheelSlots - 1)];
+		while (timer != nullptr)
+		{
+			Timer* const next = timer->m_next;
+			if (timer->m_dueTick <= now)
+			{
+				Unlink(*timer);
+				timer->m_hasExpired = true;
+			}
+			timer = next;
+		}
+	}
+
+	m_currentTick = now;
+}
+
+void DeviceIoEngine::Unlink(Timer& timer)
+{
+	assert(timer.m_engine == this && m_numArmedTimers > 0);
+
+	if (timer.m_prev != nullptr)
+		timer.m_prev->m_next = timer.m_next;
+	else
+		m_wheel[timer.m_dueTick & (k_wheelSlots - 1)] = timer.m_next;
+	if (timer.m_next != nullptr)
+		timer.m_next->m_prev = timer.m_prev;
+
+	timer.m_prev = nullptr;
+	timer.m_next = nullptr;
+	timer.m_engine = nullptr;
+	--m_numArmedTimers;
+}
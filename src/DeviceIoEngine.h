@@ -0,0 +1,144 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <windows.h>
+
+#include "AutoHandle.h"
+
+
+
+// drives the overlapped I/O of every device file through a single completion port, so one thread can wait for
+// all of them at once without an event per operation. completions, timers and signals are dispatched on whichever
+// thread calls Pump(), of which there must only be one at a time; Signal() may be called from any thread.
+class DeviceIoEngine
+{
+public:
+	// one overlapped operation. it must stay put until its completion has been dispatched, even if it's cancelled
+	// or the file is closed, which is why users allocate theirs up front and reuse them.
+	class Operation
+	{
+	public:
+		Operation();
+		virtual ~Operation();
+
+		// a cleared OVERLAPPED to hand to ReadFile() and the like; the operation is pending from then on.
+		// if the call fails right away nothing will be dispatched, so the caller must Abandon() it.
+		OVERLAPPED* Begin();
+		void Abandon();
+
+		bool IsPending() const;  // begun and its completion not dispatched yet
+		uint64_t GetCompletionTicks() const;  // HighResClock time its last completion was dispatched at; 0 until then
+		OVERLAPPED* GetOverlapped();  // for GetOverlappedResult() and CancelIoEx()
+
+		Operation(const Operation&) = delete;
+		Operation& operator = (const Operation&) = delete;
+
+	protected:
+		virtual void OnComplete(DWORD bytesTransferred);  // on the pumping thread; does nothing by default
+
+
+	private:
+		friend class DeviceIoEngine;
+
+		struct Context : OVERLAPPED
+		{
+			Operation* owner;
+		};
+
+		Context m_context;
+		bool m_isPending;
+		uint64_t m_completionTicks;
+	};
+
+
+	// a one-shot timer on the engine's wheel; it expires on the pumping thread. an unarmed timer never expires,
+	// and an armed one is disarmed when destroyed, so timers can live on the stack of whoever waits for them.
+	class Timer
+	{
+	public:
+		Timer();
+		~Timer();
+
+		bool IsArmed() const;  // false once expired
+		bool HasExpired() const;  // until armed again or cancelled; also true if due but not dispatched yet
+		bool ConsumeExpiry();  // return true once after the timer expired
+
+		Timer(const Timer&) = delete;
+		Timer& operator = (const Timer&) = delete;
+
+
+	private:
+		friend class DeviceIoEngine;
+
+		DeviceIoEngine* m_engine;  // null if not armed
+		Timer* m_prev;  // siblings in the wheel slot
+		Timer* m_next;
+		uint64_t m_dueTick;
+		bool m_hasExpired;
+	};
+
+
+	DeviceIoEngine();
+	~DeviceIoEngine();
+
+	bool IsValid() const;
+	bool Attach(HANDLE file);  // route the completions of file's overlapped operations here; once per file
+
+	// dispatch what has completed or expired, waiting for up to timeout milliseconds, or until the next timer is
+	// due, if there is nothing yet. return false if the port failed
+	bool Pump(DWORD timeout);
+
+	void ArmTimer(Timer& timer, std::chrono::microseconds delay);  // rounded up to the wheel's resolution
+	void CancelTimer(Timer& timer);
+
+	// signals are bits of the caller's choosing. raising any wakes up Pump(); they stay raised until taken, even if
+	// a nested Pump(), e.g. of a synchronous read, has consumed the wake-up.
+	void Signal(uint32_t signals);
+	bool HasSignals() const;
+	uint32_t TakeSignals();
+
+	DeviceIoEngine(const DeviceIoEngine&) = delete;
+	DeviceIoEngine& operator = (const DeviceIoEngine&) = delete;
+
+
+private:
+	// a hashed timing wheel: arming and cancelling are O(1), and a timer due more than a revolution ahead waits in
+	// its slot for the revolutions in between. the timers in use are few and short, so a small wheel does.
+	static constexpr unsigned int k_wheelSlots = 256;  // a power of two
+	static constexpr uint64_t k_tickMicroseconds = 1000;
+	static constexpr unsigned int k_maxCompletionsPerPump = 16;
+
+	static uint64_t GetCurrentTick();
+	DWORD GetTimerWait(uint64_t now) const;  // milliseconds until the next timer is due; INFINITE if none is armed
+	void ExpireTimers(uint64_t now);
+	void Unlink(Timer& timer);
+
+
+	AutoHandle m_port;
+	std::atomic<uint32_t> m_signals;
+	Timer* m_wheel[k_wheelSlots];  // heads of each slot's list
+	uint64_t m_currentTick;  // every timer due up to this has expired
+	unsigned int m_numArmedTimers;
+};
@@ -0,0 +1,137 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "Keystrokes.h"
+
+#include <iterator>
+
+
+
+namespace
+{
+
+
+struct ButtonKey
+{
+	WORD button;
+	WORD virtualKey;
+};
+
+constexpr ButtonKey k_buttonKeys[] = {
+	{ XINPUT_GAMEPAD_A, VK_PAD_A },
+	{ XINPUT_GAMEPAD_B, VK_PAD_B },
+	{ XINPUT_GAMEPAD_X, VK_PAD_X },
+	{ XINPUT_GAMEPAD_Y, VK_PAD_Y },
+	{ XINPUT_GAMEPAD_RIGHT_SHOULDER, VK_PAD_RSHOULDER },
+	{ XINPUT_GAMEPAD_LEFT_SHOULDER, VK_PAD_LSHOULDER },
+	{ XINPUT_GAMEPAD_DPAD_UP, VK_PAD_DPAD_UP },
+	{ XINPUT_GAMEPAD_DPAD_DOWN, VK_PAD_DPAD_DOWN },
+	{ XINPUT_GAMEPAD_DPAD_LEFT, VK_PAD_DPAD_LEFT },
+	{ XINPUT_GAMEPAD_DPAD_RIGHT, VK_PAD_DPAD_RIGHT },
+	{ XINPUT_GAMEPAD_START, VK_PAD_START },
+	{ XINPUT_GAMEPAD_BACK, VK_PAD_BACK },
+	{ XINPUT_GAMEPAD_LEFT_THUMB, VK_PAD_LTHUMB_PRESS },
+	{ XINPUT_GAMEPAD_RIGHT_THUMB, VK_PAD_RTHUMB_PRESS }
+};
+
+
+// the thumbstick key codes of both sticks are laid out alike: up, down, right, left, up-left, up-right, down-right, down-left
+WORD GetThumbKey(WORD firstKey, SHORT x, SHORT y, SHORT deadZone)
+{
+	const bool up = y > deadZone;
+	const bool down = y < -deadZone;
+	const bool right = x > deadZone;
+	const bool left = x < -deadZone;
+
+	if (up)
+		return firstKey + (left ? 4 : right ? 5 : 0);
+	else if (down)
+		return firstKey + (right ? 6 : left ? 7 : 1);
+	else if (right)
+		return firstKey + 2;
+	else if (left)
+		return firstKey + 3;
+	else
+		return 0;
+}
+
+
+}  // unnamed namespace
+
+
+
+KeystrokeGenerator::KeystrokeGenerator(BYTE userIndex)
+	: m_userIndex(userIndex)
+	, m_keys()
+{
+	static_assert(std::size(k_buttonKeys) == k_numButtons);
+}
+
+void KeystrokeGenerator::Update(const XINPUT_GAMEPAD& gamepad, uint64_t now, SpmcQueue<XINPUT_KEYSTROKE>& output)
+{
+	WORD pressedKeys[k_numKeys];
+	for (unsigned int i = 0; i < k_numButtons; ++i)
+		pressedKeys[i] = (gamepad.wButtons & k_buttonKeys[i].button) != 0 ? k_buttonKeys[i].virtualKey : 0;
+	pressedKeys[k_numButtons + 0] = gamepad.bLeftTrigger > XINPUT_GAMEPAD_TRIGGER_THRESHOLD ? VK_PAD_LTRIGGER : 0;
+	pressedKeys[k_numButtons + 1] = gamepad.bRightTrigger > XINPUT_GAMEPAD_TRIGGER_THRESHOLD ? VK_PAD_RTRIGGER : 0;
+	pressedKeys[k_numButtons + 2] = GetThumbKey(VK_PAD_LTHUMB_UP, gamepad.sThumbLX, gamepad.sThumbLY, XINPUT_GAMEPAD_LEFT_THUMB_DEADZONE);
+	pressedKeys[k_numButtons + 3] = GetThumbKey(VK_PAD_RTHUMB_UP, gamepad.sThumbRX, gamepad.sThumbRY, XINPUT_GAMEPAD_RIGHT_THUMB_DEADZONE);
+
+	for (unsigned int i = 0; i < k_numKeys; ++i)
+	{
+		KeyState& key = m_keys[i];
+		if (key.virtualKey != pressedKeys[i])
+		{
+			// a thumbstick rolling from one direction to another releases the old key before pressing the new one
+			if (key.virtualKey != 0)
+				Push(key.virtualKey, XINPUT_KEYSTROKE_KEYUP, output);
+			if (pressedKeys[i] != 0)
+				Push(pressedKeys[i], XINPUT_KEYSTROKE_KEYDOWN, output);
+
+			key.virtualKey = pressedKeys[i];
+			key.nextRepeatTime = now + k_repeatDelay;
+		}
+		else if (key.virtualKey != 0 && now >= key.nextRepeatTime)
+		{
+			Push(key.virtualKey, XINPUT_KEYSTROKE_KEYDOWN | XINPUT_KEYSTROKE_REPEAT, output);
+			key.nextRepeatTime = now + k_repeatInterval;
+		}
+	}
+}
+
+void KeystrokeGenerator::ReleaseAll(SpmcQueue<XINPUT_KEYSTROKE>& output)
+{
+	for (KeyState& key : m_keys)
+	{
+		if (key.virtualKey != 0)
+			Push(key.virtualKey, XINPUT_KEYSTROKE_KEYUP, output);
+		key.virtualKey = 0;
+	}
+}
+
+void KeystrokeGenerator::Push(WORD virtualKey, WORD flags, SpmcQueue<XINPUT_KEYSTROKE>& output) const
+{
+	XINPUT_KEYSTROKE keystroke;
+	keystroke.VirtualKey = virtualKey;
+	keystroke.Unicode = 0;
+	keystroke.Flags = flags;
+	keystroke.UserIndex = m_userIndex;
+	keystroke.HidCode = 0;
+	output.Push(keystroke);  // dropped if nobody has been popping for a while
+}
@@ -0,0 +1,64 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+
+#include <windows.h>
+#include <xinput.h>
+
+#include "SpmcQueue.h"
+
+
+
+// turns successive gamepad states into the XINPUT_KEYSTROKE events that XInputGetKeystroke() reports.
+// buttons and triggers are keys of their own, while each thumbstick acts as a single key whose virtual key code
+// follows the direction it's pushed in.
+class KeystrokeGenerator
+{
+public:
+	static constexpr uint64_t k_repeatDelay = 400;  // ms; a held key starts repeating after this long
+	static constexpr uint64_t k_repeatInterval = 100;  // ms
+
+
+	explicit KeystrokeGenerator(BYTE userIndex);
+
+	// push an event for every key whose state changed since the last call, and repeats for keys being held
+	void Update(const XINPUT_GAMEPAD& gamepad, uint64_t now, SpmcQueue<XINPUT_KEYSTROKE>& output);
+	void ReleaseAll(SpmcQueue<XINPUT_KEYSTROKE>& output);  // key-ups for everything held, e.g. when the device is gone
+
+
+private:
+	static constexpr unsigned int k_numButtons = 14;
+	static constexpr unsigned int k_numKeys = k_numButtons + 4;  // + triggers and thumbsticks
+
+	struct KeyState
+	{
+		WORD virtualKey;  // 0 if released
+		uint64_t nextRepeatTime;
+	};
+
+
+	void Push(WORD virtualKey, WORD flags, SpmcQueue<XINPUT_KEYSTROKE>& output) const;
+
+
+	const BYTE m_userIndex;
+	KeyState m_keys[k_numKeys];
+};
@@ -18,31 +18,23 @@
 
 #include "LightWeightMutex.h"
 
-#include <windows.h>
-
 
 LWMutex::LWMutex()
-	: m_cs(new CRITICAL_SECTION)
-{
-	InitializeCriticalSection(m_cs.get());
-}
-
-LWMutex::~LWMutex()
+	: m_srwLock(SRWLOCK_INIT)
 {
-	DeleteCriticalSection(m_cs.get());
 }
 
 void LWMutex::lock()
 {
-	EnterCriticalSection(m_cs.get());
+	AcquireSRWLockExclusive(&m_srwLock);
 }
 
 bool LWMutex::try_lock()
 {
-	return TryEnterCriticalSection(m_cs.get()) != FALSE;
+	return TryAcquireSRWLockExclusive(&m_srwLock) != FALSE;
 }
 
 void LWMutex::unlock()
 {
-	LeaveCriticalSection(m_cs.get());
+	ReleaseSRWLockExclusive(&m_srwLock);
 }
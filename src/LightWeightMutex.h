@@ -18,22 +18,23 @@
 
 #pragma once
 
-#include <memory>
+#include <windows.h>
 
 
-struct _RTL_CRITICAL_SECTION;
-
-
-// can be used with std::scoped_lock
+// can be used with std::scoped_lock. a slim reader/writer lock used exclusively; it's pointer-sized, needs no
+// allocation nor clean-up, and an uncontended lock/unlock pair is one interlocked operation each.
+// unlike a critical section it isn't recursive, so a thread must not lock it twice.
 class LWMutex
 {
 public:
 	LWMutex();
-	~LWMutex();
 	void lock();
 	bool try_lock();
 	void unlock();
 
+	LWMutex(const LWMutex&) = delete;
+	LWMutex& operator = (const LWMutex&) = delete;
+
 private:
-	std::unique_ptr<_RTL_CRITICAL_SECTION> m_cs;
+	SRWLOCK m_srwLock;
 };
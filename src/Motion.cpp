@@ -0,0 +1,115 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Motion.h"
+
+#include <emmintrin.h>
+
+
+
+namespace
+{
+
+
+constexpr float k_accelRange = 4.f;  // G at MotionCalibration::accelSensitivity
+constexpr float k_gyroRange = 936.f;  // degrees per second at MotionCalibration::gyroSensitivity
+
+
+float GetScale(int16_t origin, int16_t sensitivity, float range)
+{
+	const int span = sensitivity - origin;
+	return span != 0 ? range / static_cast<float>(span) : 0.f;  // broken calibration reads as no motion
+}
+
+
+}  // unnamed namespace
+
+
+
+MotionDecoder::MotionDecoder()
+	: MotionDecoder(k_defaultCalibration)
+{
+}
+
+MotionDecoder::MotionDecoder(const MotionCalibration& calibration)
+	: m_scales()
+	, m_biases()
+{
+	SetCalibration(calibration);
+}
+
+void MotionDecoder::SetCalibration(const MotionCalibration& calibration)
+{
+	// the lanes repeat the frame layout; those past the last frame are computed and thrown away
+	for (unsigned int i = 0; i < k_numLanes; ++i)
+	{
+		const unsigned int axis = i % 3;
+		const bool isAccel = i % k_valuesPerFrame < 3;
+		const int16_t origin = isAccel ? calibration.accelOrigin[axis] : calibration.gyroOrigin[axis];
+		const int16_t sensitivity = isAccel ? calibration.accelSensitivity[axis] : calibration.gyroSensitivity[axis];
+		m_scales[i] = GetScale(origin, sensitivity, isAccel ? k_accelRange : k_gyroRange);
+		m_biases[i] = origin * m_scales[i];
+	}
+}
+
+void MotionDecoder::Decode(const Packet& packet, __out HAGR_MOTION_SAMPLE (&result)[k_framesPerPacket]) const
+{
+	// the loads run past the frames into the rest of the packet, which is still within its 64 bytes
+	static_assert(sizeof(PacketType) + sizeof(DeviceSubPacket::CommonStates) + k_numLanes * sizeof(int16_t) <= sizeof(Packet));
+	static_assert(sizeof(HAGR_MOTION_SAMPLE::acceleration) + sizeof(HAGR_MOTION_SAMPLE::angularVelocity) == k_valuesPerFrame * sizeof(float));
+
+	const auto* raw = reinterpret_cast<const __m128i*>(packet.GetSubPacket<PacketType::Device_FullStates>().motion);
+	alignas(16) float values[k_numLanes];
+	for (unsigned int i = 0; i < k_numLanes / 8; ++i)
+	{
+		// sign-extend by moving each word to the top of a dword and shifting it back down
+		const __m128i words = _mm_loadu_si128(raw + i);
+		const __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+		const __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16);
+
+		float* output = values + i * 8;
+		_mm_store_ps(output, _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(low), _mm_load_ps(m_scales + i * 8)), _mm_load_ps(m_biases + i * 8)));
+		_mm_store_ps(output + 4, _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(high), _mm_load_ps(m_scales + i * 8 + 4)), _mm_load_ps(m_biases + i * 8 + 4)));
+	}
+
+	for (unsigned int frame = 0; frame < k_framesPerPacket; ++frame)
+	{
+		const float* frameValues = values + frame * k_valuesPerFrame;
+		for (unsigned int axis = 0; axis < 3; ++axis)
+		{
+			result[frame].acceleration[axis] = frameValues[axis];
+			result[frame].angularVelocity[axis] = frameValues[3 + axis];
+		}
+	}
+}
+
+void MotionDecoder::DecodeReference(const MotionCalibration& calibration, const Packet& packet, __out HAGR_MOTION_SAMPLE (&result)[k_framesPerPacket])
+{
+	const auto& states = packet.GetSubPacket<PacketType::Device_FullStates>();
+	for (unsigned int frame = 0; frame < k_framesPerPacket; ++frame)
+	{
+		const auto& motion = states.motion[frame];
+		for (unsigned int axis = 0; axis < 3; ++axis)
+		{
+			const int16_t accelOrigin = calibration.accelOrigin[axis];
+			const int16_t gyroOrigin = calibration.gyroOrigin[axis];
+			result[frame].acceleration[axis] = (motion.accel[axis] - accelOrigin) * GetScale(accelOrigin, calibration.accelSensitivity[axis], k_accelRange);
+			result[frame].angularVelocity[axis] = (motion.gyro[axis] - gyroOrigin) * GetScale(gyroOrigin, calibration.gyroSensitivity[axis], k_gyroRange);
+		}
+	}
+}
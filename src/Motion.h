@@ -0,0 +1,74 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <windows.h>
+
+#include "ProInternals.h"
+#include "hagr.h"
+
+
+
+// motion sensor calibration exactly as stored in SPI flash, in raw device units along the device's own axes
+struct MotionCalibration
+{
+	int16_t accelOrigin[3];
+	int16_t accelSensitivity[3];  // reading at 4 G
+	int16_t gyroOrigin[3];
+	int16_t gyroSensitivity[3];  // reading at 936 degrees per second
+};
+
+
+// converts the motion frames of full state packets into physical units. the 18 values of a packet are
+// converted together with SSE2, so the cost doesn't depend on how the calibration scales them.
+class MotionDecoder
+{
+public:
+	static constexpr unsigned int k_framesPerPacket = 3;
+
+	// nominal values of the sensors; used for whatever the flash doesn't have
+	static constexpr MotionCalibration k_defaultCalibration = {
+		{ 0, 0, 0 },
+		{ 16384, 16384, 16384 },
+		{ 0, 0, 0 },
+		{ 13371, 13371, 13371 }
+	};
+
+
+	MotionDecoder();  // for k_defaultCalibration
+	explicit MotionDecoder(const MotionCalibration& calibration);
+
+	void SetCalibration(const MotionCalibration& calibration);
+	// packet must be of PacketType::Device_FullStates. timestamps of result are left untouched
+	void Decode(const Packet& packet, __out HAGR_MOTION_SAMPLE (&result)[k_framesPerPacket]) const;
+
+	// straightforward conversion the vectorized one is derived from; kept for verification and benchmarks
+	static void DecodeReference(const MotionCalibration& calibration, const Packet& packet, __out HAGR_MOTION_SAMPLE (&result)[k_framesPerPacket]);
+
+
+private:
+	static constexpr unsigned int k_valuesPerFrame = 6;  // acceleration followed by angular velocity
+	static constexpr unsigned int k_numLanes = 24;  // the 18 values rounded up to whole 8-value loads
+
+
+	alignas(16) float m_scales[k_numLanes];
+	alignas(16) float m_biases[k_numLanes];  // origin times scale
+};
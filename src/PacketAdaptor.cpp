@@ -0,0 +1,199 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "PacketAdaptor.h"
+
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+
+
+namespace
+{
+
+
+constexpr uint8_t k_batteryType = BATTERY_TYPE_NIMH;  // doesn't really matter so we hard-code this
+
+
+template <typename T1, typename T2>
+constexpr bool IsSet(T1 val, T2 index)
+{
+	return ((static_cast<uint64_t>(val) >> static_cast<uint8_t>(index)) & 1) == 1;
+}
+
+
+uint8_t DecodeBatteryLevel(uint8_t batteryAndWired)
+{
+	// 0 is EMPTY; remap the rest [1-8] to [1-3], where BATTERY_LEVEL_LOW=1, MEDIUM=2, FULL=3
+	const uint8_t battery = batteryAndWired >> 4;
+	if (battery >= 7)
+		return BATTERY_LEVEL_FULL;
+	else if (battery >= 4)
+		return BATTERY_LEVEL_MEDIUM;
+	else if (battery >= 1)
+		return BATTERY_LEVEL_LOW;
+	else
+		return BATTERY_LEVEL_EMPTY;
+}
+
+
+constexpr ButtonTable k_defaultButtons(PacketAdaptor::k_defaultProfile);
+
+constexpr AxisTable k_defaultLeftX(PacketAdaptor::k_defaultCalibration.leftX);
+constexpr AxisTable k_defaultLeftY(PacketAdaptor::k_defaultCalibration.leftY);
+constexpr AxisTable k_defaultRightX(PacketAdaptor::k_defaultCalibration.rightX);
+constexpr AxisTable k_defaultRightY(PacketAdaptor::k_defaultCalibration.rightY);
+
+
+}  // unnamed namespace
+
+
+
+PacketAdaptor::PacketAdaptor()
+	: m_profile(k_defaultProfile)
+	, m_buttons(k_defaultButtons)
+	, m_leftX(k_defaultLeftX)
+	, m_leftY(k_defaultLeftY)
+	, m_rightX(k_defaultRightX)
+	, m_rightY(k_defaultRightY)
+{
+	VerifyTables(k_defaultCalibration);
+}
+
+PacketAdaptor::PacketAdaptor(const MappingProfile& profile)
+	: m_profile(profile)
+	, m_buttons(profile == k_defaultProfile ? k_defaultButtons : ButtonTable(profile))
+	, m_leftX(profile.stickDeadzonePercent == 0 ? k_defaultLeftX : AxisTable(k_defaultCalibration.leftX, profile.stickDeadzonePercent))
+	, m_leftY(profile.stickDeadzonePercent == 0 ? k_defaultLeftY : AxisTable(k_defaultCalibration.leftY, profile.stickDeadzonePercent))
+	, m_rightX(profile.stickDeadzonePercent == 0 ? k_defaultRightX : AxisTable(k_defaultCalibration.rightX, profile.stickDeadzonePercent))
+	, m_rightY(profile.stickDeadzonePercent == 0 ? k_defaultRightY : AxisTable(k_defaultCalibration.rightY, profile.stickDeadzonePercent))
+{
+	VerifyTables(k_defaultCalibration);
+}
+
+PacketAdaptor::PacketAdaptor(const StickCalibration& calibration)
+	: m_profile(k_defaultProfile)
+	, m_buttons(k_defaultButtons)
+	, m_leftX(calibration.leftX)
+	, m_leftY(calibration.leftY)
+	, m_rightX(calibration.rightX)
+	, m_rightY(calibration.rightY)
+{
+	VerifyTables(calibration);
+}
+
+void PacketAdaptor::SetCalibration(const StickCalibration& calibration)
+{
+	// the profile's deadzone is baked into the tables along with the calibration
+	m_leftX = AxisTable(calibration.leftX, m_profile.stickDeadzonePercent);
+	m_leftY = AxisTable(calibration.leftY, m_profile.stickDeadzonePercent);
+	m_rightX = AxisTable(calibration.rightX, m_profile.stickDeadzonePercent);
+	m_rightY = AxisTable(calibration.rightY, m_profile.stickDeadzonePercent);
+	VerifyTables(calibration);
+}
+
+void PacketAdaptor::Translate(const Packet& packet, __out XINPUT_STATE& outputStates, __out XINPUT_BATTERY_INFORMATION& outputBattery) const
+{
+	assert(packet.type == PacketType::Device_FullStates);
+	const auto& gameStates = packet.GetSubPacket<PacketType::Device_FullStates>();
+
+	outputStates.dwPacketNumber = gameStates.timestamp;
+
+	const auto [leftX, leftY] = gameStates.leftStick.Split();
+	const auto [rightX, rightY] = gameStates.rightStick.Split();
+	outputStates.Gamepad.sThumbLX = m_leftX[leftX];
+	outputStates.Gamepad.sThumbLY = m_leftY[leftY];
+	outputStates.Gamepad.sThumbRX = m_rightX[rightX];
+	outputStates.Gamepad.sThumbRY = m_rightY[rightY];
+
+	// a set trigger bit becomes 0xFF without branching
+	const uint32_t mapped = m_buttons.Map(gameStates.keys);
+	outputStates.Gamepad.bLeftTrigger = static_cast<BYTE>(0 - ((mapped & k_leftTriggerBit) >> 16));
+	outputStates.Gamepad.bRightTrigger = static_cast<BYTE>(0 - ((mapped & k_rightTriggerBit) >> 17));
+	outputStates.Gamepad.wButtons = static_cast<WORD>(mapped);
+
+	outputBattery.BatteryType = k_batteryType;
+	outputBattery.BatteryLevel = DecodeBatteryLevel(gameStates.batteryAndWired);
+}
+
+uint32_t PacketAdaptor::MapKeys(const Packet& packet) const
+{
+	assert(packet.type == PacketType::Device_FullStates);
+	return m_buttons.Map(packet.GetSubPacket<PacketType::Device_FullStates>().keys);
+}
+
+void PacketAdaptor::TranslateReference(const StickCalibration& calibration, const MappingProfile& profile, const Packet& packet, __out XINPUT_STATE& outputStates, __out XINPUT_BATTERY_INFORMATION& outputBattery)
+{
+	assert(packet.type == PacketType::Device_FullStates);
+	const auto& gameStates = packet.GetSubPacket<PacketType::Device_FullStates>();
+
+	outputStates.dwPacketNumber = gameStates.timestamp;
+
+	const auto [leftX, leftY] = gameStates.leftStick.Split();
+	const auto [rightX, rightY] = gameStates.rightStick.Split();
+	outputStates.Gamepad.sThumbLX = AxisTable::RemapAxis(calibration.leftX, profile.stickDeadzonePercent, leftX);
+	outputStates.Gamepad.sThumbLY = AxisTable::RemapAxis(calibration.leftY, profile.stickDeadzonePercent, leftY);
+	outputStates.Gamepad.sThumbRX = AxisTable::RemapAxis(calibration.rightX, profile.stickDeadzonePercent, rightX);
+	outputStates.Gamepad.sThumbRY = AxisTable::RemapAxis(calibration.rightY, profile.stickDeadzonePercent, rightY);
+
+	const uint32_t buttons = gameStates.keys;
+	uint32_t mapped = 0;
+	for (unsigned int i = 0; i < MappingProfile::k_numKeys; ++i)
+		mapped |= IsSet(buttons, i) ? profile.keyBits[i] : 0;
+	outputStates.Gamepad.bLeftTrigger = (mapped & k_leftTriggerBit) != 0 ? 0xFF : 0;
+	outputStates.Gamepad.bRightTrigger = (mapped & k_rightTriggerBit) != 0 ? 0xFF : 0;
+	outputStates.Gamepad.wButtons = static_cast<WORD>(mapped & 0xFFFF);
+
+	outputBattery.BatteryType = k_batteryType;
+	outputBattery.BatteryLevel = DecodeBatteryLevel(gameStates.batteryAndWired);
+}
+
+void PacketAdaptor::VerifyTables([[maybe_unused]] const StickCalibration& calibration) const
+{
+#ifdef _DEBUG
+	// every raw axis value and every single key must translate exactly like the reference does
+	Packet packet;
+	ZeroMemory(&packet, sizeof(packet));
+	packet.type = PacketType::Device_FullStates;
+	auto& gameStates = packet.GetSubPacket<PacketType::Device_FullStates>();
+
+	for (unsigned int i = 0; i < AxisTable::k_size; ++i)
+	{
+		const uint8_t splitBytes[] = {
+			static_cast<uint8_t>(i & 0xFF),
+			static_cast<uint8_t>(((i >> 8) & 0xF) | ((i & 0xF) << 4)),
+			static_cast<uint8_t>(i >> 4)
+		};
+		memcpy(gameStates.leftStick.bytes, splitBytes, sizeof(splitBytes));
+		memcpy(gameStates.rightStick.bytes, splitBytes, sizeof(splitBytes));
+
+		const uint32_t keys = i < 24 ? (1u << i) : i;
+		gameStates.keys.bytes[0] = static_cast<uint8_t>(keys);
+		gameStates.keys.bytes[1] = static_cast<uint8_t>(keys >> 8);
+		gameStates.keys.bytes[2] = static_cast<uint8_t>(keys >> 16);
+
+		XINPUT_STATE result = {};
+		XINPUT_STATE expected = {};
+		XINPUT_BATTERY_INFORMATION battery;
+		Translate(packet, result, battery);
+		TranslateReference(calibration, m_profile, packet, expected, battery);
+		assert(memcmp(&result, &expected, sizeof(result)) == 0);
+	}
+#endif  // _DEBUG
+}
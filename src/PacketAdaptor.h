@@ -0,0 +1,225 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include <windows.h>
+#include <xinput.h>
+
+#include "ProInternals.h"
+
+
+
+// calibration of a single stick axis in raw 12-bit device units
+struct AxisCalibration
+{
+	int16_t max;
+	int16_t min;
+	int16_t neutral;
+};
+
+struct StickCalibration
+{
+	AxisCalibration leftX;
+	AxisCalibration leftY;
+	AxisCalibration rightX;
+	AxisCalibration rightY;
+};
+
+
+// what every key of the device turns into, and how much of each stick's travel around neutral reads as 0
+struct MappingProfile
+{
+	static constexpr unsigned int k_numKeys = 24;  // bits of the key field
+
+	uint32_t keyBits[k_numKeys];  // PacketAdaptor::MapKeys() bits of every key, indexed by Buttons; 0 leaves a key unbound
+	uint8_t stickDeadzonePercent;  // of the travel from neutral; what's beyond it is stretched over the full range
+
+
+	constexpr bool operator == (const MappingProfile& other) const
+	{
+		for (unsigned int i = 0; i < k_numKeys; ++i)
+		{
+			if (keyBits[i] != other.keyBits[i])
+				return false;
+		}
+		return stickDeadzonePercent == other.stickDeadzonePercent;
+	}
+};
+
+
+// XInput value of every raw 12-bit axis value
+class AxisTable
+{
+public:
+	static constexpr unsigned int k_size = 1 << 12;
+
+
+	constexpr AxisTable(const AxisCalibration& calibration, uint8_t deadzonePercent = 0)
+		: m_values()
+	{
+		for (unsigned int i = 0; i < k_size; ++i)
+			m_values[i] = RemapAxis(calibration, deadzonePercent, static_cast<uint16_t>(i));
+	}
+
+	__forceinline int16_t operator [] (uint16_t value) const
+	{
+		return m_values[value & (k_size - 1)];
+	}
+
+	// the formula the table is built from
+	static constexpr int16_t RemapAxis(const AxisCalibration& calibration, uint8_t deadzonePercent, uint16_t value)
+	{
+		const float signedVal = static_cast<float>(std::clamp(static_cast<int16_t>(value), calibration.min, calibration.max) - calibration.neutral);
+		const float deadzone = deadzonePercent / 100.f;
+		if (signedVal > 0.f)
+		{
+			const float rangeOrig = static_cast<float>(calibration.max - calibration.neutral);
+			const float invRangeOrig = 1.f / rangeOrig;
+			return static_cast<int16_t>(ApplyDeadzone(signedVal * invRangeOrig, deadzone) * 0x7FFF);
+		}
+		else if (signedVal < 0.f)
+		{
+			const float rangeOrig = static_cast<float>(calibration.neutral - calibration.min);
+			const float invRangeOrig = 1.f / rangeOrig;
+			return static_cast<int16_t>(ApplyDeadzone(signedVal * invRangeOrig, deadzone) * 0x8000);
+		}
+		else
+			return 0;
+	}
+
+
+private:
+	// normalized is in [-1, 1]. without a deadzone it comes back exactly as it went in
+	static constexpr float ApplyDeadzone(float normalized, float deadzone)
+	{
+		if (normalized > deadzone)
+			return (normalized - deadzone) / (1.f - deadzone);
+		else if (normalized < -deadzone)
+			return (normalized + deadzone) / (1.f - deadzone);
+		else
+			return 0.f;
+	}
+
+
+	int16_t m_values[k_size];
+};
+
+
+// each byte of the 24-bit key field indexes its own table. an entry holds the XInput button bits in its low word,
+// and the two binary triggers in the bits above that.
+class ButtonTable
+{
+public:
+	constexpr ButtonTable(const MappingProfile& profile)
+		: m_entries()
+	{
+		for (unsigned int byteIndex = 0; byteIndex < k_numBytes; ++byteIndex)
+		{
+			for (unsigned int value = 0; value < k_numValues; ++value)
+			{
+				for (unsigned int bit = 0; bit < 8; ++bit)
+					m_entries[byteIndex][value] |= ((value >> bit) & 1) != 0 ? profile.keyBits[byteIndex * 8 + bit] : 0;
+			}
+		}
+	}
+
+	__forceinline uint32_t Map(uint32_t keys) const
+	{
+		return m_entries[0][keys & 0xFF] | m_entries[1][(keys >> 8) & 0xFF] | m_entries[2][(keys >> 16) & 0xFF];
+	}
+
+
+private:
+	static constexpr unsigned int k_numBytes = 3;
+	static constexpr unsigned int k_numValues = 256;
+
+	uint32_t m_entries[k_numBytes][k_numValues];
+};
+
+
+// translates device packets into XInput states with precomputed tables
+class PacketAdaptor
+{
+public:
+	// measured on a single controller; sticks of other controllers are usually close enough
+	static constexpr StickCalibration k_defaultCalibration = {
+		{ 0xE20, 0x220, 0x7E0 },  // left X: max, min, neutral
+		{ 0xE20, 0x1B0, 0x7A0 },  // left Y
+		{ 0xE00, 0x230, 0x800 },  // right X
+		{ 0xE20, 0x150, 0x770 }  // right Y
+	};
+
+	// MapKeys() packs the XInput buttons in the low word and the two binary triggers in the bits above that
+	static constexpr uint32_t k_leftTriggerBit = 1 << 16;
+	static constexpr uint32_t k_rightTriggerBit = 1 << 17;
+
+	// the layout Hagr has always had: buttons where Xbox has them, not where their letters say
+	static constexpr MappingProfile k_defaultProfile = {
+		{
+			XINPUT_GAMEPAD_X,  // Y; Pro's X is at the physical position of Xbox's Y
+			XINPUT_GAMEPAD_Y,  // X
+			XINPUT_GAMEPAD_A,  // B
+			XINPUT_GAMEPAD_B,  // A
+			0, 0,
+			XINPUT_GAMEPAD_RIGHT_SHOULDER,  // R
+			k_rightTriggerBit,  // ZR; unlike XBO, Pro's triggers are binary
+			XINPUT_GAMEPAD_BACK,  // Minus
+			XINPUT_GAMEPAD_START,  // Plus
+			XINPUT_GAMEPAD_RIGHT_THUMB,  // TriggerR
+			XINPUT_GAMEPAD_LEFT_THUMB,  // TriggerL
+			0, 0,  // Home, Share
+			0, 0,
+			XINPUT_GAMEPAD_DPAD_DOWN,  // Down
+			XINPUT_GAMEPAD_DPAD_UP,  // Up
+			XINPUT_GAMEPAD_DPAD_RIGHT,  // Right
+			XINPUT_GAMEPAD_DPAD_LEFT,  // Left
+			0, 0,
+			XINPUT_GAMEPAD_LEFT_SHOULDER,  // L
+			k_leftTriggerBit  // ZL
+		},
+		0  // no deadzone
+	};
+
+
+	PacketAdaptor();  // tables for k_defaultProfile and k_defaultCalibration are built at compile time
+	explicit PacketAdaptor(const MappingProfile& profile);  // the compile-time tables are still used if profile is the default
+	explicit PacketAdaptor(const StickCalibration& calibration);
+
+	void SetCalibration(const StickCalibration& calibration);  // rebuild the stick tables
+	void Translate(const Packet& packet, __out XINPUT_STATE& outputStates, __out XINPUT_BATTERY_INFORMATION& outputBattery) const;
+	uint32_t MapKeys(const Packet& packet) const;  // buttons only; much cheaper than Translate()
+
+	// straightforward translation the tables are derived from; kept for verification and benchmarks
+	static void TranslateReference(const StickCalibration& calibration, const MappingProfile& profile, const Packet& packet, __out XINPUT_STATE& outputStates, __out XINPUT_BATTERY_INFORMATION& outputBattery);
+
+
+private:
+	void VerifyTables(const StickCalibration& calibration) const;  // debug builds only
+
+
+	MappingProfile m_profile;
+	ButtonTable m_buttons;
+	AxisTable m_leftX;
+	AxisTable m_leftY;
+	AxisTable m_rightX;
+	AxisTable m_rightY;
+};
@@ -0,0 +1,98 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <type_traits>
+
+#include "Pipes.h"
+#include "ProInternals.h"
+
+
+
+// a handler of one packet type. func is given the subpacket, plus the whole packet if it takes a second argument,
+// and may return false to stop the walk. made with HandlePacket<>().
+template <PacketType Type, typename F>
+struct PacketHandler
+{
+	using SubPacket = typename ToPacketType<Type>::type;
+	static constexpr PacketType k_type = Type;
+
+	F func;
+
+	bool operator () (const Packet& packet) const  // packet must be of k_type
+	{
+		const SubPacket& subPacket = packet.GetSubPacket<Type>();
+		if constexpr (std::is_invocable_v<const F&, const SubPacket&, const Packet&>)
+			return Invoke(subPacket, packet);
+		else
+			return Invoke(subPacket);
+	}
+
+private:
+	template <typename... Args>
+	bool Invoke(const Args&... args) const
+	{
+		if constexpr (std::is_void_v<std::invoke_result_t<const F&, const Args&...>>)
+		{
+			func(args...);
+			return true;
+		}
+		else
+			return func(args...);
+	}
+};
+
+template <PacketType Type, typename F>
+PacketHandler<Type, F> HandlePacket(const F& func)
+{
+	return PacketHandler<Type, F> { func };
+}
+
+
+template <PacketType... Types>
+constexpr bool AreDistinct()
+{
+	constexpr PacketType k_types[] = { Types... };
+	for (size_t i = 0; i < sizeof...(Types); ++i)
+	{
+		for (size_t j = i + 1; j < sizeof...(Types); ++j)
+		{
+			if (k_types[i] == k_types[j])
+				return false;
+		}
+	}
+	return true;
+}
+
+
+// walk buffer once and hand every packet to the handler of its type; packets of other types are skipped.
+// the set of handlers is fixed at compile time, so every type check is an inlined compare rather than an indirect call.
+// like IterateBuffer(), return true if a handler stopped the walk.
+template <typename... Handlers>
+bool DispatchPackets(const Buffer& buffer, const Handlers&... handlers)
+{
+	static_assert(sizeof...(Handlers) > 0);
+	static_assert(AreDistinct<Handlers::k_type...>(), "only one handler per packet type");
+
+	return IterateBuffer<Packet>(buffer, [&handlers...](const Packet& packet) {
+		bool shouldContinue = true;
+		static_cast<void>(((packet.type == Handlers::k_type && (shouldContinue = handlers(packet), true)) || ...));
+		return shouldContinue;
+	} );
+}
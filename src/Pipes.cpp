@@ -19,58 +19,154 @@
 #define NOMINMAX
 
 #include "Pipes.h"
-#include "SteadyTimer.h"
+#include "Capture.h"
 
 #include <algorithm>
 #include <mutex>
 
 
+namespace
+{
+
+
+constexpr unsigned int k_scratchBufferCount = 4;  // enough for a command round trip issued while reattaching
+constexpr std::chrono::milliseconds k_cancelTimeout(1000);
+
+
+}  // unnamed namespace
+
+
+
+BufferPool::Lease::Lease(BufferPool& pool, unsigned int blockIndex, uint32_t size)
+	: m_pool(&pool)
+	, m_blockIndex(blockIndex)
+	, m_buffer(pool.m_storage.get() + static_cast<size_t>(blockIndex) * pool.m_blockSize, size)
+{
+	ZeroMemory(m_buffer.data, m_buffer.size);
+}
+
+BufferPool::Lease::Lease(uint32_t size)
+	: m_pool(nullptr)
+	, m_blockIndex(0)
+	, m_buffer(size)
+{
+}
+
+BufferPool::Lease::~Lease()
+{
+	if (m_pool != nullptr)
+		m_pool->Release(m_blockIndex);
+}
+
+
+BufferPool::BufferPool(uint32_t blockSize, unsigned int blockCount)
+	: m_blockSize(blockSize)
+	, m_blockCount(std::min(blockCount, k_maxBlockCount))
+	, m_storage(new uint8_t[static_cast<size_t>(blockSize) * m_blockCount])
+	, m_freeBlocks(m_blockCount == k_maxBlockCount ? ~0u : (1u << m_blockCount) - 1)
+{
+	assert(blockCount <= k_maxBlockCount);
+}
+
+BufferPool::Lease BufferPool::Acquire(uint32_t size)
+{
+	if (size <= m_blockSize)
+	{
+		uint32_t freeBlocks = m_freeBlocks.load(std::memory_order_relaxed);
+		while (freeBlocks != 0)
+		{
+			const uint32_t lowestFreeBit = freeBlocks & (~freeBlocks + 1);
+			if (m_freeBlocks.compare_exchange_weak(freeBlocks, freeBlocks & ~lowestFreeBit, std::memory_order_acquire))
+			{
+				unsigned int blockIndex = 0;
+				while ((lowestFreeBit >> blockIndex) != 1)
+					++blockIndex;
+				return Lease(*this, blockIndex, size);
+			}
+		}
+	}
+
+	return Lease(size);
+}
+
+void BufferPool::Release(unsigned int blockIndex)
+{
+	m_freeBlocks.fetch_or(1u << blockIndex, std::memory_order_release);
+}
+
+
+
 class Pipe::Helper
 {
 public:
+	// issue an operation into the first idle slot. func receives the slot and returns what ReadFile()/WriteFile() returns.
 	template <typename Func>
-	static OpResult ExecuteOp(Pipe& pipe, const Func& func)
+	static OpResult IssueOp(Pipe& pipe, const Func& func)
 	{
 		if (!pipe.IsValid())
 			return { OpResultCode::InvalidFile, NO_ERROR };
-		else if (pipe.IsOpExecuting())
+		else if (pipe.m_numIssuedSlots == pipe.m_slots.size())
 			return { OpResultCode::StillExecuting, NO_ERROR };
 
-		func();
+		// a slot whose cancellation timed out stays out of use until its completion turns up
+		Slot& slot = pipe.GetSlot(pipe.m_numIssuedSlots);
+		if (slot.IsPending())
+			return { OpResultCode::StillExecuting, NO_ERROR };
+		slot.Begin();
 
-		const DWORD lastError = GetLastError();
-		if (lastError == ERROR_IO_PENDING || lastError == NO_ERROR)  // although NO_ERROR isn't expected but we still treat it as a success
-			return { OpResultCode::Success, NO_ERROR };
-		else
+		// the operation may also complete synchronously, whose completion is dispatched by the engine all the same
+		if (func(slot) != FALSE || GetLastError() == ERROR_IO_PENDING)
 		{
-			pipe.m_overlapped->Internal = 0;  // m_overlapped might be set to a bad state
-			return { OpResultCode::InvalidFile, lastError };
+			++pipe.m_numIssuedSlots;
+			return { OpResultCode::Success, NO_ERROR };
 		}
+
+		const DWORD error = GetLastError();
+		slot.Abandon();
+		return { OpResultCode::InvalidFile, error };
+	}
+
+	// forget the oldest operation, which must have completed
+	static void RetireHeadSlot(Pipe& pipe)
+	{
+		assert(pipe.m_numIssuedSlots > 0);
+		pipe.m_headSlot = (pipe.m_headSlot + 1) % pipe.m_slots.size();
+		--pipe.m_numIssuedSlots;
+	}
+
+	static bool IsAnySlotPending(const Pipe& pipe)
+	{
+		return std::any_of(pipe.m_slots.begin(), pipe.m_slots.end(), [](const auto& slot) { return slot->IsPending(); });
 	}
 };
 
 
 
-Pipe::Pipe(HANDLE file, unsigned int bufferSize)
-	: m_file(file)
-	, m_overlapped()
-	, m_buffer(new Buffer(bufferSize))
+Pipe::Slot::Slot(unsigned int bufferSize)
+	: buffer(bufferSize)
+	, result(buffer.data, 0)
 {
-	assert(m_buffer != nullptr);
+}
 
-	if (IsHandleValid(m_file))
-	{
-		m_overlapped.reset(new OVERLAPPED);
+void Pipe::Slot::OnComplete(DWORD bytesTransferred)
+{
+	result.size = std::min(static_cast<uint32_t>(bytesTransferred), buffer.size);
+}
 
-		constexpr BOOL k_autoReset = FALSE;  // we want auto-reset
-		constexpr BOOL k_initallyCleared = FALSE;
-		constexpr wchar_t* k_noEventName = nullptr;
-		HANDLE event = CreateEventW(nullptr, k_autoReset, k_initallyCleared, k_noEventName);
-		assert(event != NULL);
 
-		ZeroMemory(m_overlapped.get(), sizeof(*m_overlapped));
-		m_overlapped->hEvent = event;
-	}
+Pipe::Pipe(DeviceIoEngine& engine, unsigned int bufferSize, unsigned int slotCount)
+	: m_engine(engine)
+	, m_file(INVALID_HANDLE_VALUE)
+	, m_bufferSize(bufferSize)
+	, m_slots()
+	, m_headSlot(0)
+	, m_numIssuedSlots(0)
+{
+	assert(slotCount > 0);
+
+	m_slots.reserve(slotCount);
+	for (unsigned int i = 0; i < slotCount; ++i)
+		m_slots.emplace_back(new Slot(bufferSize));
 }
 
 Pipe::~Pipe()
@@ -78,165 +174,218 @@ Pipe::~Pipe()
 	Close();
 }
 
+void Pipe::Open(HANDLE file)
+{
+	Close();
+	m_file = file;
+}
+
+void Pipe::Close()
+{
+	CancelOp();
+	m_file = INVALID_HANDLE_VALUE;
+}
+
 Pipe::SyncResult Pipe::Sync(std::chrono::milliseconds timeout)
+{
+	DeviceIoEngine::Timer deadline;
+	if (timeout != k_syncInfinite)
+		m_engine.ArmTimer(deadline, timeout);
+	return Sync(deadline);
+}
+
+Pipe::SyncResult Pipe::Sync(const DeviceIoEngine::Timer& deadline)
 {
 	if (!IsValid())
 		return SyncResult::InvalidFile;
-	else if (IsOpExecuting())
-	{
-		const auto waitResult = WaitForSingleObject(
-			m_overlapped->hEvent,
-			timeout == k_syncInfinite ? INFINITE : static_cast<DWORD>(timeout.count())  // translate infinite case
-		);
 
-		if (waitResult == WAIT_OBJECT_0)
-			return SyncResult::Success;
-		else if (waitResult == WAIT_TIMEOUT)
+	// completions of other files dispatched meanwhile stay with their slots until those are looked at
+	while (IsOpExecuting())
+	{
+		if (deadline.HasExpired())
 			return SyncResult::StillExecuting;
-		else
+		else if (!m_engine.Pump(INFINITE))
 			return SyncResult::InvalidFile;
 	}
-	else
-		return SyncResult::Success;
+	return SyncResult::Success;
 }
 
 bool Pipe::IsOpExecuting() const
 {
-	return m_overlapped && !HasOverlappedIoCompleted(m_overlapped.get());
+	return m_numIssuedSlots > 0 && GetSlot(0).IsPending();
 }
 
 unsigned int Pipe::GetBufferSize() const
 {
-	return m_buffer->size;
+	return m_bufferSize;
 }
 
 bool Pipe::IsValid() const
 {
-	const auto isOverlappedValid = static_cast<bool>(m_overlapped);
-	[[maybe_unused]] const auto isBufferValid = static_cast<bool>(m_buffer);
-	assert(isOverlappedValid == isBufferValid);
-	return isOverlappedValid;
+	return IsHandleValid(m_file);
 }
 
-Pipe& Pipe::operator =(Pipe&& other)
+void Pipe::CancelOp()
 {
-	Close();
+	for (unsigned int i = 0; i < m_numIssuedSlots; ++i)
+	{
+		Slot& slot = GetSlot(i);
+		if (slot.IsPending())
+			CancelIoEx(m_file, slot.GetOverlapped());
+	}
 
-	m_file = other.m_file;
-	other.m_file = INVALID_HANDLE_VALUE;
-	m_overlapped = std::move(other.m_overlapped);
-	m_buffer = std::move(other.m_buffer);
+	// the kernel owns a slot until its completion has been dispatched, so it can't be reused before that.
+	// a file closed under us cancels its operations as well. the wait is bounded in case a driver doesn't let go.
+	if (Helper::IsAnySlotPending(*this))
+	{
+		DeviceIoEngine::Timer deadline;
+		m_engine.ArmTimer(deadline, k_cancelTimeout);
+		while (Helper::IsAnySlotPending(*this) && !deadline.HasExpired() && m_engine.Pump(INFINITE))
+			continue;
+	}
 
-	return *this;
+	m_headSlot = 0;
+	m_numIssuedSlots = 0;
 }
 
-void Pipe::CancelOp()
+Pipe::Slot& Pipe::GetSlot(unsigned int index)
 {
-	if (IsOpExecuting())
-		CancelIoEx(m_file, m_overlapped.get());
+	return *m_slots[(m_headSlot + index) % m_slots.size()];
 }
 
-void Pipe::Close()
+const Pipe::Slot& Pipe::GetSlot(unsigned int index) const
 {
-	if (m_overlapped)
-	{
-		CancelOp();
-		CloseHandle(m_overlapped->hEvent);
-	}
+	return *m_slots[(m_headSlot + index) % m_slots.size()];
 }
 
 
-ReadPipe::ReadPipe(HANDLE file, unsigned int bufferSize)
-	: Pipe(file, bufferSize)
-	, m_isResultConsumed(false)
+ReadPipe::ReadPipe(DeviceIoEngine& engine, unsigned int bufferSize, unsigned int queueDepth)
+	: Pipe(engine, bufferSize, queueDepth)
+	, m_isHeadViewed(false)
 {
 }
 
 Pipe::OpResult ReadPipe::Read()
 {
-	const auto result = Helper::ExecuteOp(
-		*this,
-		[this] () {
-			ReadFile(m_file, m_buffer->data, m_buffer->size, nullptr, m_overlapped.get());
-		}
-	);
+	OpResult result { OpResultCode::StillExecuting, NO_ERROR };  // every slot already has a read if none gets issued
+	while (true)
+	{
+		const auto issueResult = Helper::IssueOp(
+			*this,
+			[this] (Slot& slot) {
+				return ReadFile(m_file, slot.buffer.data, slot.buffer.size, nullptr, slot.GetOverlapped());
+			}
+		);
 
-	// because GetResult() returns StillExecuting if an operation is running, there's no worries
-	// about result from the last successful being pulled.
-	if (std::get<OpResultCode>(result) == OpResultCode::Success)
-		m_isResultConsumed = false;
+		if (std::get<OpResultCode>(issueResult) == OpResultCode::StillExecuting)
+			return result;
+		else if (std::get<OpResultCode>(issueResult) != OpResultCode::Success)
+			return issueResult;
 
-	return result;
+		result = issueResult;
+	}
 }
 
-ReadPipe::ReadResult ReadPipe::ReadSync(Buffer& outBuffer, std::chrono::milliseconds timeout)
+ReadPipe::ReadResult ReadPipe::ReadSync(std::chrono::milliseconds timeout)
 {
-	assert(outBuffer.size <= m_buffer->size);
+	DeviceIoEngine::Timer deadline;
+	if (timeout != k_syncInfinite)
+		m_engine.ArmTimer(deadline, timeout);
+	return ReadSync(deadline);
+}
 
-	const auto result = Read();
-	assert(std::get<0>(result) != OpResultCode::StillExecuting);
-	if (std::get<0>(result) == OpResultCode::Success)
+ReadPipe::ReadResult ReadPipe::ReadSync(const DeviceIoEngine::Timer& deadline)
+{
+	const auto releaseResult = ReleaseViewedSlot();
+	const auto result = std::get<OpResultCode>(releaseResult) == OpResultCode::InvalidFile ? releaseResult : Read();
+	if (std::get<OpResultCode>(result) != OpResultCode::InvalidFile)
 	{
-		const auto syncResult = Sync(timeout);
+		const auto syncResult = Sync(deadline);
 		if (syncResult == SyncResult::Success)
-			return GetResult(outBuffer);
+			return GetResult();
 		else if (syncResult == SyncResult::StillExecuting)
-			return { OpResultCode::StillExecuting, NO_ERROR, 0 };
+			return { OpResultCode::StillExecuting, NO_ERROR, nullptr };
 		else
-			return { OpResultCode::InvalidFile, GetLastError(), 0 };
+			return { OpResultCode::InvalidFile, GetLastError(), nullptr };
 	}
 
-	return { std::get<0>(result), std::get<1>(result), 0 };
+	return { std::get<0>(result), std::get<1>(result), nullptr };
 }
 
-ReadPipe::ReadResult ReadPipe::GetResult(Buffer& outBuffer)
+bool ReadPipe::IsResultReady() const
 {
-	assert(outBuffer.size <= m_buffer->size);
+	// the head slot stays issued while its data is handed out; the next one in line counts then
+	const unsigned int nextSlot = m_isHeadViewed ? 1 : 0;
+	return IsValid() && nextSlot < m_numIssuedSlots && !GetSlot(nextSlot).IsPending();
+}
 
+ReadPipe::ReadResult ReadPipe::GetResult()
+{
 	if (!IsValid())
-		return { OpResultCode::InvalidFile, NO_ERROR, 0 };
+		return { OpResultCode::InvalidFile, NO_ERROR, nullptr };
+
+	const auto releaseResult = ReleaseViewedSlot();
+	if (std::get<OpResultCode>(releaseResult) == OpResultCode::InvalidFile)
+		return { OpResultCode::InvalidFile, std::get<SystemErrorCode>(releaseResult), nullptr };
+
+	if (m_numIssuedSlots == 0)
+		return { OpResultCode::Success, NO_ERROR, nullptr };
 	else if (IsOpExecuting())
-		return { OpResultCode::StillExecuting, NO_ERROR, 0 };
+		return { OpResultCode::StillExecuting, NO_ERROR, nullptr };
+
+	// the slot is recycled on the next call whether or not the read succeeded
+	Slot& slot = GetSlot(0);
+	m_isHeadViewed = true;
 
+	// the completion callback has sized the result already; this is for the status
 	DWORD bytesRead;
-	if (m_isResultConsumed)
-	{
-		return { OpResultCode::Success, NO_ERROR, 0 };
-	}
-	else if (GetOverlappedResult(m_file, m_overlapped.get(), &bytesRead, FALSE) != 0)
+	if (GetOverlappedResult(m_file, slot.GetOverlapped(), &bytesRead, FALSE) != 0)
+		return { OpResultCode::Success, NO_ERROR, &slot.result };
+	else
+		return { OpResultCode::InvalidFile, GetLastError(), nullptr };
+}
+
+uint64_t ReadPipe::GetResultTicks() const
+{
+	return m_isHeadViewed && m_numIssuedSlots != 0 ? GetSlot(0).GetCompletionTicks() : 0;
+}
+
+Pipe::OpResult ReadPipe::ReleaseViewedSlot()
+{
+	if (!m_isHeadViewed || m_numIssuedSlots == 0)
 	{
-		m_isResultConsumed = true;
-		memcpy(
-			outBuffer.data,
-			m_buffer->data,
-			std::min(static_cast<uint32_t>(bytesRead), outBuffer.size)
-		);
-		return { OpResultCode::Success, NO_ERROR, bytesRead };  // return the valid length from last device read
+		m_isHeadViewed = false;
+		return { OpResultCode::Success, NO_ERROR };
 	}
-	else
-		return { OpResultCode::InvalidFile, GetLastError(), 0 };
+
+	m_isHeadViewed = false;
+	Helper::RetireHeadSlot(*this);
+	return Read();  // the freed slot goes back to the end of the queue
 }
 
 
-WritePipe::WritePipe(HANDLE file, unsigned int bufferSize)
-	: Pipe(file, bufferSize)
+WritePipe::WritePipe(DeviceIoEngine& engine, unsigned int bufferSize)
+	: Pipe(engine, bufferSize, 1)
 {
 }
 
 Pipe::OpResult WritePipe::Write(const Buffer& buffer)
 {
-	assert(buffer.size <= m_buffer->size);
+	assert(buffer.size <= m_bufferSize);
 
-	if (IsOpExecuting())
+	if (!IsValid())
+		return { OpResultCode::InvalidFile, NO_ERROR };
+	else if (IsOpExecuting())
 		return { OpResultCode::StillExecuting, NO_ERROR };
+	else if (m_numIssuedSlots > 0)
+		Helper::RetireHeadSlot(*this);  // last write has completed
 
-	ZeroMemory(m_buffer->data, m_buffer->size);
-	memcpy(m_buffer->data, buffer.data, buffer.size);
-
-	return Helper::ExecuteOp(
+	return Helper::IssueOp(
 		*this,
-		[this] () {
-			WriteFile(m_file, m_buffer->data, m_buffer->size, nullptr, m_overlapped.get());
+		[this, &buffer] (Slot& slot) {
+			ZeroMemory(slot.buffer.data, slot.buffer.size);
+			memcpy(slot.buffer.data, buffer.data, buffer.size);
+			return WriteFile(m_file, slot.buffer.data, slot.buffer.size, nullptr, slot.GetOverlapped());
 		}
 	);
 }
@@ -251,17 +400,46 @@ Pipe::OpResult WritePipe::WriteSync(const Buffer& buffer, std::chrono::milliseco
 }
 
 
-DeviceIoPipes::DeviceIoPipes(AutoHandle&& file, const PipeParams& pipeParams)
-	: m_file(std::move(file))
-	, m_pipeRead(m_file, pipeParams.readBufferSize)
-	, m_pipeWrite(m_file, pipeParams.writeBufferSize)
+DeviceIoPipes::DeviceIoPipes(DeviceIoEngine& engine, const PipeParams& pipeParams)
+	: m_engine(engine)
+	, m_file()
+	, m_pipeRead(engine, pipeParams.readBufferSize, std::max(pipeParams.readQueueDepth, 1u))
+	, m_pipeWrite(engine, pipeParams.writeBufferSize)
 	, m_mutexRead()
 	, m_mutexWrite()
+	, m_scratchBuffers(std::max(pipeParams.readBufferSize, pipeParams.writeBufferSize), k_scratchBufferCount)
+	, m_captureWriter(nullptr)
+	, m_captureChannel(0)
 {
 }
 
 DeviceIoPipes::~DeviceIoPipes()
 {
+	Close();
+}
+
+bool DeviceIoPipes::Open(AutoHandle&& file)
+{
+	Close();
+
+	// a file can only ever be attached to one port; one we can't drive is no use
+	std::scoped_lock lock(m_mutexRead, m_mutexWrite);
+	if (!m_engine.Attach(file))
+		return false;
+
+	m_file = std::move(file);
+	m_pipeRead.Open(m_file);
+	m_pipeWrite.Open(m_file);
+	return true;
+}
+
+void DeviceIoPipes::Close()
+{
+	// the pipes keep their slots for the next file; only what runs on them has to wind down first
+	std::scoped_lock lock(m_mutexRead, m_mutexWrite);
+	m_pipeRead.Close();
+	m_pipeWrite.Close();
+	m_file.Close();
 }
 
 Pipe::OpResult DeviceIoPipes::Read()
@@ -270,18 +448,32 @@ Pipe::OpResult DeviceIoPipes::Read()
 	return m_pipeRead.Read();
 }
 
-ReadPipe::ReadResult DeviceIoPipes::ReadSync(Buffer& outBuffer, std::chrono::milliseconds timeout)
+ReadPipe::ReadResult DeviceIoPipes::ReadSync(std::chrono::milliseconds timeout)
+{
+	DeviceIoEngine::Timer deadline;
+	if (timeout != Pipe::k_syncInfinite)
+		m_engine.ArmTimer(deadline, timeout);
+	return ReadSync(deadline);
+}
+
+ReadPipe::ReadResult DeviceIoPipes::ReadSync(const DeviceIoEngine::Timer& deadline)
 {
 	std::scoped_lock lock(m_mutexRead);
-	return m_pipeRead.ReadSync(outBuffer, timeout);
+	const auto result = m_pipeRead.ReadSync(deadline);
+	if (m_captureWriter != nullptr && std::get<const Buffer*>(result) != nullptr)
+		m_captureWriter->Record(m_captureChannel, *std::get<const Buffer*>(result));
+	return result;
 }
 
-ReadPipe::ReadResult DeviceIoPipes::PopReadResult(Buffer& outBuffer)
+ReadPipe::ReadResult DeviceIoPipes::PopReadResult()
 {
 	std::scoped_lock lock(m_mutexRead);
-	return m_file ?
-		m_pipeRead.GetResult(outBuffer) :
-		ReadPipe::ReadResult { Pipe::OpResultCode::InvalidFile, NO_ERROR, 0 };
+	const auto result = m_file ?
+		m_pipeRead.GetResult() :
+		ReadPipe::ReadResult { Pipe::OpResultCode::InvalidFile, NO_ERROR, nullptr };
+	if (m_captureWriter != nullptr && std::get<const Buffer*>(result) != nullptr)
+		m_captureWriter->Record(m_captureChannel, *std::get<const Buffer*>(result));
+	return result;
 }
 
 Pipe::OpResult DeviceIoPipes::Write(const Buffer& buffer)
@@ -310,22 +502,15 @@ Pipe::SyncResult DeviceIoPipes::SyncWrite(std::chrono::milliseconds timeout)
 
 Pipe::SyncResult DeviceIoPipes::SyncAll(std::chrono::milliseconds timeout)
 {
-	const SteadyTimer timer;
-	const auto syncReadResult = SyncRead(timeout);
+	DeviceIoEngine::Timer deadline;
+	if (timeout != Pipe::k_syncInfinite)
+		m_engine.ArmTimer(deadline, timeout);
 
+	// both directions complete through the same port, so waiting for one keeps the other's completion too.
 	// only continue if the read operation finished
-	if (syncReadResult == Pipe::SyncResult::Success)
-	{
-		const auto elaspedTime = timer.GetElapsed();
-
-		// system overhead may make usedTimeout greater than timeout in which case we consider operation timed out
-		if (timeout > elaspedTime)
-			return SyncWrite(timeout - elaspedTime);
-		else
-			return Pipe::SyncResult::StillExecuting;
-	}
-
-	return syncReadResult;
+	std::scoped_lock lock(m_mutexRead, m_mutexWrite);
+	const auto syncReadResult = m_pipeRead.Sync(deadline);
+	return syncReadResult == Pipe::SyncResult::Success ? m_pipeWrite.Sync(deadline) : syncReadResult;
 }
 
 void DeviceIoPipes::CancelRead()
@@ -334,23 +519,16 @@ void DeviceIoPipes::CancelRead()
 	m_pipeRead.CancelOp();
 }
 
-DeviceIoPipes& DeviceIoPipes::operator =(DeviceIoPipes&& other)
+BufferPool::Lease DeviceIoPipes::AcquireScratchBuffer(uint32_t size)
 {
-	std::scoped_lock lock(m_mutexRead, m_mutexWrite, other.m_mutexRead, other.m_mutexWrite);
-
-	m_pipeRead = std::move(other.m_pipeRead);
-	m_pipeWrite = std::move(other.m_pipeWrite);
-	m_file = std::move(other.m_file);
-	other.m_file = INVALID_HANDLE_VALUE;
-
-	return *this;
+	return m_scratchBuffers.Acquire(size);
 }
 
-void DeviceIoPipes::Close()
+void DeviceIoPipes::SetCapture(CaptureWriter* writer, unsigned int channel)
 {
-	// closing m_file automatically makes future operations of m_pipeRead and m_pipeWrite return InvalidFile
-	std::scoped_lock lock(m_mutexRead, m_mutexWrite);
-	m_file.Close();
+	std::scoped_lock lock(m_mutexRead);
+	m_captureWriter = writer;
+	m_captureChannel = channel;
 }
 
 unsigned int DeviceIoPipes::GetReadBufferSize() const
@@ -363,6 +541,26 @@ unsigned int DeviceIoPipes::GetWriteBufferSize() const
 	return m_pipeWrite.GetBufferSize();
 }
 
+bool DeviceIoPipes::IsReadReady() const
+{
+	return m_pipeRead.IsResultReady();
+}
+
+uint64_t DeviceIoPipes::GetReadResultTicks() const
+{
+	return m_pipeRead.GetResultTicks();
+}
+
+DeviceIoEngine& DeviceIoPipes::GetEngine() const
+{
+	return m_engine;
+}
+
+HANDLE DeviceIoPipes::GetFile() const
+{
+	return m_file;
+}
+
 bool DeviceIoPipes::IsFileValid() const
 {
 	return m_file;
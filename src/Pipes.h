@@ -18,34 +18,50 @@
 
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
 #include <memory>
 #include <tuple>
+#include <vector>
 
 #include <windows.h>
 
 #include "AutoHandle.h"
+#include "DeviceIoEngine.h"
 #include "LightWeightMutex.h"
 
 
 
+class CaptureWriter;
+
+
 struct Buffer
 {
 	uint32_t size { 0 };
 	uint8_t* data { nullptr };
+	bool isOwner { true };
 
 	Buffer(uint32_t size)
 		: size(size)
 		, data(new uint8_t[size])
+		, isOwner(true)
 	{
 		ZeroMemory(data, size);
 	}
 
+	// wraps storage owned by someone else, which must outlive the Buffer. the storage is left untouched.
+	Buffer(uint8_t* storage, uint32_t size)
+		: size(size)
+		, data(storage)
+		, isOwner(false)
+	{
+	}
+
 	~Buffer()
 	{
-		if (data != nullptr)
+		if (isOwner && data != nullptr)
 			delete[] data;
 	}
 
@@ -55,14 +71,64 @@ struct Buffer
 		assert(sizeof(T) <= size);
 		return *reinterpret_cast<T*>(data);
 	}
+
+	Buffer(const Buffer&) = delete;
+	Buffer& operator = (const Buffer&) = delete;
 };
 
 
-// return true if an invocation of func() returned false
+// a fixed number of equally-sized blocks allocated once at construction. acquiring a buffer from the pool
+// doesn't touch the heap unless every block is in use, in which case it falls back to a heap-allocated one.
+class BufferPool
+{
+public:
+	// gives exclusive access to a buffer and returns it to the pool when destroyed
+	class Lease
+	{
+	public:
+		~Lease();
+
+		Buffer& operator * () { return m_buffer; }
+		Buffer* operator -> () { return &m_buffer; }
+
+		Lease(const Lease&) = delete;
+		Lease& operator = (const Lease&) = delete;
+
+	private:
+		friend class BufferPool;
+
+		Lease(BufferPool& pool, unsigned int blockIndex, uint32_t size);  // pooled block
+		Lease(uint32_t size);  // heap fallback
+
+		BufferPool* m_pool;
+		unsigned int m_blockIndex;
+		Buffer m_buffer;
+	};
+
+	BufferPool(uint32_t blockSize, unsigned int blockCount);
+
+	Lease Acquire(uint32_t size);  // always succeeds; the returned buffer is zeroed like a newly allocated one
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator = (const BufferPool&) = delete;
+
+private:
+	static constexpr unsigned int k_maxBlockCount = 32;  // one bit for each block in m_freeBlocks
+
+	void Release(unsigned int blockIndex);
+
+	const uint32_t m_blockSize;
+	const unsigned int m_blockCount;
+	std::unique_ptr<uint8_t[]> m_storage;
+	std::atomic<uint32_t> m_freeBlocks;  // bit i is set if block i is available
+};
+
+
+// return true if an invocation of func() returned false.
+// buffer may be shorter than T, e.g., a view of a short read, in which case func() is never invoked.
 template <typename T, typename F>
 bool IterateBuffer(const Buffer& buffer, const F& func)
 {
-	assert(sizeof(T) <= buffer.size);
 	const unsigned int numOfT = buffer.size / sizeof(T);
 	for (unsigned int i = 0; i < numOfT; ++i)
 	{
@@ -75,6 +141,8 @@ bool IterateBuffer(const Buffer& buffer, const F& func)
 
 
 
+// the overlapped operations of one direction of a file, driven by a DeviceIoEngine. the slots are allocated once and
+// reused by every file the pipe is opened on, so reattaching a device doesn't allocate anything.
 class Pipe
 {
 public:
@@ -92,49 +160,81 @@ public:
 	static constexpr std::chrono::milliseconds k_syncInfinite { 0 };
 
 
-	Pipe(HANDLE file, unsigned int bufferSize);
+	Pipe(DeviceIoEngine& engine, unsigned int bufferSize, unsigned int slotCount);  // invalid until Open()
 	~Pipe();
 
-	SyncResult Sync(std::chrono::milliseconds timeout);  // return false if file is not valid or timed out
-	void CancelOp();
+	void Open(HANDLE file);  // file must be attached to the engine. whatever ran on the previous file is cancelled
+	void Close();  // cancel running operations and forget the file, which is still open afterwards
 
-	bool IsOpExecuting() const;
+	// wait for the oldest operation, pumping the engine meanwhile; return false if file is not valid or timed out.
+	// an unarmed deadline never expires
+	SyncResult Sync(std::chrono::milliseconds timeout);
+	SyncResult Sync(const DeviceIoEngine::Timer& deadline);
+	void CancelOp();  // cancel every running operation and wait for them to wind down
+
+	bool IsOpExecuting() const;  // true if the oldest operation is still running
 	unsigned int GetBufferSize() const;
-	bool IsValid() const;  // must be able to check validity as Pipe supports move operation
+	bool IsValid() const;
 
-	Pipe& operator =(Pipe&& other);
+	Pipe(const Pipe&) = delete;
+	Pipe& operator = (const Pipe&) = delete;
 
 
 protected:
 	class Helper;
 
-	void Close();  // cancel running overlapped operation and relese some resources. the file would still be open.
+	// one overlapped operation and the buffer it owns
+	struct Slot : DeviceIoEngine::Operation
+	{
+		Buffer buffer;
+		Buffer result;  // non-owning view of the valid part of buffer after a read completes
+
+		explicit Slot(unsigned int bufferSize);
+
+	protected:
+		void OnComplete(DWORD bytesTransferred) override;
+	};
 
+	Slot& GetSlot(unsigned int index);  // index is relative to m_headSlot
+	const Slot& GetSlot(unsigned int index) const;
 
+
+	DeviceIoEngine& m_engine;
 	HANDLE m_file;
-	std::unique_ptr<OVERLAPPED> m_overlapped;
-	std::unique_ptr<Buffer> m_buffer;
+	unsigned int m_bufferSize;
+	std::vector<std::unique_ptr<Slot>> m_slots;
+	unsigned int m_headSlot;  // the oldest issued operation
+	unsigned int m_numIssuedSlots;  // issued operations are consecutive, starting from m_headSlot
 };
 
 
 
+// keeps a read issued into every slot so the device always has somewhere to put its next report.
+// completed reads are handed out in the order they were issued, without copying.
 class ReadPipe : public Pipe
 {
 public:
-	using ReadResult = std::tuple<OpResultCode, SystemErrorCode, unsigned int>;
+	// the buffer pointer refers to the pipe's internal storage and is null if there's no data
+	using ReadResult = std::tuple<OpResultCode, SystemErrorCode, const Buffer*>;
 
-	ReadPipe(HANDLE file, unsigned int bufferSize);
+	ReadPipe(DeviceIoEngine& engine, unsigned int bufferSize, unsigned int queueDepth);
 
-	OpResult Read();
-	ReadResult ReadSync(Buffer& outBuffer, std::chrono::milliseconds timeout);
+	OpResult Read();  // issue a read into every idle slot
+	ReadResult ReadSync(std::chrono::milliseconds timeout);
+	ReadResult ReadSync(const DeviceIoEngine::Timer& deadline);
+	bool IsResultReady() const;  // a read has completed that GetResult() hasn't handed out yet
 
-	// for a successful read, only the first call to GetResult() returns a meaningful result.
-	// all subsequent calls without issuing another read will succeed but have zero data copied to outBuffer.
-	ReadResult GetResult(Buffer& outBuffer);
+	// returns the oldest completed read. the returned buffer stays valid until the next call to GetResult(),
+	// ReadSync() or CancelOp(), at which point its slot is reissued. if no read is issued at all, it succeeds
+	// with no data.
+	ReadResult GetResult();
+	uint64_t GetResultTicks() const;  // HighResClock time the read last handed out by GetResult() completed at; 0 if none
 
 
 private:
-	bool m_isResultConsumed;
+	OpResult ReleaseViewedSlot();  // recycle the slot whose data was last handed out
+
+	bool m_isHeadViewed;  // the head slot's data has been handed out by GetResult()
 };
 
 
@@ -142,7 +242,7 @@ private:
 class WritePipe : public Pipe
 {
 public:
-	WritePipe(HANDLE file, unsigned int bufferSize);
+	WritePipe(DeviceIoEngine& engine, unsigned int bufferSize);
 
 	OpResult Write(const Buffer& buffer);
 	OpResult WriteSync(const Buffer& buffer, std::chrono::milliseconds timeout);
@@ -157,14 +257,19 @@ public:
 	{
 		unsigned int readBufferSize;
 		unsigned int writeBufferSize;
+		unsigned int readQueueDepth;  // number of reads kept in flight; reaped in the order they were issued
 	};
 
-	DeviceIoPipes(AutoHandle&& file, const PipeParams& pipeParams);
+	DeviceIoPipes(DeviceIoEngine& engine, const PipeParams& pipeParams);  // closed until Open()
 	~DeviceIoPipes();
 
+	bool Open(AutoHandle&& file);  // close the current file, if any; return false if the engine can't drive file
+	void Close();
+
 	Pipe::OpResult Read();
-	ReadPipe::ReadResult ReadSync(Buffer& outBuffer, std::chrono::milliseconds timeout);
-	ReadPipe::ReadResult PopReadResult(Buffer& outBuffer);
+	ReadPipe::ReadResult ReadSync(std::chrono::milliseconds timeout);
+	ReadPipe::ReadResult ReadSync(const DeviceIoEngine::Timer& deadline);  // see Pipe::Sync()
+	ReadPipe::ReadResult PopReadResult();  // see ReadPipe::GetResult() for the lifetime of the returned buffer
 	Pipe::OpResult Write(const Buffer& buffer);
 	Pipe::OpResult WriteSync(const Buffer& buffer, std::chrono::milliseconds timeout);
 
@@ -173,18 +278,29 @@ public:
 	Pipe::SyncResult SyncAll(std::chrono::milliseconds timeout);
 	void CancelRead();
 
-	DeviceIoPipes& operator =(DeviceIoPipes&& other);
-	void Close();
+	// scratch buffers for building and parsing packets without hitting the heap
+	BufferPool::Lease AcquireScratchBuffer(uint32_t size);
+
+	// every successful read is also recorded into writer, which may be null to stop. it's kept across Open()
+	void SetCapture(CaptureWriter* writer, unsigned int channel);
 
 	unsigned int GetReadBufferSize() const;
 	unsigned int GetWriteBufferSize() const;
+	bool IsReadReady() const;  // a read has completed that PopReadResult() hasn't handed out yet
+	uint64_t GetReadResultTicks() const;  // see ReadPipe::GetResultTicks()
+	DeviceIoEngine& GetEngine() const;
+	HANDLE GetFile() const;  // null if closed; for device-specific calls, not for reading or writing
 	bool IsFileValid() const;
 
 
 private:
+	DeviceIoEngine& m_engine;
 	AutoHandle m_file;
 	ReadPipe m_pipeRead;
 	WritePipe m_pipeWrite;
 	LWMutex m_mutexRead;
 	LWMutex m_mutexWrite;
+	BufferPool m_scratchBuffers;
+	CaptureWriter* m_captureWriter;  // guarded by m_mutexRead
+	unsigned int m_captureChannel;
 };
@@ -16,26 +16,29 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define NOMINMAX
+
 #include "Pro.h"
 
 #include <algorithm>
-#include <functional>
-#include <optional>
+#include <cstring>
+#include <iterator>
 #include <string>
-#include <type_traits>
 
 #include <windows.h>
-#include <initguid.h>
-#include <hidclass.h>
-#include <setupapi.h>
+#include <hidsdi.h>
 
+#include "Calibration.h"
+#include "Config.h"
 #include "DebugUtils.h"
+#include "PacketAdaptor.h"
+#include "PacketDispatch.h"
 #include "Pipes.h"
 #include "ProInternals.h"
 #include "SteadyTimer.h"
 
 
-#pragma comment(lib, "setupapi.lib")
+#pragma comment(lib, "hid.lib")
 
 
 
@@ -43,80 +46,19 @@ namespace
 {
 
 
-constexpr DeviceIoPipes::PipeParams k_pipeParams = { 128, 64 };  // read = 128 B; write = 64 B
-constexpr unsigned int k_pullInterval = 15;  // ms; ~60 ticks per second seem like Pro's spec
-constexpr uint64_t k_packetTimeout = 100;  // ms; for how long the cached states are considered invalid and controller disconnected
-constexpr std::chrono::milliseconds k_cmdReplyTimeout(400);  // for how long we wait for device to reply to a certain command
-constexpr uint8_t k_batteryType = BATTERY_TYPE_NIMH;  // doesn't really matter so we hard-code this
+constexpr DeviceIoPipes::PipeParams k_pipeParams = { 128, 64, 4 };  // read = 128 B; write = 64 B; 4 reads in flight
+constexpr std::chrono::milliseconds k_vibrationRefreshInterval(40);  // the device stops a rumble by itself if it isn't refreshed
+constexpr unsigned int k_keystrokeQueueSize = 64;  // events; new ones are dropped while the queue is full
+constexpr std::chrono::milliseconds k_enableMotionRetryInterval(100);  // before EnableIMU is sent again without a reply
+constexpr std::chrono::milliseconds k_resumeTimeout(100);  // for how long an XInput call waits for a fresh report after standby
+constexpr unsigned int k_maxDiscardedReads = 64;  // more than the HID driver buffers by default plus our reads in flight
+constexpr int64_t k_reportIntervalWeight = 16;  // in reports; the moving average follows a new interval within a few dozens
 
 
-template <typename F>
-class Tearoff
+// also serves as the staleness check; a state that was never published is infinitely old
+std::chrono::microseconds GetAge(uint64_t publishTicks)
 {
-public:
-	__forceinline Tearoff(const F& func, unsigned int count)
-		: m_func(func)
-		, m_count(count)
-	{ }
-
-	__forceinline bool IsAvailable() const
-	{
-		return m_count > 0;
-	}
-
-	template <typename... Args>
-	typename std::invoke_result<F, Args...>::type operator () (Args&&... args)
-	{
-		assert(m_count > 0);
-		const auto result = m_func(std::forward<Args>(args)...);
-		--m_count;
-		return result;
-	}
-
-	template <typename... Args>
-	std::optional<typename std::invoke_result<F, Args...>::type> RunSafe(Args&&... args)
-	{
-		return IsAvailable() ? std::make_optional(operator()(std::forward<Args>(args)...)) : std::nullopt;
-	}
-
-private:
-	const F& m_func;
-	unsigned int m_count;
-};
-
-
-std::wstring FindDevicePath()
-{
-	constexpr wchar_t k_devicePathSigPro[] = L"hid#vid_057e&pid_2009";
-
-	std::wstring foundPath;
-
-	HDEVINFO hDevInfoList = SetupDiGetClassDevsW(&GUID_DEVINTERFACE_HID, nullptr, nullptr, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
-	if (hDevInfoList == INVALID_HANDLE_VALUE)
-		return foundPath;
-
-	SP_DEVINFO_DATA devInfoData { sizeof(devInfoData) };
-	for (unsigned int i = 0; SetupDiEnumDeviceInfo(hDevInfoList, i, &devInfoData) != FALSE; ++i)
-	{
-		SP_DEVICE_INTERFACE_DATA devIntfData { sizeof(devIntfData) };
-		if (SetupDiEnumDeviceInterfaces(hDevInfoList, &devInfoData, &GUID_DEVINTERFACE_HID, 0, &devIntfData))
-		{
-			constexpr unsigned int buffSize = 1024;
-			uint8_t buffer[buffSize];
-			auto* devIntfDetail = reinterpret_cast<SP_DEVICE_INTERFACE_DETAIL_DATA_W*>(buffer);
-			devIntfDetail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
-
-			if (SetupDiGetDeviceInterfaceDetailW(hDevInfoList, &devIntfData, devIntfDetail, buffSize, nullptr, nullptr) &&
-				wcsstr(devIntfDetail->DevicePath, k_devicePathSigPro) != nullptr)
-			{
-				foundPath = devIntfDetail->DevicePath;
-				break;
-			}
-		}
-	}
-
-	SetupDiDestroyDeviceInfoList(hDevInfoList);
-	return foundPath;
+	return std::chrono::microseconds(HighResClock::ToMicroseconds(HighResClock::Now() - publishTicks));
 }
 
 
@@ -137,287 +79,504 @@ HANDLE OpenDevice(const std::wstring& path)
 }
 
 
-const Packet* GetLastPacket(const Buffer& buffer)
+// these write a packet without waiting for it to go out. StillExecuting means that the previous write is still on
+// its way and nothing was written
+Pipe::OpResultCode SendHostCommand(DeviceIoPipes& devPipes, HostSubPacket::CommandCode cmdCode)
 {
-	const Packet* lastGoodPacket = nullptr;
-	const auto& funcMatch = [&lastGoodPacket](const Packet& packet) {
-		if (packet.type == PacketType::Device_FullStates)
-			lastGoodPacket = &packet;
-		return true;
-	};
+	constexpr PacketType k_packetType = PacketType::Host_Command;
+
+	auto writeBuffer = devPipes.AcquireScratchBuffer(k_pipeParams.writeBufferSize);
+	Packet& packet = *writeBuffer;
 
-	IterateBuffer<Packet>(buffer, funcMatch);
-	return lastGoodPacket;
+	ZeroMemory(&packet, sizeof(packet));
+	packet.type = k_packetType;
+	packet.GetSubPacket<k_packetType>().cmdCode = cmdCode;
+	return std::get<Pipe::OpResultCode>(devPipes.Write(*writeBuffer));
 }
 
 
+// fillArgs receives the subpacket to fill in subcommand arguments
 template <typename F>
-bool ReadUntil(DeviceIoPipes& pipes, const F& func)
+Pipe::OpResultCode WriteHostSubcommand(DeviceIoPipes& devPipes, HostSubPacket::SubcommandCode subcmdCode, uint8_t serialId, const F& fillArgs)
 {
-	bool shouldContinuePulling = true;
-	Buffer buffer(pipes.GetReadBufferSize());
-	const SteadyTimer timer;
-	while (shouldContinuePulling)
-	{
-		const auto elaspedTime = timer.GetElapsed();
-		if (elaspedTime > k_cmdReplyTimeout)
-			return false;
+	constexpr PacketType k_packetType = PacketType::Host_RumbleAndSubcommand;
 
-		const auto readResult = std::get<Pipe::OpResultCode>(pipes.ReadSync(buffer, k_cmdReplyTimeout - elaspedTime));
-		if (readResult != Pipe::OpResultCode::Success)
-			return false;  // either an erorr occurred or operation timed out
+	auto writeBuffer = devPipes.AcquireScratchBuffer(k_pipeParams.writeBufferSize);
+	Packet& packet = *writeBuffer;
 
-		DebugOutputPacket(buffer);
+	ZeroMemory(&packet, sizeof(packet));
+	packet.type = k_packetType;
+	auto& rumbleAndSubcmd = packet.GetSubPacket<k_packetType>();
+	rumbleAndSubcmd.serialId = serialId;
+	rumbleAndSubcmd.left = HostSubPacket::RumbleParam::Neutral();
+	rumbleAndSubcmd.right = HostSubPacket::RumbleParam::Neutral();
+	rumbleAndSubcmd.subcmdCode = subcmdCode;
+	fillArgs(rumbleAndSubcmd);
 
-		shouldContinuePulling = !IterateBuffer<Packet>(buffer, func);
-	}
-	return true;
+	return std::get<Pipe::OpResultCode>(devPipes.Write(*writeBuffer));
 }
 
 
-bool WaitForDeviceFullStatesPacket(DeviceIoPipes& pipes)
+Pipe::OpResultCode SendHostSubcommand(DeviceIoPipes& devPipes, HostSubPacket::SubcommandCode subcmdCode, uint8_t serialId, uint32_t subcmdData)
 {
-	return ReadUntil(pipes, [](const Packet& packet) {
-		const bool found = packet.type == PacketType::Device_FullStates;
-		return !found;  // return true to continue reading
-	} );
+	const auto& fillArgs = [subcmdData](HostSubPacket::RumbleAndSubcommand& rumbleAndSubcmd) {
+		rumbleAndSubcmd.subcmdData = subcmdData;
+	};
+	return WriteHostSubcommand(devPipes, subcmdCode, serialId, fillArgs);
 }
 
 
-bool WaitForDeviceCommandReply(DeviceIoPipes& pipes, HostSubPacket::CommandCode cmd)
+// ask for range of SPI flash; the data arrives in a subcommand reply that echoes range
+Pipe::OpResultCode RequestSPIFlash(DeviceIoPipes& devPipes, const HostSubPacket::SPIFlashRange& range)
 {
-	return ReadUntil(pipes, [cmd](const Packet& packet) {
-		const bool found = packet.type == PacketType::Device_CommandReply &&
-			packet.GetSubPacket<PacketType::Device_CommandReply>().cmdCode == cmd;
-		return !found;  // return true to continue reading
-	} );
+	const auto& fillArgs = [&range](HostSubPacket::RumbleAndSubcommand& rumbleAndSubcmd) {
+		rumbleAndSubcmd.spiFlashRange = range;
+	};
+	return WriteHostSubcommand(devPipes, HostSubPacket::SubcommandCode::ReadSPIFlash, 1, fillArgs);
 }
 
 
-bool WaitForDeviceSubcommandReply(DeviceIoPipes& pipes, HostSubPacket::SubcommandCode subcmd)
-{
-	return ReadUntil(pipes, [subcmd](const Packet& packet) {
-		const bool found = packet.type == PacketType::Device_SubcommandReply &&
-			packet.GetSubPacket<PacketType::Device_SubcommandReply>().subcmdCode == subcmd;
-		return !found;  // return true to continue reading
-	} );
-}
+}  // unnamed namespace
+
 
 
-bool SendHostCommand(DeviceIoPipes& devPipes, HostSubPacket::CommandCode cmdCode, bool readReply)
+// ----------------------------------------------------------------------------
+// ProAgent::InitSequence definitions -----------------------------------------
+
+// brings a freshly opened device into full report mode and reads its calibration. the device is probed first: if
+// it's already streaming full states it only gets its player lights, which a previous session may have set to
+// another slot. otherwise every step writes its command and
+// moves on as soon as the matching reply shows up in the read stream, so the sequence takes as long as the device
+// needs to answer rather than a fixed timeout per step. a step whose reply got lost is sent again.
+// nothing here blocks. TryUpdate() hands over whatever the device sent, and the step timer wakes the service thread
+// up, so the other agents keep being served while one device is brought up.
+class ProAgent::InitSequence
 {
-	constexpr PacketType k_packetType = PacketType::Host_Command;
+public:
+	explicit InitSequence(DeviceIoPipes& devPipes)
+		: m_devPipes(devPipes)
+		, m_stepTimer()
+		, m_playerLEDMask(0)
+		, m_step(Step::Done)
+		, m_numAttempts(0)
+		, m_isStepWritten(false)
+		, m_hasRunHandshake(false)
+		, m_hasDeviceId(false)
+		, m_deviceId()
+		, m_stickCalibration(PacketAdaptor::k_defaultCalibration)
+		, m_motionCalibration(MotionDecoder::k_defaultCalibration)
+		, m_numFlashReads(0)
+		, m_startTicks(0)
+		, m_initMicroseconds(0)
+	{ }
 
-	Buffer writeBuffer(k_pipeParams.writeBufferSize);
-	Packet& packet = writeBuffer;
+	// on a freshly opened device; return false if it failed right away.
+	// the low nibble of playerLEDMask lights up LEDs 1 through 4
+	bool Start(uint32_t playerLEDMask)
+	{
+		m_playerLEDMask = playerLEDMask;
+		m_hasRunHandshake = false;
+		m_hasDeviceId = false;
+		m_stickCalibration = PacketAdaptor::k_defaultCalibration;
+		m_motionCalibration = MotionDecoder::k_defaultCalibration;
+		m_numFlashReads = 0;
+		m_startTicks = HighResClock::Now();
+		m_initMicroseconds = 0;
+
+		// every reply arrives through the reads, which are kept issued from here on
+		if (std::get<Pipe::OpResultCode>(m_devPipes.Read()) == Pipe::OpResultCode::InvalidFile)
+			return false;
+		return EnterStep(Step::Probe);
+	}
 
-	ZeroMemory(&packet, sizeof(packet));
-	packet.type = k_packetType;
-	packet.GetSubPacket<k_packetType>().cmdCode = cmdCode;
-	const auto writeResult = devPipes.WriteSync(writeBuffer, Pipe::k_syncInfinite);
-	if (std::get<Pipe::OpResultCode>(writeResult) != Pipe::OpResultCode::Success)
-		return false;
+	void Cancel()  // the device went away halfway
+	{
+		m_devPipes.GetEngine().CancelTimer(m_stepTimer);
+		m_step = Step::Done;
+	}
 
-	if (readReply && !WaitForDeviceCommandReply(devPipes, cmdCode))
-		return false;
+	bool IsRunning() const
+	{
+		return m_step != Step::Done;
+	}
 
-	return true;
-}
+	// these return false if the device failed or a step ran out of attempts
+	bool OnRead(const Buffer& buffer)  // every read that completes while running, in arrival order
+	{
+		bool isOk = true;
+		const auto& shouldContinue = [this, &isOk](bool isHandled) {
+			isOk = isHandled;
+			return isOk && IsRunning();  // return true to keep iterating
+		};
+		DispatchPackets(buffer,
+			HandlePacket<PacketType::Device_CommandReply>([this, &shouldContinue](const DeviceSubPacket::CommandReply& reply) {
+				return shouldContinue(OnCommandReply(reply));
+			} ),
+			HandlePacket<PacketType::Device_SubcommandReply>([this, &shouldContinue](const DeviceSubPacket::SubcommandReply& reply) {
+				return shouldContinue(OnSubcommandReply(reply));
+			} ),
+			HandlePacket<PacketType::Device_FullStates>([this, &shouldContinue](const DeviceSubPacket::FullStates&) {
+				return shouldContinue(OnFullStates());
+			} )
+		);
+		return isOk;
+	}
 
+	bool Service()  // on every wake-up of the service thread, after the reads were handed over
+	{
+		if (!IsRunning())
+			return true;
+		else if (m_stepTimer.HasExpired())
+			return OnStepTimeout();
+		return m_isStepWritten || WriteStep();  // the write pipe was busy the last time
+	}
 
-bool SendHostSubcommand(DeviceIoPipes& devPipes, HostSubPacket::SubcommandCode subcmdCode, uint8_t serialId, uint32_t subcmdData, bool readReply)
-{
-	constexpr PacketType k_packetType = PacketType::Host_RumbleAndSubcommand;
+	bool HasRunHandshake() const  // false if the device was already initialized
+	{
+		return m_hasRunHandshake;
+	}
+
+	// from Start() until the device was initialized, not counting the calibration reads; until now if it never was
+	uint64_t GetInitMicroseconds() const
+	{
+		return m_initMicroseconds != 0 ? m_initMicroseconds : HighResClock::ToMicroseconds(HighResClock::Now() - m_startTicks);
+	}
 
-	Buffer writeBuffer(k_pipeParams.writeBufferSize);
-	Packet& packet = writeBuffer;
+	// user calibration overrides factory calibration stick by stick; sticks without either keep the defaults.
+	// the same goes for the motion sensors
+	const StickCalibration& GetStickCalibration() const
+	{
+		return m_stickCalibration;
+	}
 
-	ZeroMemory(&packet, sizeof(packet));
-	packet.type = k_packetType;
-	auto& rumbleAndSubcmd = packet.GetSubPacket<k_packetType>();
-	rumbleAndSubcmd.serialId = serialId;
-	rumbleAndSubcmd.left = HostSubPacket::RumbleParam::Neutral();
-	rumbleAndSubcmd.right = HostSubPacket::RumbleParam::Neutral();
-	rumbleAndSubcmd.subcmdCode = subcmdCode;
-	rumbleAndSubcmd.subcmdData = subcmdData;
+	const MotionCalibration& GetMotionCalibration() const
+	{
+		return m_motionCalibration;
+	}
 
-	const auto writeResult = devPipes.WriteSync(writeBuffer, Pipe::k_syncInfinite);
-	if (std::get<Pipe::OpResultCode>(writeResult) != Pipe::OpResultCode::Success)
-		return false;
 
-	if (readReply && !WaitForDeviceSubcommandReply(devPipes, subcmdCode))
-		return false;
+private:
+	enum class Step
+	{
+		Probe,  // status command; the device streaming full states goes straight to SetPlayerLights
+		HandShake,
+		SetHighSpeed,
+		HandShakeAgain,  // the device handshakes again at the new baud rate
+		ForceUSB,  // device doesn't generate reply to this command code
+		SetPlayerLights,
+		RequestDeviceId,  // status command, if the probe's reply didn't make it. the device id keys the calibration cache
+		ReadFactoryStickCalibration,  // flash is only read if the cache doesn't know the device
+		ReadUserStickCalibration,
+		ReadFactoryMotionCalibration,
+		ReadUserMotionCalibration,
+		Done
+	};
 
-	return true;
-}
+	static constexpr std::chrono::milliseconds k_probeWindow { 50 };  // a streaming device sends several reports meanwhile
+	static constexpr std::chrono::milliseconds k_stepTimeout { 100 };  // before a command is sent again
+	static constexpr unsigned int k_maxAttempts = 3;
 
+	// what the flash steps read, in step order
+	static constexpr HostSubPacket::SPIFlashRange k_flashRanges[] = {
+		{ k_factoryStickCalibrationAddress, k_factoryStickCalibrationSize },
+		{ k_userStickCalibrationAddress, k_userStickCalibrationSize },
+		{ k_factoryMotionCalibrationAddress, k_factoryMotionCalibrationSize },
+		{ k_userMotionCalibrationAddress, k_userMotionCalibrationSize }
+	};
+	static_assert(static_cast<unsigned int>(Step::Done) - static_cast<unsigned int>(Step::ReadFactoryStickCalibration) == std::size(k_flashRanges));
 
-template <typename T1, typename T2>
-bool IsSet(T1 val, T2 index)
-{
-	return ((static_cast<uint64_t>(val) >> static_cast<uint8_t>(index)) & 1) == 1;
-}
 
+	// the decoders want exactly the bytes of their range
+	template <size_t N, typename Calibration>
+	static void Decode(bool (*decode)(const uint8_t (&)[N], Calibration&), const uint8_t* data, __out Calibration& result)
+	{
+		uint8_t copy[N];
+		memcpy(copy, data, N);
+		decode(copy, result);
+	}
 
-class PacketAdaptor
-{
-public:
-	static void Translate(const Packet& packet, __out XINPUT_STATE& outputStates, __out XINPUT_BATTERY_INFORMATION& outputBattery)
-	{
-		assert(packet.type == PacketType::Device_FullStates);
-		const auto& gameStates = packet.GetSubPacket<PacketType::Device_FullStates>();
-
-		outputStates.dwPacketNumber = gameStates.timestamp;
-
-		const auto [leftX, leftY] = gameStates.leftStick.Split();
-		const auto [rightX, rightY] = gameStates.rightStick.Split();
-		outputStates.Gamepad.sThumbLX = RemapAxis<RamapConfigLeftX>(leftX);
-		outputStates.Gamepad.sThumbLY = RemapAxis<RamapConfigLeftY>(leftY);
-		outputStates.Gamepad.sThumbRX = RemapAxis<RamapConfigRightX>(rightX);
-		outputStates.Gamepad.sThumbRY = RemapAxis<RamapConfigRightY>(rightY);
-
-		const uint32_t buttons = gameStates.keys;
-		outputStates.Gamepad.bLeftTrigger = IsSet(buttons, Buttons::ZL) ? 0xFF : 0;  // Unlike XBO, Pro's triggers are binary
-		outputStates.Gamepad.bRightTrigger = IsSet(buttons, Buttons::ZR) ? 0xFF : 0;
-		outputStates.Gamepad.wButtons = 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Y) ? XINPUT_GAMEPAD_X : 0;  // Pro's X is at the physical position of Xbox's Y
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::X) ? XINPUT_GAMEPAD_Y : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::B) ? XINPUT_GAMEPAD_A : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::A) ? XINPUT_GAMEPAD_B : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::R) ? XINPUT_GAMEPAD_RIGHT_SHOULDER : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Minus) ? XINPUT_GAMEPAD_BACK : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Plus) ? XINPUT_GAMEPAD_START : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::TriggerR) ? XINPUT_GAMEPAD_RIGHT_THUMB : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::TriggerL) ? XINPUT_GAMEPAD_LEFT_THUMB : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Down) ? XINPUT_GAMEPAD_DPAD_DOWN : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Up) ? XINPUT_GAMEPAD_DPAD_UP : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Right) ? XINPUT_GAMEPAD_DPAD_RIGHT : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::Left) ? XINPUT_GAMEPAD_DPAD_LEFT : 0;
-		outputStates.Gamepad.wButtons |= IsSet(buttons, Buttons::L) ? XINPUT_GAMEPAD_LEFT_SHOULDER : 0;
-
-		outputBattery.BatteryType = k_batteryType;
-		outputBattery.BatteryLevel = DecodeBatteryLevel(gameStates.batteryAndWired);
+	bool IsReadingFlash() const
+	{
+		return m_step >= Step::ReadFactoryStickCalibration && m_step < Step::Done;
 	}
 
-private:
+	const HostSubPacket::SPIFlashRange& GetFlashRange() const  // of the current flash step
+	{
+		return k_flashRanges[static_cast<unsigned int>(m_step) - static_cast<unsigned int>(Step::ReadFactoryStickCalibration)];
+	}
 
-#define DEFINE_REMAP_CONFIG(name, M, m, neu)	\
-	enum class name : int16_t {	\
-		max = M,				\
-		min = m,				\
-		neutral = neu			\
-	};
-	DEFINE_REMAP_CONFIG(RamapConfigLeftX, 0xE20, 0x220, 0x7E0);
-	DEFINE_REMAP_CONFIG(RamapConfigLeftY, 0xE20, 0x1B0, 0x7A0);
-	DEFINE_REMAP_CONFIG(RamapConfigRightX, 0xE00, 0x230, 0x800);
-	DEFINE_REMAP_CONFIG(RamapConfigRightY, 0xE20, 0x150, 0x770);
-#undef DEFINE_REMAP_CONFIG
+	bool EnterStep(Step step)
+	{
+		m_step = step;
+		m_numAttempts = 0;
+		m_hasRunHandshake |= step == Step::HandShake;
+		if (step != Step::Done)
+			return SendStep();
 
+		m_devPipes.GetEngine().CancelTimer(m_stepTimer);
+		return true;
+	}
+
+	bool SendStep()  // (re)start the current step
+	{
+		m_devPipes.GetEngine().ArmTimer(m_stepTimer, m_step == Step::Probe ? k_probeWindow : k_stepTimeout);
+		m_isStepWritten = false;
+		return WriteStep();
+	}
 
-	template <typename Config>
-	static int16_t RemapAxis(uint16_t value)
+	// a busy write pipe, e.g. right after ForceUSB, is tried again on a later wake-up, one of which is the completion
+	// of the write in the way. a pipe that stays busy costs the step an attempt
+	bool WriteStep()
 	{
-		constexpr int16_t k_max = static_cast<int16_t>(Config::max);
-		constexpr int16_t k_min = static_cast<int16_t>(Config::min);
-		constexpr int16_t k_neutral = static_cast<int16_t>(Config::neutral);
+		const auto writeResultCode = WriteStepCommand();
+		if (writeResultCode == Pipe::OpResultCode::InvalidFile)
+			return false;
 
-		const float signedVal = static_cast<float>(std::clamp(static_cast<int16_t>(value), k_min, k_max) - k_neutral);
-		if (signedVal > 0.f)
+		m_isStepWritten = writeResultCode == Pipe::OpResultCode::Success;
+		if (m_isStepWritten && m_step == Step::ForceUSB)
+			return EnterStep(Step::SetPlayerLights);  // nothing to wait for, so the next command follows right away
+		return true;
+	}
+
+	Pipe::OpResultCode WriteStepCommand()
+	{
+		using HostSubPacket::CommandCode;
+		using HostSubPacket::SubcommandCode;
+
+		switch (m_step)
 		{
-			constexpr float rangeOrig = k_max - k_neutral;
-			constexpr float invRangeOrig = 1.f / rangeOrig;
-			return static_cast<int16_t>(signedVal * invRangeOrig * 0x7FFF);
+		case Step::Probe:
+		case Step::RequestDeviceId:
+			// raw data: 0x80 0x01
+			DebugOutputString(L"HostCommand=Status\n");
+			return SendHostCommand(m_devPipes, CommandCode::Status);
+		case Step::HandShake:
+		case Step::HandShakeAgain:
+			// raw data: 0x80 0x02
+			DebugOutputString(L"HostCommand=HandShake\n");
+			return SendHostCommand(m_devPipes, CommandCode::HandShake);
+		case Step::SetHighSpeed:
+			// raw data: 0x80 0x03
+			DebugOutputString(L"HostCommand=SetHighSpeed\n");
+			return SendHostCommand(m_devPipes, CommandCode::SetHighSpeed);
+		case Step::ForceUSB:
+			// raw data: 0x80 0x04
+			DebugOutputString(L"HostCommand=ForceUSB\n");
+			return SendHostCommand(m_devPipes, CommandCode::ForceUSB);
+		case Step::SetPlayerLights:
+			DebugOutputString(L"HostSubcommand=SetPlayerLights\n");
+			return SendHostSubcommand(m_devPipes, SubcommandCode::SetPlayerLights, 1, m_playerLEDMask);
+		case Step::ReadFactoryStickCalibration:
+		case Step::ReadUserStickCalibration:
+		case Step::ReadFactoryMotionCalibration:
+		case Step::ReadUserMotionCalibration:
+			DebugOutputString(L"HostSubcommand=ReadSPIFlash\n");
+			return RequestSPIFlash(m_devPipes, GetFlashRange());
+		default:
+			return Pipe::OpResultCode::Success;
 		}
-		else if (signedVal < 0.f)
+	}
+
+	bool OnStepTimeout()
+	{
+		// a device that isn't streaming by the end of the probe window needs the handshake
+		if (m_step == Step::Probe)
+			return EnterStep(Step::HandShake);
+		else if (++m_numAttempts < k_maxAttempts)
+			return SendStep();
+
+		// a device works without its calibration, only less precisely; it's the initialization that has to succeed
+		if (m_step == Step::RequestDeviceId)
+			return LookUpCalibration();
+		else if (IsReadingFlash())
+			return EnterNextFlashStep();
+		return false;
+	}
+
+	bool ReadCalibration()  // once the device is initialized
+	{
+		m_initMicroseconds = HighResClock::ToMicroseconds(HighResClock::Now() - m_startTicks);
+		return m_hasDeviceId ? LookUpCalibration() : EnterStep(Step::RequestDeviceId);
+	}
+
+	bool LookUpCalibration()  // once the device id is known, or the device didn't tell it
+	{
+		if (m_hasDeviceId && LoadCachedCalibration(m_deviceId, m_stickCalibration, m_motionCalibration))
+			return EnterStep(Step::Done);
+		return EnterStep(Step::ReadFactoryStickCalibration);
+	}
+
+	bool EnterNextFlashStep()  // the current one was read or ran out of attempts
+	{
+		if (m_step != Step::ReadUserMotionCalibration)
+			return EnterStep(static_cast<Step>(static_cast<unsigned int>(m_step) + 1));
+
+		// only complete reads are cached so that a hiccup doesn't stick around
+		if (m_hasDeviceId && m_numFlashReads == std::size(k_flashRanges))
+			SaveCachedCalibration(m_deviceId, m_stickCalibration, m_motionCalibration);
+		return EnterStep(Step::Done);
+	}
+
+	// these return false if the step that follows couldn't be sent
+	bool OnCommandReply(const DeviceSubPacket::CommandReply& reply)
+	{
+		using HostSubPacket::CommandCode;
+
+		if (reply.cmdCode == CommandCode::Status && !m_hasDeviceId)
 		{
-			constexpr float rangeOrig = k_neutral - k_min;
-			constexpr float invRangeOrig = 1.f / rangeOrig;
-			return static_cast<int16_t>(signedVal * invRangeOrig * 0x8000);
+			static_assert(sizeof(reply.macAddress) == sizeof(m_deviceId));
+			memcpy(m_deviceId.data(), reply.macAddress, sizeof(reply.macAddress));
+			m_hasDeviceId = true;
+			if (m_step == Step::RequestDeviceId)
+				return LookUpCalibration();
 		}
-		else
-			return 0;
+		else if (reply.cmdCode == CommandCode::HandShake && m_step == Step::HandShake)
+			return EnterStep(Step::SetHighSpeed);
+		else if (reply.cmdCode == CommandCode::SetHighSpeed && m_step == Step::SetHighSpeed)
+			return EnterStep(Step::HandShakeAgain);
+		else if (reply.cmdCode == CommandCode::HandShake && m_step == Step::HandShakeAgain)
+			return EnterStep(Step::ForceUSB);
+		return true;
 	}
 
-	static uint8_t DecodeBatteryLevel(uint8_t batteryAndWired)
+	bool OnSubcommandReply(const DeviceSubPacket::SubcommandReply& reply)
 	{
-		// 0 is EMPTY; remap the rest [1-8] to [1-3], where BATTERY_LEVEL_LOW=1, MEDIUM=2, FULL=3
-		const uint8_t battery = batteryAndWired >> 4;
-		if (battery >= 7)
-			return BATTERY_LEVEL_FULL;
-		else if (battery >= 4)
-			return BATTERY_LEVEL_MEDIUM;
-		else if (battery >= 1)
-			return BATTERY_LEVEL_LOW;
-		else
-			return BATTERY_LEVEL_EMPTY;
-	}
-};
+		using HostSubPacket::SubcommandCode;
 
+		if (reply.subcmdCode == SubcommandCode::SetPlayerLights && m_step == Step::SetPlayerLights)
+			return ReadCalibration();
+		else if (reply.subcmdCode != SubcommandCode::ReadSPIFlash || !IsReadingFlash())
+			return true;
 
-}  // unnamed namespace
+		// the reply echoes the range so we can tell it apart from a late reply to an earlier read
+		const auto& range = GetFlashRange();
+		if (reply.spiFlash.range.address != range.address || reply.spiFlash.range.size != range.size)
+			return true;
 
+		const uint8_t* data = reply.spiFlash.data;
+		switch (m_step)
+		{
+		case Step::ReadFactoryStickCalibration:
+			Decode(&DecodeFactoryStickCalibration, data, m_stickCalibration);
+			break;
+		case Step::ReadUserStickCalibration:
+			Decode(&DecodeUserStickCalibration, data, m_stickCalibration);
+			break;
+		case Step::ReadFactoryMotionCalibration:
+			Decode(&DecodeFactoryMotionCalibration, data, m_motionCalibration);
+			break;
+		default:
+			Decode(&DecodeUserMotionCalibration, data, m_motionCalibration);
+			break;
+		}
+		++m_numFlashReads;
+		return EnterNextFlashStep();
+	}
 
+	bool OnFullStates()
+	{
+		return m_step == Step::Probe ? EnterStep(Step::SetPlayerLights) : true;
+	}
 
-// ----------------------------------------------------------------------------
-// ProAgent definitions -------------------------------------------------------
 
-ProAgent::CachedStates::CachedStates()
-	: timestamp(0)
-	, mutex()
-	, gamepad()
-	, battery()
-{
-	std::unique_lock lock(mutex);
+	DeviceIoPipes& m_devPipes;
+	DeviceIoEngine::Timer m_stepTimer;  // the current step's timeout
+	uint32_t m_playerLEDMask;
+	Step m_step;
+	unsigned int m_numAttempts;  // of the current step, not counting the first
+	bool m_isStepWritten;  // false while the current step waits for the write pipe
+	bool m_hasRunHandshake;
+	bool m_hasDeviceId;
+	DeviceId m_deviceId;
+	StickCalibration m_stickCalibration;
+	MotionCalibration m_motionCalibration;
+	unsigned int m_numFlashReads;  // that succeeded
+	uint64_t m_startTicks;  // HighResClock
+	uint64_t m_initMicroseconds;
+};
+
 
-	ZeroMemory(&gamepad, sizeof(gamepad));
-	ZeroMemory(&battery, sizeof(battery));
-}
 
+// ----------------------------------------------------------------------------
+// ProAgent definitions -------------------------------------------------------
 
-ProAgent::ProAgent()
-	: m_devPipes(OpenDevice(FindDevicePath()), k_pipeParams)
+ProAgent::ProAgent(unsigned int userIndex, DeviceIoEngine& ioEngine)
+	: m_userIndex(userIndex)
+	, m_ioEngine(ioEngine)
+	, m_devicePath()
+	, m_devPipes(ioEngine, k_pipeParams)
+	, m_initSequence(std::make_unique<InitSequence>(m_devPipes))
+	, m_isDeviceReady(false)
+	, m_numAttachFailures(0)
+	, m_packetAdaptor(Config::Get().mappingProfile)
 	, m_cachedStates()
-	, m_workerThread()
-	, m_workerStopSignal(false)
+	, m_latchButtonPresses(Config::Get().latchButtonPresses)
+	, m_latchedKeys(0)
+	, m_stateHistory(Config::Get().stateHistoryDepth != 0 ? std::make_unique<BroadcastRing<HAGR_TIMED_STATE>>(Config::Get().stateHistoryDepth) : nullptr)
+	, m_keystrokeGenerator(static_cast<BYTE>(userIndex))
+	, m_keystrokes(k_keystrokeQueueSize)
+	, m_keystrokesWanted(false)
+	, m_motionDecoder()
+	, m_motionSamples(HAGR_MOTION_DEPTH)
+	, m_motionWanted(false)
+	, m_isMotionEnabled(false)
+	, m_motionRequestTicks(0)
+	, m_requestedVibration(0)
+	, m_sentVibration(0)
+	, m_vibrationSentTime(0)
+	, m_outputSerialId(0)
+	, m_stats()
+	, m_lastReportTimestamp(0)
+	, m_hasLastReportTimestamp(false)
+	, m_lastReportTicks(0)
+	, m_reportIntervalMicroseconds(0)
+	, m_lastCallMilliseconds(HighResClock::ToMicroseconds(HighResClock::Now()) / 1000)  // nobody is idle from the start
+	, m_isInStandby(false)
+	, m_resumeTicks(0)
+	, m_resumedEvent(CreateEventW(nullptr, TRUE, TRUE, nullptr))
+	, m_wakeSignal(0)
+	, m_firstPullEvent(CreateEventW(nullptr, TRUE, FALSE, nullptr))
 	, m_deviceTriedFirstPull(false)
 {
-	InitWorkerThread();
+	assert(m_resumedEvent && m_firstPullEvent);
 }
 
 ProAgent::~ProAgent()
 {
-	if (m_workerThread)
-	{
-		m_workerStopSignal = true;
-		m_workerThread->join();
-	}
 }
 
 // return true if result is cached or being read from device; return false otherwise
 bool ProAgent::TryUpdate()
 {
-	// only try to reattach once in each tick
-	Tearoff reattachRequest(std::mem_fn(&ProAgent::ReattachToDevice), 1);
-
-	if (!m_devPipes.IsFileValid() && !reattachRequest(this))
+	// the registry looks for the device again if it's gone
+	if (!m_devPipes.IsFileValid())
 		return false;
 
-	Buffer buffer(k_pipeParams.readBufferSize);
-	const auto popResultCode = std::get<Pipe::OpResultCode>(m_devPipes.PopReadResult(buffer));
+	// nothing is published while the device is being brought up
+	if (m_initSequence->IsRunning())
+	{
+		ContinueInit();
+		return m_devPipes.IsFileValid();
+	}
+
+	// the buffer is the pipe's own storage and stays put until the next pop, while the other queued reads keep
+	// the device busy in the meantime. reports that piled up are popped one per wake-up, in arrival order.
+	const auto popResult = m_devPipes.PopReadResult();
+	const auto popResultCode = std::get<Pipe::OpResultCode>(popResult);
+	const Buffer* buffer = std::get<const Buffer*>(popResult);
 	if (popResultCode == Pipe::OpResultCode::InvalidFile)
 	{
-		m_devPipes.Close();
-		reattachRequest.RunSafe(this);
+		CloseDevice();
 		return false;  // we don't have results ready in this tick
 	}
 	else if (popResultCode == Pipe::OpResultCode::StillExecuting)
 	{
 		// if PopReadResult() keeps returning StillExecuting, it could mean another process, e.g. Steam, is
-		// communicating with the device and somehow forces it into sleep mode.
-		if (GetTickCount64() - m_cachedStates.timestamp > k_packetTimeout)
+		// communicating with the device and somehow forces it into sleep mode. a device that was just woken up
+		// from standby, or just attached, gets the same time to send its first report.
+		if (GetAge(std::max(m_cachedStates.Read().publishTicks, m_resumeTicks)) > GetPacketTimeout())
 		{
-			m_devPipes.Close();
-			reattachRequest.RunSafe(this);
+			CloseDevice();
 			return false;
 		}
 	}
@@ -426,21 +585,80 @@ bool ProAgent::TryUpdate()
 		// issue next read before processing packets to maximize throughput
 		const auto readResultCode = std::get<Pipe::OpResultCode>(m_devPipes.Read());
 
-		// now process packets
-		if (const auto* packet = GetLastPacket(buffer))
+		// now process packets. the read is walked once; everything below works on the reports it collected
+		static_assert(k_pipeParams.readBufferSize / sizeof(Packet) <= ReportBatch::k_capacity);
+		ReportBatch batch;
+		batch.size = 0;
+		if (buffer != nullptr)
+		{
+			DispatchPackets(*buffer,
+				HandlePacket<PacketType::Device_FullStates>([&batch](const DeviceSubPacket::FullStates&, const Packet& packet) {
+					batch.reports[batch.size++] = &packet;
+				} ),
+				HandlePacket<PacketType::Device_SubcommandReply>([this](const DeviceSubPacket::SubcommandReply& reply) {
+					// bit 7 of the ack is set on success
+					if (reply.subcmdCode == HostSubPacket::SubcommandCode::EnableIMU && (reply.subcmdAck & 0x80) != 0)
+						m_isMotionEnabled = true;
+				} )
+			);
+		}
+
+		if (batch.size != 0)
 		{
-			std::unique_lock lock(m_cachedStates.mutex);
-			m_cachedStates.timestamp = GetTickCount64();
-			PacketAdaptor::Translate(*packet, m_cachedStates.gamepad, m_cachedStates.battery);
-			m_deviceTriedFirstPull = true;
+			const unsigned int numFullStates = batch.size;
+			const Packet* packet = batch.reports[numFullStates - 1];  // only the latest is published
+			const uint64_t publishTicks = HighResClock::Now();
+
+			// the device's report timestamp advances by one per report, so a bigger step means reports were lost
+			const uint8_t reportTimestamp = packet->GetSubPacket<PacketType::Device_FullStates>().timestamp;
+			const unsigned int timestampStep = m_hasLastReportTimestamp ? static_cast<uint8_t>(reportTimestamp - m_lastReportTimestamp) : 0;
+			if (timestampStep > numFullStates)
+				m_stats.reportsDropped.fetch_add(timestampStep - numFullStates, std::memory_order_relaxed);
+			m_lastReportTimestamp = reportTimestamp;
+			m_hasLastReportTimestamp = true;
+			MeasureReportInterval(publishTicks, timestampStep);
+
+			RecordAllReports(batch, publishTicks);  // before publishing, so a latched press is never behind the cached state
+			if (m_isMotionEnabled)
+				RecordMotion(batch, publishTicks);
+			const auto packetTimeout = static_cast<uint32_t>(GetPacketTimeout().count());
+			m_cachedStates.Write([this, packet, publishTicks, packetTimeout](CachedStates& states) {
+				states.publishTicks = publishTicks;
+				states.packetTimeoutMicroseconds = packetTimeout;
+				m_packetAdaptor.Translate(*packet, states.gamepad, states.battery);
+			} );
+			m_stats.publishLatency.Record(HighResClock::ToMicroseconds(HighResClock::Now() - m_devPipes.GetReadResultTicks()));
+
+			m_stats.reportsReceived.fetch_add(numFullStates, std::memory_order_relaxed);
+			m_stats.reportsCoalesced.fetch_add(numFullStates - 1, std::memory_order_relaxed);
+
+			if (!m_deviceTriedFirstPull.exchange(true))
+				SetEvent(m_firstPullEvent);
+
+			// the first report after standby is a fresh one; release the calls waiting for it
+			if (m_isInStandby.load(std::memory_order_relaxed))
+			{
+				m_isInStandby.store(false, std::memory_order_release);
+				SetEvent(m_resumedEvent);
+			}
+		}
+
+		// at most one packet per report; turning the motion sensors on takes a single one, sent again until the
+		// device confirms it
+		if (readResultCode != Pipe::OpResultCode::InvalidFile)
+		{
+			const bool isMotionRequestDue = m_motionRequestTicks == 0 || GetAge(m_motionRequestTicks) >= k_enableMotionRetryInterval;
+			if (!m_isMotionEnabled && m_motionWanted.load(std::memory_order_relaxed) && isMotionRequestDue)
+				EnableMotion();
+			else
+				SendVibration();
 		}
 
 		// handle failed read operation only after caching states
 		if (readResultCode == Pipe::OpResultCode::InvalidFile)
 		{
 			// still return true as this tick successfully updated cache
-			m_devPipes.Close();
-			reattachRequest.RunSafe(this);
+			CloseDevice();
 		}
 	}
 	return true;
@@ -448,108 +666,458 @@ bool ProAgent::TryUpdate()
 
 bool ProAgent::GetCachedState(__out XINPUT_STATE& result) const
 {
-	std::shared_lock lock(m_cachedStates.mutex);
-	result = m_cachedStates.gamepad;
-	return (GetTickCount64() - m_cachedStates.timestamp < k_packetTimeout);
+	uint64_t unusedPublishTicks;
+	return GetCachedState(result, unusedPublishTicks);
+}
+
+bool ProAgent::GetCachedState(__out XINPUT_STATE& result, __out uint64_t& publishTicks) const
+{
+	NoteCall(true);
+
+	const CachedStates states = m_cachedStates.Read();
+	result = states.gamepad;
+	publishTicks = states.publishTicks;
+
+	const auto age = GetAge(states.publishTicks);
+	if (states.publishTicks != 0)
+		m_stats.cacheAge.Record(static_cast<uint64_t>(age.count()));
+
+	if (m_latchButtonPresses)
+	{
+		// the latched keys include the cached state's, so whatever is cleared here has been reported once.
+		// with several threads polling the same user index, only one of them sees a given short press.
+		const uint32_t latched = m_latchedKeys.exchange(0, std::memory_order_relaxed);
+		result.Gamepad.wButtons |= static_cast<WORD>(latched);
+		if ((latched & PacketAdaptor::k_leftTriggerBit) != 0)
+			result.Gamepad.bLeftTrigger = 0xFF;
+		if ((latched & PacketAdaptor::k_rightTriggerBit) != 0)
+			result.Gamepad.bRightTrigger = 0xFF;
+	}
+
+	return age < std::chrono::microseconds(states.packetTimeoutMicroseconds);
+}
+
+void ProAgent::PeekCachedStates(__out XINPUT_STATE& gamepad, __out XINPUT_BATTERY_INFORMATION& battery, __out uint64_t& publishTicks) const
+{
+	const CachedStates states = m_cachedStates.Read();
+	gamepad = states.gamepad;
+	battery = states.battery;
+	publishTicks = states.publishTicks;
+}
+
+bool ProAgent::ReadStateHistory(__inout uint64_t& cursor, __out_ecount(count) HAGR_TIMED_STATE* result, __inout DWORD& count) const
+{
+	NoteCall(false);  // the reader picks up fresh entries on its next read
+
+	if (!m_stateHistory)
+	{
+		count = 0;
+		return false;
+	}
+
+	count = m_stateHistory->Read(cursor, result, count);
+	return true;
+}
+
+void ProAgent::ReadMotion(__inout uint64_t& cursor, __out_ecount(count) HAGR_MOTION_SAMPLE* result, __inout DWORD& count)
+{
+	NoteCall(false);
+
+	if (!m_motionWanted.load(std::memory_order_relaxed))
+		m_motionWanted.store(true, std::memory_order_relaxed);
+
+	count = m_motionSamples.Read(cursor, result, count);
 }
 
 bool ProAgent::GetBatteryInfo(__out XINPUT_BATTERY_INFORMATION& result) const
 {
-	std::shared_lock lock(m_cachedStates.mutex);
-	result = m_cachedStates.battery;
-	return (GetTickCount64() - m_cachedStates.timestamp < k_packetTimeout);
+	NoteCall(true);
+
+	const CachedStates states = m_cachedStates.Read();
+	result = states.battery;
+	return GetAge(states.publishTicks) < std::chrono::microseconds(states.packetTimeoutMicroseconds);
+}
+
+// called on game threads
+bool ProAgent::PopKeystroke(__out XINPUT_KEYSTROKE& result)
+{
+	NoteCall(false);
+
+	// keystrokes are only generated once somebody asks for them, so the first call never returns stale ones
+	if (!m_keystrokesWanted.load(std::memory_order_relaxed))
+		m_keystrokesWanted.store(true, std::memory_order_relaxed);
+
+	return m_keystrokes.Pop(result);
 }
 
 bool ProAgent::IsDeviceValid() const
 {
-	return m_devPipes.IsFileValid();
+	return m_isDeviceReady.load(std::memory_order_acquire);
+}
+
+void ProAgent::GetStats(__out HAGR_STATS& result) const
+{
+	m_stats.CopyTo(result);
+}
+
+// called on game threads
+void ProAgent::SetVibration(const XINPUT_VIBRATION& vibration)
+{
+	NoteCall(false);  // the service thread sends it once it's up again
+
+	// games set the same values every frame; only the latest one matters
+	const uint32_t packed = (static_cast<uint32_t>(vibration.wLeftMotorSpeed) << 16) | vibration.wRightMotorSpeed;
+	m_requestedVibration.store(packed, std::memory_order_relaxed);
 }
 
 // return true if cached state is available in the end.
 // cannot be called on a worker thread.
-bool ProAgent::WaitForFirstCachedState() const
+bool ProAgent::WaitForFirstCachedState(std::chrono::milliseconds timeout) const
 {
-	// the spinning loop relies on TryUpdate() properly checking packet time-out interval
-	// or it could block forever.
-	while (!m_deviceTriedFirstPull && m_devPipes.IsFileValid())
-		;  // spin
+	// the event is signaled by the worker thread as soon as the first state is cached or the device is closed.
+	// it's never reset, so a controller plugged in later is reported once it's up rather than waited for
+	if (!m_deviceTriedFirstPull && m_devPipes.IsFileValid())
+		WaitForSingleObject(m_firstPullEvent, static_cast<DWORD>(timeout.count()));
 
 	return m_deviceTriedFirstPull;
 }
 
-void ProAgent::InitWorkerThread()
+void ProAgent::RecordAllReports(const ReportBatch& batch, uint64_t publishTicks)
 {
-	if (m_workerThread)
+	const bool wantsKeystrokes = m_keystrokesWanted.load(std::memory_order_relaxed);
+	if (!m_latchButtonPresses && !m_stateHistory && !wantsKeystrokes)
 		return;
 
-	auto* thread = new std::thread(std::mem_fn(&ProAgent::WorkerThreadProc), this);
-	m_workerThread.reset(thread);
+	uint32_t keys = 0;
+	const uint64_t timestamp = HighResClock::ToMicroseconds(publishTicks);
+	const uint64_t now = timestamp / 1000;  // keystroke repeats count in milliseconds
+	for (unsigned int i = 0; i < batch.size; ++i)
+	{
+		const Packet& packet = *batch.reports[i];
+		keys |= m_packetAdaptor.MapKeys(packet);
+		if (m_stateHistory || wantsKeystrokes)
+		{
+			HAGR_TIMED_STATE entry;
+			XINPUT_BATTERY_INFORMATION unusedBattery;
+			entry.timestampMicroseconds = timestamp;  // reports of the same read arrived together
+			m_packetAdaptor.Translate(packet, entry.state, unusedBattery);
+			if (m_stateHistory)
+				m_stateHistory->Push(entry);
+			if (wantsKeystrokes)
+				m_keystrokeGenerator.Update(entry.state.Gamepad, now, m_keystrokes);
+		}
+	}
+
+	if (m_latchButtonPresses)
+		m_latchedKeys.fetch_or(keys, std::memory_order_relaxed);
+}
+
+void ProAgent::RecordMotion(const ReportBatch& batch, uint64_t publishTicks)
+{
+	// frames of the same read arrived together. they're spread back over the measured report interval, the newest
+	// one at arrival. until the interval is known they all share the arrival time.
+	const uint64_t arrival = HighResClock::ToMicroseconds(publishTicks);
+	const uint64_t frameSpacing = m_reportIntervalMicroseconds / MotionDecoder::k_framesPerPacket;
+	uint64_t framesBehind = static_cast<uint64_t>(batch.size) * MotionDecoder::k_framesPerPacket;
+	for (unsigned int i = 0; i < batch.size; ++i)
+	{
+		HAGR_MOTION_SAMPLE samples[MotionDecoder::k_framesPerPacket];
+		m_motionDecoder.Decode(*batch.reports[i], samples);
+		for (auto& sample : samples)
+		{
+			--framesBehind;
+			sample.timestampMicroseconds = arrival - framesBehind * frameSpacing;
+			m_motionSamples.Push(sample);
+		}
+	}
 }
 
-bool ProAgent::ReattachToDevice()
+void ProAgent::MeasureReportInterval(uint64_t publishTicks, unsigned int timestampStep)
 {
-	m_deviceTriedFirstPull = false;
+	// arrival times jitter with USB polling and with our own wake-ups, which the moving average evens out.
+	// a gap as long as the timeout is a stall rather than the interval, and may have wrapped the 8-bit timestamp too.
+	const uint64_t elapsed = HighResClock::ToMicroseconds(publishTicks - m_lastReportTicks);
+	m_lastReportTicks = publishTicks;
+	if (timestampStep == 0 || elapsed >= static_cast<uint64_t>(k_packetTimeout.count()))
+		return;
 
-	if (AutoHandle newDeviceFile = OpenDevice(FindDevicePath()))
+	const int64_t sample = static_cast<int64_t>(elapsed / timestampStep);
+	const int64_t average = m_reportIntervalMicroseconds;
+	m_reportIntervalMicroseconds = static_cast<uint32_t>(average == 0 ? sample : average + (sample - average) / k_reportIntervalWeight);
+}
+
+void ProAgent::CloseDevice()
+{
+	m_initSequence->Cancel();
+	m_isDeviceReady.store(false, std::memory_order_release);
+	m_keystrokeGenerator.ReleaseAll(m_keystrokes);
+	m_devPipes.Close();
+	SetEvent(m_firstPullEvent);  // nothing will arrive any more; release the waiters
+	m_isInStandby.store(false, std::memory_order_release);
+	SetEvent(m_resumedEvent);
+}
+
+void ProAgent::NoteCall(bool shouldWaitForResume) const
+{
+	// a coarse time is enough, and keeps game threads from writing the shared cache line on every call
+	const uint64_t now = HighResClock::ToMicroseconds(HighResClock::Now()) / 1000;
+	if (m_lastCallMilliseconds.load(std::memory_order_relaxed) != now)
+		m_lastCallMilliseconds.store(now, std::memory_order_relaxed);
+
+	if (!m_isInStandby.load(std::memory_order_acquire))
+		return;
+
+	if (m_wakeSignal != 0)
+		m_ioEngine.Signal(m_wakeSignal);
+	if (shouldWaitForResume)
+		WaitForSingleObject(m_resumedEvent, static_cast<DWORD>(k_resumeTimeout.count()));
+}
+
+void ProAgent::DiscardCompletedReads()
+{
+	// bounded in case the device keeps completing reads as fast as they're issued
+	for (unsigned int i = 0; i < k_maxDiscardedReads; ++i)
 	{
-		DeviceIoPipes newDevicePipes(std::move(newDeviceFile), k_pipeParams);
-		m_devPipes = std::move(newDevicePipes);
-		if (!WaitForDeviceFullStatesPacket(m_devPipes))
+		const auto popResultCode = std::get<Pipe::OpResultCode>(m_devPipes.PopReadResult());
+		if (popResultCode == Pipe::OpResultCode::StillExecuting)
+			break;
+
+		if (popResultCode == Pipe::OpResultCode::InvalidFile || std::get<Pipe::OpResultCode>(m_devPipes.Read()) == Pipe::OpResultCode::InvalidFile)
 		{
-			// controller is not in an initialized state. have to reinitialize.
-			m_devPipes.CancelRead();  // cancel previous async read op
-			return InitDevice();
+			CloseDevice();
+			break;
 		}
+	}
+}
 
-		return true;
+void ProAgent::SetWakeSignal(uint32_t wakeSignal)
+{
+	m_wakeSignal = wakeSignal;
+}
+
+uint64_t ProAgent::GetLastCallMilliseconds() const
+{
+	return m_lastCallMilliseconds.load(std::memory_order_relaxed);
+}
+
+void ProAgent::EnterStandby()
+{
+	if (!m_isDeviceReady.load(std::memory_order_relaxed) || m_isInStandby.load(std::memory_order_relaxed))
+		return;
+
+	// reset first so that a call seeing the flag always has something to wait for
+	ResetEvent(m_resumedEvent);
+	m_isInStandby.store(true, std::memory_order_release);
+}
+
+void ProAgent::LeaveStandby()
+{
+	if (!m_isInStandby.load(std::memory_order_relaxed))
+		return;
+
+	// the HID driver kept the reports that came in after our reads were filled, and would hand out the oldest first.
+	// the flag stays set until TryUpdate() publishes one that arrived after this.
+	// reads count as completed only once the engine has dispatched them, which it may not have done yet
+	HidD_FlushQueue(m_devPipes.GetFile());  // fails harmlessly on a replay pipe
+	m_ioEngine.Pump(0);
+	DiscardCompletedReads();
+	m_resumeTicks = HighResClock::Now();
+	m_hasLastReportTimestamp = false;  // the gap in timestamps isn't lost reports
+}
+
+void ProAgent::ServiceStandby()
+{
+	if (m_devPipes.IsFileValid())
+		DiscardCompletedReads();
+}
+
+bool ProAgent::IsReportReady() const
+{
+	return m_devPipes.IsFileValid() && m_devPipes.IsReadReady();
+}
+
+bool ProAgent::HasDevice() const
+{
+	return m_devPipes.IsFileValid();
+}
+
+bool ProAgent::IsInitializing() const
+{
+	return m_initSequence->IsRunning();
+}
+
+unsigned int ProAgent::GetAttachFailures() const
+{
+	return m_numAttachFailures;
+}
+
+void ProAgent::ResetAttachFailures()
+{
+	m_numAttachFailures = 0;
+}
+
+const std::wstring& ProAgent::GetDevicePath() const
+{
+	return m_devicePath;
+}
+
+std::chrono::microseconds ProAgent::GetPacketTimeout() const
+{
+	if (m_reportIntervalMicroseconds == 0)
+		return k_packetTimeout;
+
+	const auto timeout = std::chrono::microseconds(m_reportIntervalMicroseconds) * k_packetTimeoutIntervals;
+	return std::clamp(timeout, k_minPacketTimeout, k_packetTimeout);
+}
+
+void ProAgent::SetCaptureWriter(CaptureWriter* writer)
+{
+	m_devPipes.SetCapture(writer, m_userIndex);
+}
+
+bool ProAgent::AttachToDevice(const std::wstring& path)
+{
+	if (path != m_devicePath)
+		m_numAttachFailures = 0;
+	m_devicePath = path;
+	m_sentVibration = 0;  // a fresh device isn't rumbling
+	m_isMotionEnabled = false;  // and its motion sensors are off
+	m_motionRequestTicks = 0;
+	m_hasLastReportTimestamp = false;
+	m_reportIntervalMicroseconds = 0;  // USB and Bluetooth report at different rates
+	if (AutoHandle newDeviceFile = OpenDevice(m_devicePath))
+	{
+		m_stats.reattachCount.fetch_add(1, std::memory_order_relaxed);
+
+		// the pipes keep their buffers and overlapped structures from one device to the next
+		if (m_devPipes.Open(std::move(newDeviceFile)))
+		{
+			// turn on the light of our player slot
+			if (m_initSequence->Start(1u << (m_userIndex % 4)))
+				return true;
+
+			CloseDevice();
+		}
 	}
+
+	++m_numAttachFailures;
+	SetEvent(m_firstPullEvent);  // no device to wait for
 	return false;
 }
 
-bool ProAgent::InitDevice()
+void ProAgent::SendVibration()
 {
-	using HostSubPacket::CommandCode;
-	using HostSubPacket::SubcommandCode;
+	const uint32_t requested = m_requestedVibration.load(std::memory_order_relaxed);
+	const uint64_t now = HighResClock::Now();
+	const bool isRefreshDue = requested != 0 && std::chrono::microseconds(HighResClock::ToMicroseconds(now - m_vibrationSentTime)) >= k_vibrationRefreshInterval;
+	if (requested == m_sentVibration && !isRefreshDue)
+		return;
 
-	// raw data: 0x80 0x02
-	DebugOutputString(L"HostCommand=HandShake\n");
-	if (!SendHostCommand(m_devPipes, CommandCode::HandShake, true))
-		return false;
+	// XInput's left motor is the heavy low-frequency one and the right motor is the light high-frequency one.
+	// both actuators of the Pro controller play both bands.
+	const auto& toAmplitude = [](uint32_t motorSpeed) {
+		return static_cast<uint8_t>(motorSpeed * HostSubPacket::RumbleParam::k_maxAmplitude / 0xFFFF);
+	};
+	const auto rumbleParam = HostSubPacket::RumbleParam::FromAmplitudes(toAmplitude(requested >> 16), toAmplitude(requested & 0xFFFF));
 
-	// raw data: 0x80 0x03
-	DebugOutputString(L"HostCommand=SetHighSpeed\n");
-	if (!SendHostCommand(m_devPipes, CommandCode::SetHighSpeed, true))
-		return false;
+	constexpr PacketType k_packetType = PacketType::Host_Rumble;
 
-	// raw data: 0x80 0x02
-	DebugOutputString(L"HostCommand=HandShake\n");
-	if (!SendHostCommand(m_devPipes, CommandCode::HandShake, true))
-		return false;
+	auto writeBuffer = m_devPipes.AcquireScratchBuffer(k_pipeParams.writeBufferSize);
+	Packet& packet = *writeBuffer;
 
-	// raw data: 0x08 0x04
-	// device doesn't generate reply to this command code
-	DebugOutputString(L"HostCommand=ForceUSB\n");
-	if (!SendHostCommand(m_devPipes, CommandCode::ForceUSB, false))
-		return false;
+	ZeroMemory(&packet, sizeof(packet));
+	packet.type = k_packetType;
+	auto& rumble = packet.GetSubPacket<k_packetType>();
+	rumble.serialId = m_outputSerialId;
+	rumble.left = rumbleParam;
+	rumble.right = rumbleParam;
+
+	// the write pipe copies the packet so the scratch buffer can go right away.
+	// if the previous packet is still on its way we simply try again with the next report.
+	const auto writeResultCode = std::get<Pipe::OpResultCode>(m_devPipes.Write(*writeBuffer));
+	if (writeResultCode == Pipe::OpResultCode::Success)
+	{
+		m_outputSerialId = (m_outputSerialId + 1) & 0x0F;
+		m_sentVibration = requested;
+		m_vibrationSentTime = now;
+	}
+}
 
-	// turn on player 0 light
-	constexpr uint32_t k_playerLEDIndex = 1;
-	DebugOutputString(L"HostSubcommand=Host_RumbleAndSubcommand\n");
-	if (!SendHostSubcommand(m_devPipes, SubcommandCode::SetPlayerLights, 1, k_playerLEDIndex, true))
-		return false;
+void ProAgent::EnableMotion()
+{
+	constexpr PacketType k_packetType = PacketType::Host_RumbleAndSubcommand;
 
-	return true;
+	auto writeBuffer = m_devPipes.AcquireScratchBuffer(k_pipeParams.writeBufferSize);
+	Packet& packet = *writeBuffer;
+
+	ZeroMemory(&packet, sizeof(packet));
+	packet.type = k_packetType;
+	auto& rumbleAndSubcmd = packet.GetSubPacket<k_packetType>();
+	rumbleAndSubcmd.serialId = m_outputSerialId;
+	rumbleAndSubcmd.left = HostSubPacket::RumbleParam::Neutral();
+	rumbleAndSubcmd.right = HostSubPacket::RumbleParam::Neutral();
+	rumbleAndSubcmd.subcmdCode = HostSubPacket::SubcommandCode::EnableIMU;
+	rumbleAndSubcmd.subcmdData = 1;
+
+	// TryUpdate() picks the reply out of the read stream; motion counts as enabled only from then on
+	const auto writeResultCode = std::get<Pipe::OpResultCode>(m_devPipes.Write(*writeBuffer));
+	if (writeResultCode == Pipe::OpResultCode::Success)
+	{
+		DebugOutputString(L"HostSubcommand=EnableIMU\n");
+		m_outputSerialId = (m_outputSerialId + 1) & 0x0F;
+		m_sentVibration = 0;  // the packet's neutral rumble stopped the motors, so the next report sends them again
+		m_motionRequestTicks = HighResClock::Now();
+	}
 }
 
-void ProAgent::WorkerThreadProc()
+void ProAgent::ContinueInit()
 {
-	if (m_devPipes.IsFileValid())
-		ReattachToDevice();
+	// every read that completed so far goes to the sequence, in arrival order.
+	// bounded in case the device keeps completing reads as fast as they're issued
+	bool isOk = true;
+	for (unsigned int i = 0; isOk && m_initSequence->IsRunning() && i < k_maxDiscardedReads; ++i)
+	{
+		const auto popResult = m_devPipes.PopReadResult();
+		const auto popResultCode = std::get<Pipe::OpResultCode>(popResult);
+		const Buffer* buffer = std::get<const Buffer*>(popResult);
+		if (popResultCode == Pipe::OpResultCode::StillExecuting)
+			break;
+
+		// the buffer stays put until the next pop, so the next read can go first
+		isOk = popResultCode == Pipe::OpResultCode::Success && std::get<Pipe::OpResultCode>(m_devPipes.Read()) != Pipe::OpResultCode::InvalidFile;
+		if (isOk && buffer != nullptr)
+		{
+			DebugOutputPacket(*buffer);
+			isOk = m_initSequence->OnRead(*buffer);
+		}
+	}
+	isOk = isOk && m_initSequence->Service();
 
-	while (!m_workerStopSignal)
+	// only attaches that actually had to handshake count as initializations
+	const bool isDone = !isOk || !m_initSequence->IsRunning();
+	if (isDone && m_initSequence->HasRunHandshake())
 	{
-		TryUpdate();
-		Sleep(k_pullInterval);
+		m_stats.initDeviceCount.fetch_add(1, std::memory_order_relaxed);
+		m_stats.initDeviceTotalMicroseconds.fetch_add(m_initSequence->GetInitMicroseconds(), std::memory_order_relaxed);
 	}
+
+	if (!isOk)
+	{
+		++m_numAttachFailures;
+		CloseDevice();
+	}
+	else if (isDone)
+		FinishInit();
 }
 
+void ProAgent::FinishInit()
+{
+	m_packetAdaptor.SetCalibration(m_initSequence->GetStickCalibration());
+	m_motionDecoder.SetCalibration(m_initSequence->GetMotionCalibration());
+
+	// the last publish, if any, is the previous device's. the new one gets a full packet timeout from here
+	// for its first report, however soon the service thread wakes up for other reasons
+	m_resumeTicks = HighResClock::Now();
+	m_numAttachFailures = 0;
+	m_isDeviceReady.store(true, std::memory_order_release);
+}
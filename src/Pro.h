@@ -18,56 +18,182 @@
 
 #pragma once
 
-#include <shared_mutex>
-#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
 
 #include <windows.h>
 #include <xinput.h>
 
+#include "AgentStats.h"
+#include "AutoHandle.h"
+#include "BroadcastRing.h"
+#include "Calibration.h"
+#include "DeviceIoEngine.h"
+#include "Keystrokes.h"
+#include "Motion.h"
+#include "PacketAdaptor.h"
 #include "Pipes.h"
+#include "SeqLock.h"
+#include "SpmcQueue.h"
+#include "hagr.h"
 
 
 
+// translates one Pro controller, bound to one XInput user index, into XInput states.
+// agents don't own threads; ProRegistry drives all of them from a single service thread.
+#pragma warning(push)
+#pragma warning(disable: 4324)  // structure was padded due to alignment specifier; m_cachedStates has a cache line of its own
 class ProAgent
 {
 public:
-	ProAgent();
+	// for how long the cached states are considered valid; after that the controller is considered disconnected.
+	// once the device's report interval is measured, the timeout shrinks to a multiple of it, but never below
+	// k_minPacketTimeout. k_packetTimeout applies until then, and is the upper bound.
+	static constexpr std::chrono::microseconds k_packetTimeout = std::chrono::milliseconds(100);
+	static constexpr std::chrono::microseconds k_minPacketTimeout = std::chrono::milliseconds(40);
+	static constexpr unsigned int k_packetTimeoutIntervals = 8;  // missed reports in a row that mean a disconnect
+
+	// upper bound of how long an XInput call may block while the device is being brought up. a device that needs
+	// the handshake takes the 50 ms probe window, four command round trips and, if its calibration isn't cached yet,
+	// five more for the id and the flash reads. a round trip takes a few milliseconds, while a lost reply costs a
+	// 100 ms resend. this covers the usual bring-up and two resends; the worst case isn't worth stalling a game's
+	// render loop for, as the controller shows up on a later call anyway
+	static constexpr std::chrono::milliseconds k_firstStateTimeout { 500 };
+
+
+	ProAgent(unsigned int userIndex, DeviceIoEngine& ioEngine);  // ioEngine drives the device's I/O and must outlive the agent
 	~ProAgent();
 
 	bool GetCachedState(__out XINPUT_STATE& result) const;  // result is always written
+	bool GetCachedState(__out XINPUT_STATE& result, __out uint64_t& publishTicks) const;  // publishTicks is 0 if nothing was published yet
 	bool GetBatteryInfo(__out XINPUT_BATTERY_INFORMATION& result) const;  // result is always written
-
-	bool IsDeviceValid() const;
-	bool WaitForFirstCachedState() const;  // block until the first cached state becomes available or controller disconnects
+	// return false if the history is disabled; count is updated to the number of states copied
+	bool ReadStateHistory(__inout uint64_t& cursor, __out_ecount(count) HAGR_TIMED_STATE* result, __inout DWORD& count) const;
+	// the same for motion samples. the first call asks the service thread to turn the motion sensors on
+	void ReadMotion(__inout uint64_t& cursor, __out_ecount(count) HAGR_MOTION_SAMPLE* result, __inout DWORD& count);
+
+	bool PopKeystroke(__out XINPUT_KEYSTROKE& result);  // return false if no keystroke is queued; never blocks
+
+	bool IsDeviceValid() const;  // the device is open and done initializing
+	void SetVibration(const XINPUT_VIBRATION& vibration);  // never blocks; the service thread sends the latest value later
+	// block until the first cached state becomes available, controller disconnects, or timeout elapses.
+	// only the agent's first device is waited for
+	bool WaitForFirstCachedState(std::chrono::milliseconds timeout) const;
+	void GetStats(__out HAGR_STATS& result) const;  // result.dwSize is left untouched
+
+	// latest published states without any of GetCachedState()'s side effects; publishTicks is 0 if there are none
+	void PeekCachedStates(__out XINPUT_STATE& gamepad, __out XINPUT_BATTERY_INFORMATION& battery, __out uint64_t& publishTicks) const;
+
+	// the following are only called by ProRegistry on its service thread
+	// (re)open the device and start bringing it into a state where it keeps reporting; TryUpdate() carries on from
+	// there without blocking. return false if the device couldn't be opened
+	bool AttachToDevice(const std::wstring& path);
+	bool TryUpdate();
+	bool HasDevice() const;  // the device is open, whether or not it's done initializing
+	bool IsInitializing() const;
+	unsigned int GetAttachFailures() const;  // in a row on the current device path, until it comes up
+	void ResetAttachFailures();
+	bool IsReportReady() const;  // a read has completed that TryUpdate() hasn't taken yet
+	const std::wstring& GetDevicePath() const;  // the device last assigned to this agent; kept after it disconnects
+	std::chrono::microseconds GetPacketTimeout() const;  // of the current device; see k_packetTimeout
+	void SetCaptureWriter(CaptureWriter* writer);  // record every packet read from the device, tagged with the user index
+
+	// standby: the service thread leaves the reports of a standing-by agent alone until an XInput call on it raises
+	// wakeSignal on the I/O engine. that call then blocks until LeaveStandby() and a fresh report have come through,
+	// typically one report interval, so it never returns what piled up in the meantime.
+	void SetWakeSignal(uint32_t wakeSignal);  // 0 for none
+	uint64_t GetLastCallMilliseconds() const;  // HighResClock time of the latest XInput call on this agent
+	void EnterStandby();  // no-op without a device
+	void LeaveStandby();  // throw away what arrived while standing by
+	void ServiceStandby();  // keep the reads flowing while standing by so that a device going away is noticed
 
 
 private:
-	void InitWorkerThread();
-	bool ReattachToDevice();
-	bool InitDevice();  // NS Pro controller needs to be initialized via a private protocol
-	bool TryUpdate();
-	void WorkerThreadProc();
+	// the full state reports of a single read in arrival order, collected in one walk over it
+	struct ReportBatch
+	{
+		static constexpr unsigned int k_capacity = 2;  // packets that fit in a read
+
+		const Packet* reports[k_capacity];
+		unsigned int size;
+	};
+
 
+	// NS Pro controller needs to be initialized via a private protocol, and its calibration read. defined in Pro.cpp
+	class InitSequence;
 
+
+	void ContinueInit();  // hand what the device sent over to m_initSequence; closes the device if it failed
+	void FinishInit();
+	void CloseDevice();
+	void SendVibration();  // send the latest requested vibration if it's due and the write pipe is idle
+	void EnableMotion();  // ask the device to turn the motion sensors on if the write pipe is idle
+	void RecordAllReports(const ReportBatch& batch, uint64_t publishTicks);  // for latched buttons, the state history, and keystrokes
+	void RecordMotion(const ReportBatch& batch, uint64_t publishTicks);
+	void NoteCall(bool shouldWaitForResume) const;  // on game threads, first thing in every XInput call
+	void DiscardCompletedReads();  // re-issue every completed read, throwing its data away; closes the device if it's gone
+	void MeasureReportInterval(uint64_t publishTicks, unsigned int timestampStep);  // timestampStep is 0 for the first report
+
+
+	// everything a reader needs is kept together in a single cache line
 	struct CachedStates
 	{
 		// book-keeping
-		uint64_t timestamp;
-		mutable std::shared_mutex mutex;  // VS' implementation is simple enough so use STL here
+		uint64_t publishTicks;  // HighResClock; decides staleness too
+		uint32_t packetTimeoutMicroseconds;  // GetPacketTimeout() at the time of publishing
 
 		// actual data
 		XINPUT_STATE gamepad;
 		XINPUT_BATTERY_INFORMATION battery;
-
-		CachedStates();
 	};
+	static_assert(sizeof(SeqLock<CachedStates>) == std::hardware_destructive_interference_size);
 
 
+	const unsigned int m_userIndex;  // also decides which player light is turned on
+	DeviceIoEngine& m_ioEngine;  // ProRegistry's
+	std::wstring m_devicePath;
 	DeviceIoPipes m_devPipes;
-	CachedStates m_cachedStates;
-
-	std::unique_ptr<std::thread> m_workerThread;
-	volatile bool m_workerStopSignal : 1;
-	volatile bool m_deviceTriedFirstPull : 1;  // reset by ReattachToDevice()
+	std::unique_ptr<InitSequence> m_initSequence;  // service thread only; kept from one device to the next
+	std::atomic<bool> m_isDeviceReady;  // set once m_initSequence is done with the device; cleared by CloseDevice()
+	unsigned int m_numAttachFailures;  // service thread only; see GetAttachFailures()
+	PacketAdaptor m_packetAdaptor;
+	SeqLock<CachedStates> m_cachedStates;  // written only by the service thread
+
+	// every report of a read counts here, not just the published one, so short presses aren't lost between polls
+	const bool m_latchButtonPresses;  // Config::latchButtonPresses
+	mutable std::atomic<uint32_t> m_latchedKeys;  // PacketAdaptor::MapKeys() ORed since the last GetCachedState()
+	std::unique_ptr<BroadcastRing<HAGR_TIMED_STATE>> m_stateHistory;  // null if disabled; pushed by the service thread
+	KeystrokeGenerator m_keystrokeGenerator;  // service thread only
+	SpmcQueue<XINPUT_KEYSTROKE> m_keystrokes;  // pushed by the service thread, popped by XInputGetKeystroke()
+	std::atomic<bool> m_keystrokesWanted;  // set by the first PopKeystroke()
+
+	// nothing about motion is decoded until somebody asks for it
+	MotionDecoder m_motionDecoder;  // service thread only
+	BroadcastRing<HAGR_MOTION_SAMPLE> m_motionSamples;  // pushed by the service thread
+	std::atomic<bool> m_motionWanted;  // set by the first ReadMotion()
+	bool m_isMotionEnabled;  // service thread only; set once the device confirmed EnableIMU, reset by AttachToDevice()
+	uint64_t m_motionRequestTicks;  // HighResClock; service thread only; when EnableIMU was last sent, 0 if never
+
+	std::atomic<uint32_t> m_requestedVibration;  // left motor speed in the high word; written by XInputSetState()
+	uint32_t m_sentVibration;  // service thread only
+	uint64_t m_vibrationSentTime;  // HighResClock; service thread only
+	uint8_t m_outputSerialId;  // service thread only; the device wants it to count up with every rumble packet
+
+	mutable AgentStats m_stats;  // readers of cached states record into it too
+	uint8_t m_lastReportTimestamp;  // service thread only; for counting dropped reports
+	bool m_hasLastReportTimestamp;  // service thread only
+	uint64_t m_lastReportTicks;  // HighResClock; service thread only
+	uint32_t m_reportIntervalMicroseconds;  // moving average; 0 until measured. service thread only
+
+	mutable std::atomic<uint64_t> m_lastCallMilliseconds;  // HighResClock; see NoteCall()
+	std::atomic<bool> m_isInStandby;  // written by the service thread; cleared once a fresh report is published
+	uint64_t m_resumeTicks;  // HighResClock; service thread only; when LeaveStandby() or FinishInit() last ran
+	AutoHandle m_resumedEvent;  // manual-reset; reset while standing by
+	uint32_t m_wakeSignal;  // raised on m_ioEngine; 0 for none
+
+	AutoHandle m_firstPullEvent;  // manual-reset; signaled when m_deviceTriedFirstPull is set or device is closed
+	std::atomic<bool> m_deviceTriedFirstPull;  // never reset
 };
-
+#pragma warning(pop)
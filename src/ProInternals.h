@@ -83,12 +83,15 @@ namespace HostSubPacket
 {
 	enum class SubcommandCode : uint8_t
 	{
+		ReadSPIFlash = 0x10,
 		SetPlayerLights = 0x30,
+		EnableIMU = 0x40,
 		SetIMUSensitivity = 0x41,
 	};
 
 	enum class CommandCode : uint8_t
 	{
+		Status = 0x01,
 		HandShake = 0x02,
 		SetHighSpeed = 0x03,
 		ForceUSB = 0x04
@@ -101,13 +104,37 @@ namespace HostSubPacket
 		uint8_t lowFreq;
 		uint8_t lowFreqAmp;
 
+		static constexpr uint8_t k_maxAmplitude = 100;
+
 		constexpr static RumbleParam Neutral()
 		{
 			return { 0x00, 0x01, 0x40, 0x40 };
 		}
+
+		// both bands at their default frequencies, i.e., 160 Hz for the low band and 320 Hz for the high band.
+		// amplitudes are indices into the device's own logarithmic amplitude table ranging from 0 to k_maxAmplitude.
+		// the low band amplitude is 9-bit wide and borrows the top bit of lowFreq.
+		constexpr static RumbleParam FromAmplitudes(uint8_t lowAmp, uint8_t highAmp)
+		{
+			return {
+				0x00,
+				static_cast<uint8_t>(0x01 + highAmp * 2),
+				static_cast<uint8_t>(0x40 | ((lowAmp & 1) << 7)),
+				static_cast<uint8_t>(0x40 + lowAmp / 2)
+			};
+		}
 	};
 
 
+	// argument of SubcommandCode::ReadSPIFlash; also echoed in its reply
+	struct SPIFlashRange
+	{
+		static constexpr uint8_t k_maxSize = 0x1D;
+
+		uint32_t address;
+		uint8_t size;
+	};
+
 	// 0x01
 	struct RumbleAndSubcommand
 	{
@@ -115,12 +142,17 @@ namespace HostSubPacket
 		RumbleParam left;
 		RumbleParam right;
 		SubcommandCode subcmdCode;
-		uint32_t subcmdData;
+		union
+		{
+			uint32_t subcmdData;
+			SPIFlashRange spiFlashRange;
+		};
 	};
 
 	// 0x10
 	struct Rumble
 	{
+		uint8_t serialId;
 		RumbleParam left;
 		RumbleParam right;
 	};
@@ -156,19 +188,41 @@ namespace DeviceSubPacket
 	{
 		uint8_t subcmdAck;  // success if bit index 7 is set(?)
 		HostSubPacket::SubcommandCode subcmdCode;  // same as subcommand code sent in RumbleAndSubcommand packet
-		uint32_t data;  // unknown
+		union
+		{
+			uint32_t data;  // unknown
+
+			// reply to SubcommandCode::ReadSPIFlash
+			struct
+			{
+				HostSubPacket::SPIFlashRange range;
+				uint8_t data[HostSubPacket::SPIFlashRange::k_maxSize];
+			} spiFlash;
+		};
+	};
+
+	// one sample of the motion sensors in raw device units, along the device's own axes
+	struct MotionFrame
+	{
+		int16_t accel[3];
+		int16_t gyro[3];
 	};
 
 	// 0x30
 	struct FullStates : CommonStates
 	{
-		// no additional fields
+		MotionFrame motion[3];  // oldest first; all zeros unless SubcommandCode::EnableIMU turned the sensors on
 	};
 
 	// 0x81
 	struct CommandReply
 	{
 		HostSubPacket::CommandCode cmdCode;
+
+		// the rest is only meaningful in reply to CommandCode::Status
+		uint8_t unknown;
+		uint8_t deviceType;
+		uint8_t macAddress[6];  // in reverse order
 	};
 }  // namespace DeviceSubPacket
 
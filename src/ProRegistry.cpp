@@ -0,0 +1,521 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define NOMINMAX
+
+#include "ProRegistry.h"
+
+#include <algorithm>
+#include <array>
+#include <cwctype>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <windows.h>
+#include <avrt.h>
+#include <cfgmgr32.h>
+#include <initguid.h>
+#include <hidclass.h>
+#include <setupapi.h>
+
+#include "AutoHandle.h"
+#include "Config.h"
+#include "SteadyTimer.h"
+
+
+#pragma comment(lib, "avrt.lib")
+#pragma comment(lib, "cfgmgr32.lib")
+#pragma comment(lib, "setupapi.lib")
+
+
+
+namespace
+{
+
+
+constexpr std::chrono::milliseconds k_reattachRetryDelay(15);  // how soon we look again after an agent lost its device or failed to attach
+constexpr std::chrono::milliseconds k_maxReattachRetryDelay(2000);  // a device that keeps failing is retried no less often
+constexpr std::chrono::milliseconds k_standbyCheckInterval(1000);  // how often the reads are looked at while standing by
+
+// raised on the I/O engine to wake the service thread up
+constexpr uint32_t k_stopSignal = 1 << 0;  // quit
+constexpr uint32_t k_deviceArrivalSignal = 1 << 1;  // a Pro controller interface showed up
+constexpr uint32_t k_wakeSignal = 1 << 2;  // an XInput call on an agent standing by
+
+
+// apply Config's [Service] settings to the calling thread. return the MMCSS handle to revert before the thread
+// exits; null if the thread isn't registered. every setting is best effort, a failure leaves that one as it was.
+// doubles with every failure in a row of the same device path, as each retry enumerates and initializes anew
+std::chrono::milliseconds GetReattachRetryDelay(unsigned int numAttachFailures)
+{
+	constexpr unsigned int k_maxShift = 8;  // 15 ms << 8 is past the cap already
+	return std::min(k_reattachRetryDelay * (1u << std::min(numAttachFailures, k_maxShift)), k_maxReattachRetryDelay);
+}
+
+
+HANDLE ApplyServiceThreadSettings()
+{
+	const Config& config = Config::Get();
+	const HANDLE thread = GetCurrentThread();
+
+	if (config.serviceProcessor >= 0)
+	{
+		const auto processor = static_cast<DWORD>(config.serviceProcessor);
+		SetThreadIdealProcessor(thread, processor);
+		if (config.pinServiceToProcessor && processor < sizeof(DWORD_PTR) * 8)
+			SetThreadAffinityMask(thread, static_cast<DWORD_PTR>(1) << processor);
+	}
+
+	// MMCSS boosts the thread whenever it's runnable; an explicit priority still applies in between
+	HANDLE mmcssHandle = nullptr;
+	if (!config.mmcssTask.empty())
+	{
+		DWORD taskIndex = 0;
+		mmcssHandle = AvSetMmThreadCharacteristicsW(config.mmcssTask.c_str(), &taskIndex);
+	}
+	if (config.servicePriority != THREAD_PRIORITY_NORMAL)
+		SetThreadPriority(thread, config.servicePriority);
+
+	return mmcssHandle;
+}
+
+
+// return paths of every connected Pro controller in enumeration order
+std::vector<std::wstring> FindDevicePaths()
+{
+	std::vector<std::wstring> foundPaths;
+
+	HDEVINFO hDevInfoList = SetupDiGetClassDevsW(&GUID_DEVINTERFACE_HID, nullptr, nullptr, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+	if (hDevInfoList == INVALID_HANDLE_VALUE)
+		return foundPaths;
+
+	SP_DEVINFO_DATA devInfoData { sizeof(devInfoData) };
+	for (unsigned int i = 0; SetupDiEnumDeviceInfo(hDevInfoList, i, &devInfoData) != FALSE; ++i)
+	{
+		SP_DEVICE_INTERFACE_DATA devIntfData { sizeof(devIntfData) };
+		if (SetupDiEnumDeviceInterfaces(hDevInfoList, &devInfoData, &GUID_DEVINTERFACE_HID, 0, &devIntfData))
+		{
+			constexpr unsigned int buffSize = 1024;
+			uint8_t buffer[buffSize];
+			auto* devIntfDetail = reinterpret_cast<SP_DEVICE_INTERFACE_DETAIL_DATA_W*>(buffer);
+			devIntfDetail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+
+			if (SetupDiGetDeviceInterfaceDetailW(hDevInfoList, &devIntfData, devIntfDetail, buffSize, nullptr, nullptr) &&
+				ProRegistry::IsProDevicePath(devIntfDetail->DevicePath))
+			{
+				foundPaths.emplace_back(devIntfDetail->DevicePath);
+			}
+		}
+	}
+
+	SetupDiDestroyDeviceInfoList(hDevInfoList);
+	return foundPaths;
+}
+
+
+// device paths of the last run, one line per user index, so a warm start can open them without enumerating
+std::wstring GetKnownDevicesPath(bool createFolder)
+{
+	const std::wstring folder = GetCacheFolder(createFolder);
+	return folder.empty() ? folder : folder + L"\\devices.txt";
+}
+
+
+std::array<std::wstring, ProRegistry::k_maxAgents> LoadKnownDevicePaths()
+{
+	std::array<std::wstring, ProRegistry::k_maxAgents> result;
+
+	const std::wstring path = GetKnownDevicesPath(false);
+	if (path.empty())
+		return result;
+
+	AutoHandle file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (!file)
+		return result;
+
+	wchar_t buffer[ProRegistry::k_maxAgents * 256];
+	DWORD bytesRead;
+	if (ReadFile(file, buffer, sizeof(buffer), &bytesRead, nullptr) == FALSE)
+		return result;
+
+	// anything that doesn't look like a Pro controller is ignored, so a damaged file costs nothing
+	const std::wstring content(buffer, bytesRead / sizeof(wchar_t));
+	size_t lineStart = 0;
+	for (auto& knownPath : result)
+	{
+		const size_t lineEnd = content.find(L'\n', lineStart);
+		if (lineEnd == std::wstring::npos)
+			break;
+
+		knownPath = content.substr(lineStart, lineEnd - lineStart);
+		if (!ProRegistry::IsProDevicePath(knownPath.c_str()))
+			knownPath.clear();
+		lineStart = lineEnd + 1;
+	}
+
+	return result;
+}
+
+
+void SaveKnownDevicePaths(const std::array<std::wstring, ProRegistry::k_maxAgents>& paths)
+{
+	const std::wstring path = GetKnownDevicesPath(true);
+	if (path.empty())
+		return;
+
+	std::wstring content;
+	for (const auto& knownPath : paths)
+		content += knownPath + L'\n';
+
+	// another process may be saving the same file at the same time; whoever comes last wins, which is fine
+	AutoHandle file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (!file)
+		return;
+
+	DWORD bytesWritten;
+	WriteFile(file, content.c_str(), static_cast<DWORD>(content.size() * sizeof(wchar_t)), &bytesWritten, nullptr);
+}
+
+
+}  // unnamed namespace
+
+
+
+// ----------------------------------------------------------------------------
+// ProRegistry definitions ----------------------------------------------------
+
+ProRegistry::ProRegistry(TickHandler tickHandler)
+	: m_ioEngine()
+	, m_agents()
+	, m_tickHandler(std::move(tickHandler))
+	, m_captureWriter(!Config::Get().captureFile.empty() ? std::make_unique<CaptureWriter>(Config::Get().captureFile) : nullptr)
+	, m_replayFile(!Config::Get().replayFile.empty() ? std::make_unique<CaptureFile>(Config::Get().replayFile) : nullptr)
+	, m_replayDevices()
+	, m_arrivalNotification(nullptr)
+	, m_savedDevicePaths()
+	, m_serviceThread()
+{
+	assert(m_ioEngine.IsValid());
+
+	for (unsigned int i = 0; i < k_maxAgents; ++i)
+	{
+		m_agents[i].reset(new ProAgent(i, m_ioEngine));
+		m_agents[i]->SetWakeSignal(k_wakeSignal);
+		if (m_captureWriter && m_captureWriter->IsValid())
+			m_agents[i]->SetCaptureWriter(m_captureWriter.get());
+	}
+
+	if (m_replayFile && m_replayFile->IsValid())
+	{
+		for (const unsigned int channel : m_replayFile->GetChannels())
+			m_replayDevices.emplace_back(new ReplayDevice(*m_replayFile, channel, Config::Get().replayPaced));
+	}
+
+	// register before the service thread enumerates so that no arrival slips through in between
+	CM_NOTIFY_FILTER filter;
+	ZeroMemory(&filter, sizeof(filter));
+	filter.cbSize = sizeof(filter);
+	filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_HID;
+	if (CM_Register_Notification(&filter, this, &ProRegistry::OnDeviceNotification, &m_arrivalNotification) != CR_SUCCESS)
+		m_arrivalNotification = nullptr;
+
+	// device discovery happens on the service thread. until it's done, XInput calls report no controller
+	// rather than holding up the game's first frame.
+	m_serviceThread.reset(new std::thread(std::mem_fn(&ProRegistry::ServiceThreadProc), this));
+}
+
+ProRegistry::~ProRegistry()
+{
+	// no more callbacks run once this returns
+	if (m_arrivalNotification != nullptr)
+		CM_Unregister_Notification(m_arrivalNotification);
+
+	if (m_serviceThread)
+	{
+		m_ioEngine.Signal(k_stopSignal);
+		m_serviceThread->join();
+	}
+}
+
+ProAgent* ProRegistry::GetAgent(DWORD userIndex)
+{
+	return userIndex < k_maxAgents ? m_agents[userIndex].get() : nullptr;
+}
+
+// arrival notifications and SetupAPI don't agree on the case of device paths
+bool ProRegistry::IsProDevicePath(const wchar_t* path)
+{
+	constexpr wchar_t k_devicePathSigPro[] = L"hid#vid_057e&pid_2009";
+
+	std::wstring lowerPath(path);
+	for (auto& c : lowerPath)
+		c = static_cast<wchar_t>(std::towlower(c));
+	return wcsstr(lowerPath.c_str(), k_devicePathSigPro) != nullptr;
+}
+
+// called on a system thread pool thread
+DWORD CALLBACK ProRegistry::OnDeviceNotification(
+	[[maybe_unused]] HCMNOTIFICATION notification,
+	void* context,
+	CM_NOTIFY_ACTION action,
+	CM_NOTIFY_EVENT_DATA* eventData,
+	[[maybe_unused]] DWORD eventDataSize)
+{
+	// removals are noticed by the agents themselves when their reads fail
+	if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL && IsProDevicePath(eventData->u.DeviceInterface.SymbolicLink))
+		static_cast<ProRegistry*>(context)->m_ioEngine.Signal(k_deviceArrivalSignal);
+
+	return ERROR_SUCCESS;
+}
+
+std::vector<std::wstring> ProRegistry::FindReplayDevicePaths() const
+{
+	std::vector<std::wstring> foundPaths;
+	for (const auto& replayDevice : m_replayDevices)
+	{
+		if (!replayDevice->IsFinished())
+			foundPaths.push_back(replayDevice->GetPath());
+	}
+	return foundPaths;
+}
+
+bool ProRegistry::ReattachAgents()
+{
+	bool isEveryAttachSuccessful = true;
+
+	const auto devicePaths = m_replayFile ? FindReplayDevicePaths() : FindDevicePaths();
+	std::vector<bool> isPathClaimed(devicePaths.size(), false);
+
+	const auto& claimPath = [&devicePaths, &isPathClaimed](const std::wstring& path) {
+		for (size_t i = 0; i < devicePaths.size(); ++i)
+		{
+			if (!isPathClaimed[i] && devicePaths[i] == path)
+			{
+				isPathClaimed[i] = true;
+				return true;
+			}
+		}
+		return false;
+	};
+
+	for (const auto& agent : m_agents)
+	{
+		if (agent->HasDevice())
+			claimPath(agent->GetDevicePath());
+	}
+
+	// an agent gets back the device it had before, so replugging a controller keeps its user index and player light
+	for (const auto& agent : m_agents)
+	{
+		if (!agent->HasDevice() && !agent->GetDevicePath().empty() && claimPath(agent->GetDevicePath()))
+			isEveryAttachSuccessful &= agent->AttachToDevice(agent->GetDevicePath());
+	}
+
+	// devices nobody has seen before go to the lowest free user index
+	for (const auto& agent : m_agents)
+	{
+		if (agent->HasDevice())
+			continue;
+
+		for (size_t i = 0; i < devicePaths.size(); ++i)
+		{
+			if (!isPathClaimed[i])
+			{
+				isPathClaimed[i] = true;
+				isEveryAttachSuccessful &= agent->AttachToDevice(devicePaths[i]);
+				break;
+			}
+		}
+	}
+
+	return isEveryAttachSuccessful;
+}
+
+void ProRegistry::SaveDevicePathsIfChanged()
+{
+	// replays are named after the process; there's nothing to remember about them
+	if (m_replayFile)
+		return;
+
+	bool hasChanged = false;
+	for (unsigned int i = 0; i < k_maxAgents; ++i)
+	{
+		if (m_savedDevicePaths[i] != m_agents[i]->GetDevicePath())
+		{
+			m_savedDevicePaths[i] = m_agents[i]->GetDevicePath();
+			hasChanged = true;
+		}
+	}
+
+	if (hasChanged)
+		SaveKnownDevicePaths(m_savedDevicePaths);
+}
+
+void ProRegistry::ServiceThreadProc()
+{
+	const HANDLE mmcssHandle = ApplyServiceThreadSettings();
+
+	// warm start: the devices of the last run are opened right away, so those controllers come up without waiting
+	// for SetupAPI. an agent whose device is gone still prefers that path once it turns up again.
+	bool shouldRetryReattach = false;
+	bool hasSavedPath = false;
+	bool isEverySavedPathOpen = true;
+	if (!m_replayFile)
+		m_savedDevicePaths = LoadKnownDevicePaths();
+	for (unsigned int i = 0; i < k_maxAgents; ++i)
+	{
+		if (!m_savedDevicePaths[i].empty())
+		{
+			hasSavedPath = true;
+			isEverySavedPathOpen &= m_agents[i]->AttachToDevice(m_savedDevicePaths[i]);
+		}
+	}
+
+	// then enumerate only if the cache didn't work out, e.g. on the first run or after a controller was unplugged.
+	// free slots alone don't justify going through SetupAPI; controllers plugged in later come with a notification
+	if (!hasSavedPath || !isEverySavedPathOpen)
+		shouldRetryReattach |= !ReattachAgents();
+	SaveDevicePathsIfChanged();
+	if (m_tickHandler)
+		m_tickHandler(*this);
+
+	// with nobody calling XInput for a while we stand by, so that the CPU can sleep between reports nobody reads.
+	// a tick handler, e.g. the broker's, consumes every update on its own, so it keeps us going.
+	const uint64_t standbyTimeout = static_cast<uint64_t>(Config::Get().idleTimeoutSeconds) * 1000;  // ms
+	const bool canStandBy = !m_tickHandler && standbyTimeout != 0;
+	bool isInStandby = false;
+
+	DeviceIoEngine::Timer reattachTimer;  // armed to retry after an agent lost its device or failed to attach
+	DeviceIoEngine::Timer standbyCheckTimer;
+	while (true)
+	{
+		// we sleep until a read completes on any device, or until the cached states would go stale so that
+		// TryUpdate() can detect the time-out. agents without a device sit idle until a controller arrives,
+		// or until the retry timer fires after something went wrong. while standing by, the reads are only
+		// looked at now and then, until an XInput call wakes us up. a device being brought up can't wait for that.
+		bool isAnyAgentIdle = false;
+		bool isAnyAgentAttached = false;
+		bool isAnyReportReady = false;
+		std::chrono::microseconds packetTimeout = ProAgent::k_packetTimeout;  // the fastest device's decides
+		for (const auto& agent : m_agents)
+		{
+			if (agent->HasDevice())
+			{
+				packetTimeout = std::min(packetTimeout, agent->GetPacketTimeout());
+				isAnyAgentAttached = true;
+				isAnyReportReady |= agent->IsReportReady() && (!isInStandby || agent->IsInitializing());
+			}
+			else
+				isAnyAgentIdle = true;
+		}
+
+		// without notifications we have no choice but to keep looking for devices
+		shouldRetryReattach |= isAnyAgentIdle && m_arrivalNotification == nullptr;
+		if (shouldRetryReattach && !reattachTimer.IsArmed() && !reattachTimer.HasExpired())
+		{
+			unsigned int numAttachFailures = 0;
+			for (const auto& agent : m_agents)
+				numAttachFailures = std::max(numAttachFailures, agent->GetAttachFailures());
+			m_ioEngine.ArmTimer(reattachTimer, GetReattachRetryDelay(numAttachFailures));
+		}
+
+		// reports that piled up are taken one per wake-up, and a nested wait, e.g. while leaving standby, may have
+		// taken the completions and signals off the port already. the timers bound the wait by themselves.
+		DWORD waitTimeout = INFINITE;
+		if (isAnyReportReady || m_ioEngine.HasSignals())
+			waitTimeout = 0;
+		else if (isAnyAgentAttached && !isInStandby)
+			waitTimeout = static_cast<DWORD>(std::chrono::ceil<std::chrono::milliseconds>(packetTimeout).count());
+		if (!m_ioEngine.Pump(waitTimeout))
+			break;  // something went really wrong with the port
+
+		const uint32_t signals = m_ioEngine.TakeSignals();
+		if ((signals & k_stopSignal) != 0)
+			break;
+
+		const uint64_t wakeTicks = HighResClock::Now();
+		const bool hasDeviceArrived = (signals & k_deviceArrivalSignal) != 0;
+		const bool hasRetryTimerFired = reattachTimer.ConsumeExpiry();
+		const bool hasBeenWoken = (signals & k_wakeSignal) != 0;
+		const bool isStandbyCheckDue = standbyCheckTimer.ConsumeExpiry();
+
+		// a controller being plugged in is a sign of somebody about to play, too
+		if (isInStandby && (hasBeenWoken || hasDeviceArrived))
+		{
+			for (const auto& agent : m_agents)
+				agent->LeaveStandby();
+			m_ioEngine.CancelTimer(standbyCheckTimer);
+			isInStandby = false;
+		}
+
+		// polling an agent without a new report is cheap and lets it notice its states going stale.
+		// reads completing while standing by still wake us up, but only until every one of them has
+		shouldRetryReattach = false;
+		for (const auto& agent : m_agents)
+		{
+			const bool hadDevice = agent->HasDevice();
+			if (!isInStandby)
+				agent->TryUpdate();
+			else if (agent->IsInitializing())
+			{
+				agent->TryUpdate();
+				agent->EnterStandby();  // joins the others once it's up
+			}
+			else if (isStandbyCheckDue)
+				agent->ServiceStandby();
+			shouldRetryReattach |= hadDevice && !agent->HasDevice();  // the device may still be there
+		}
+		if (isInStandby && isStandbyCheckDue)
+			m_ioEngine.ArmTimer(standbyCheckTimer, k_standbyCheckInterval);
+
+		if (isAnyAgentIdle && (hasDeviceArrived || hasRetryTimerFired))
+		{
+			// what arrived may well be the failing device plugged in again, which deserves a fresh start
+			if (hasDeviceArrived)
+			{
+				for (const auto& agent : m_agents)
+					agent->ResetAttachFailures();
+			}
+			shouldRetryReattach |= !ReattachAgents();
+			SaveDevicePathsIfChanged();
+		}
+
+		if (canStandBy && !isInStandby && isAnyAgentAttached)
+		{
+			uint64_t lastCall = 0;
+			for (const auto& agent : m_agents)
+				lastCall = std::max(lastCall, agent->GetLastCallMilliseconds());
+			if (HighResClock::ToMicroseconds(wakeTicks) / 1000 >= lastCall + standbyTimeout)
+			{
+				for (const auto& agent : m_agents)
+					agent->EnterStandby();
+				m_ioEngine.ArmTimer(standbyCheckTimer, k_standbyCheckInterval);
+				isInStandby = true;
+			}
+		}
+
+		if (m_tickHandler)
+			m_tickHandler(*this);
+	}
+
+	if (mmcssHandle != nullptr)
+		AvRevertMmThreadCharacteristics(mmcssHandle);
+}
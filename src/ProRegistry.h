@@ -0,0 +1,78 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+#include <cfgmgr32.h>
+#include <xinput.h>
+
+#include "AutoHandle.h"
+#include "Capture.h"
+#include "DeviceIoEngine.h"
+#include "Pro.h"
+
+
+
+// enumerates every connected Pro controller and binds each to a stable XInput user index.
+// a single service thread drives all agents so the cost doesn't grow with the number of controllers.
+class ProRegistry
+{
+public:
+	static constexpr unsigned int k_maxAgents = XUSER_MAX_COUNT;
+
+	using TickHandler = std::function<void(ProRegistry&)>;  // runs on the service thread whenever agents were updated
+
+
+	explicit ProRegistry(TickHandler tickHandler = TickHandler());
+	~ProRegistry();
+
+	ProAgent* GetAgent(DWORD userIndex);  // return null if userIndex is out of range
+
+	static bool IsProDevicePath(const wchar_t* path);  // of a HID device interface, in any case
+
+
+private:
+	static DWORD CALLBACK OnDeviceNotification(HCMNOTIFICATION notification, void* context, CM_NOTIFY_ACTION action, CM_NOTIFY_EVENT_DATA* eventData, DWORD eventDataSize);
+
+	std::vector<std::wstring> FindReplayDevicePaths() const;  // the replays still playing; used in place of real devices
+	bool ReattachAgents();  // hand devices that no agent owns to agents without one; return false if any attempt failed
+	void SaveDevicePathsIfChanged();  // persist the agents' device paths for the next warm start
+	void ServiceThreadProc();
+
+
+	DeviceIoEngine m_ioEngine;  // every device's I/O completes here; the service thread pumps it
+	std::array<std::unique_ptr<ProAgent>, k_maxAgents> m_agents;  // indexed by user index
+	const TickHandler m_tickHandler;  // may be empty
+
+	// Config::captureFile and Config::replayFile. while replaying, real controllers are ignored
+	std::unique_ptr<CaptureWriter> m_captureWriter;  // null if not capturing
+	std::unique_ptr<CaptureFile> m_replayFile;  // null if not replaying
+	std::vector<std::unique_ptr<ReplayDevice>> m_replayDevices;  // one per channel of m_replayFile
+
+	HCMNOTIFICATION m_arrivalNotification;  // null if registration failed, in which case we fall back to the timer
+	std::array<std::wstring, k_maxAgents> m_savedDevicePaths;  // service thread only; what the cache file holds
+	std::unique_ptr<std::thread> m_serviceThread;
+};
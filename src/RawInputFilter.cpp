@@ -0,0 +1,265 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "RawInputFilter.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+
+#include <windows.h>
+#include <psapi.h>
+
+#include "LightWeightMutex.h"
+#include "ProRegistry.h"
+
+
+
+namespace
+{
+
+
+// user32's own; null until installed
+decltype(&GetRawInputData) s_getRawInputData = nullptr;
+decltype(&GetRawInputBuffer) s_getRawInputBuffer = nullptr;
+decltype(&GetRawInputDeviceList) s_getRawInputDeviceList = nullptr;
+bool s_isWow64 = false;
+
+
+// raw input device handles stay the same while a device is connected, and there are only a few of them, so the
+// device name is only asked for the first time a handle shows up
+class ProDeviceCache
+{
+public:
+	bool IsProDevice(HANDLE device)
+	{
+		{
+			std::scoped_lock lock(m_mutex);
+			for (const auto& entry : m_entries)
+			{
+				if (entry.device == device)
+					return entry.isPro;
+			}
+		}
+
+		wchar_t name[256];
+		UINT nameLength = static_cast<UINT>(std::size(name));
+		const bool isPro = GetRawInputDeviceInfoW(device, RIDI_DEVICENAME, name, &nameLength) != static_cast<UINT>(-1) &&
+			ProRegistry::IsProDevicePath(name);
+
+		// the oldest entry makes room; a handle of a device that's gone is never asked about again
+		std::scoped_lock lock(m_mutex);
+		m_entries[m_nextEntry] = { device, isPro };
+		m_nextEntry = (m_nextEntry + 1) % k_capacity;
+		return isPro;
+	}
+
+private:
+	static constexpr unsigned int k_capacity = 16;
+
+	struct Entry
+	{
+		HANDLE device;
+		bool isPro;
+	};
+
+	LWMutex m_mutex;
+	Entry m_entries[k_capacity] {};
+	unsigned int m_nextEntry = 0;
+};
+
+ProDeviceCache s_proDevices;
+
+
+bool IsFromProDevice(const RAWINPUTHEADER& header)
+{
+	return header.dwType == RIM_TYPEHID && s_proDevices.IsProDevice(header.hDevice);
+}
+
+
+UINT WINAPI FilteredGetRawInputData(HRAWINPUT hRawInput, UINT uiCommand, LPVOID pData, PUINT pcbSize, UINT cbSizeHeader)
+{
+	// neither a size query nor a failure has anything to look at
+	const UINT result = s_getRawInputData(hRawInput, uiCommand, pData, pcbSize, cbSizeHeader);
+	if (pData == nullptr || result == static_cast<UINT>(-1) || result < sizeof(RAWINPUTHEADER))
+		return result;
+
+	// a WM_INPUT already posted can't be taken back; to the caller the controller's input is as good as gone.
+	// anything asking for the size alone goes on to ask for the data, and is turned down then
+	if (!IsFromProDevice(*static_cast<const RAWINPUTHEADER*>(pData)))
+		return result;
+
+	SetLastError(ERROR_INVALID_HANDLE);
+	return static_cast<UINT>(-1);
+}
+
+
+UINT WINAPI FilteredGetRawInputBuffer(PRAWINPUT pData, PUINT pcbSize, UINT cbSizeHeader)
+{
+	// a buffer of nothing but the controllers' blocks would read as a drained queue, so we read on until a block
+	// is kept or the queue really is empty
+	const UINT bufferSize = pcbSize != nullptr ? *pcbSize : 0;
+	while (true)
+	{
+		// under WOW64 the blocks are laid out for 64 bits, which callers walk in ways of their own; they're left alone
+		const UINT count = s_getRawInputBuffer(pData, pcbSize, cbSizeHeader);
+		if (pData == nullptr || count == 0 || count == static_cast<UINT>(-1) || s_isWow64)
+			return count;
+
+		// the other blocks are moved up over the controller's. each still starts where NEXTRAWINPUTBLOCK() of the
+		// one before points, so the caller walks them just the same
+		RAWINPUT* source = pData;
+		RAWINPUT* destination = pData;
+		UINT numKept = 0;
+		for (UINT i = 0; i < count; ++i)
+		{
+			RAWINPUT* const nextSource = NEXTRAWINPUTBLOCK(source);
+			if (!IsFromProDevice(source->header))
+			{
+				if (destination != source)
+					memmove(destination, source, source->header.dwSize);
+				destination = NEXTRAWINPUTBLOCK(destination);
+				++numKept;
+			}
+			source = nextSource;
+		}
+		if (numKept != 0)
+			return numKept;
+
+		*pcbSize = bufferSize;  // in case the call wrote to it
+	}
+}
+
+
+UINT WINAPI FilteredGetRawInputDeviceList(PRAWINPUTDEVICELIST pRawInputDeviceList, PUINT puiNumDevices, UINT cbSize)
+{
+	// a count query still includes the controllers, which merely leaves the caller's list a bit roomier than needed
+	const UINT count = s_getRawInputDeviceList(pRawInputDeviceList, puiNumDevices, cbSize);
+	if (pRawInputDeviceList == nullptr || count == static_cast<UINT>(-1))
+		return count;
+
+	UINT numKept = 0;
+	for (UINT i = 0; i < count; ++i)
+	{
+		const RAWINPUTDEVICELIST& device = pRawInputDeviceList[i];
+		if (device.dwType != RIM_TYPEHID || !s_proDevices.IsProDevice(device.hDevice))
+			pRawInputDeviceList[numKept++] = device;
+	}
+	return numKept;
+}
+
+
+struct ImportPatch
+{
+	ULONG_PTR original;
+	ULONG_PTR replacement;
+};
+
+
+// imports are matched by the address they're bound to rather than by name, so that it doesn't matter whether a
+// module imports from user32.dll itself or through an API set. an entry already patched, e.g. by another Hagr
+// module of the same process, no longer matches.
+void PatchImports(HMODULE module, const ImportPatch* patches, size_t numPatches)
+{
+	auto* const base = reinterpret_cast<uint8_t*>(module);
+	const auto* dosHeader = reinterpret_cast<const IMAGE_DOS_HEADER*>(base);
+	if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+		return;
+	const auto* ntHeaders = reinterpret_cast<const IMAGE_NT_HEADERS*>(base + dosHeader->e_lfanew);
+	if (ntHeaders->Signature != IMAGE_NT_SIGNATURE)
+		return;
+
+	const IMAGE_DATA_DIRECTORY& importDirectory = ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	if (importDirectory.VirtualAddress == 0)
+		return;
+
+	for (auto* descriptor = reinterpret_cast<const IMAGE_IMPORT_DESCRIPTOR*>(base + importDirectory.VirtualAddress); descriptor->Name != 0; ++descriptor)
+	{
+		for (auto* thunk = reinterpret_cast<IMAGE_THUNK_DATA*>(base + descriptor->FirstThunk); thunk->u1.Function != 0; ++thunk)
+		{
+			for (size_t i = 0; i < numPatches; ++i)
+			{
+				if (thunk->u1.Function != patches[i].original)
+					continue;
+
+				// the table is usually read-only once the loader is done with it. a pointer-sized write is atomic, so
+				// a thread calling through it meanwhile gets either function
+				DWORD oldProtect;
+				if (VirtualProtect(&thunk->u1.Function, sizeof(thunk->u1.Function), PAGE_READWRITE, &oldProtect) != FALSE)
+				{
+					thunk->u1.Function = patches[i].replacement;
+					VirtualProtect(&thunk->u1.Function, sizeof(thunk->u1.Function), oldProtect, &oldProtect);
+				}
+				break;
+			}
+		}
+	}
+}
+
+
+void Install()
+{
+	const HMODULE user32 = GetModuleHandleW(L"user32.dll");
+	if (user32 == nullptr)
+		return;  // nobody in the process can be using raw input
+
+	s_getRawInputData = reinterpret_cast<decltype(&GetRawInputData)>(GetProcAddress(user32, "GetRawInputData"));
+	s_getRawInputBuffer = reinterpret_cast<decltype(&GetRawInputBuffer)>(GetProcAddress(user32, "GetRawInputBuffer"));
+	s_getRawInputDeviceList = reinterpret_cast<decltype(&GetRawInputDeviceList)>(GetProcAddress(user32, "GetRawInputDeviceList"));
+	if (s_getRawInputData == nullptr || s_getRawInputBuffer == nullptr || s_getRawInputDeviceList == nullptr)
+		return;
+
+	BOOL isWow64 = FALSE;
+	s_isWow64 = IsWow64Process(GetCurrentProcess(), &isWow64) != FALSE && isWow64 != FALSE;
+
+	const ImportPatch patches[] = {
+		{ reinterpret_cast<ULONG_PTR>(s_getRawInputData), reinterpret_cast<ULONG_PTR>(&FilteredGetRawInputData) },
+		{ reinterpret_cast<ULONG_PTR>(s_getRawInputBuffer), reinterpret_cast<ULONG_PTR>(&FilteredGetRawInputBuffer) },
+		{ reinterpret_cast<ULONG_PTR>(s_getRawInputDeviceList), reinterpret_cast<ULONG_PTR>(&FilteredGetRawInputDeviceList) },
+	};
+
+	// our own imports keep going to user32 along with everyone else's that we don't know of
+	HMODULE thisModule = nullptr;
+	GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCWSTR>(&Install), &thisModule);
+
+	HMODULE modules[1024];
+	DWORD bytesNeeded = 0;
+	if (EnumProcessModules(GetCurrentProcess(), modules, sizeof(modules), &bytesNeeded) == FALSE)
+		return;
+
+	const DWORD numModules = std::min<DWORD>(bytesNeeded, sizeof(modules)) / sizeof(HMODULE);
+	for (DWORD i = 0; i < numModules; ++i)
+	{
+		if (modules[i] != thisModule && modules[i] != user32)
+			PatchImports(modules[i], patches, std::size(patches));
+	}
+}
+
+
+}  // unnamed namespace
+
+
+
+void InstallRawInputFilter()
+{
+	static std::once_flag s_installFlag;
+	std::call_once(s_installFlag, &Install);
+}
@@ -0,0 +1,29 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+
+
+// hides the Pro controllers from raw input while every other device keeps its registration and its events. the raw
+// input functions of user32.dll are replaced in the import tables of the modules loaded by the time this is called,
+// so that reports, buffered reads and the device list all leave the controllers out. modules loaded later, or
+// resolving the functions with GetProcAddress(), still see them. neither are buffered reads of a 32-bit process
+// on 64-bit Windows filtered, as WOW64 hands out blocks in the 64-bit layout. only the first call does anything.
+void InstallRawInputFilter();
@@ -0,0 +1,97 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+
+// single-writer sequence lock. readers never block and never write to shared memory;
+// they retry in the rare case that a write happens while they copy the data.
+// the whole object occupies its own cache line(s) so it isn't falsely shared with neighbors.
+#pragma warning(push)
+#pragma warning(disable: 4324)  // structure was padded due to alignment specifier; that's the point
+template <typename T>
+class alignas(std::hardware_destructive_interference_size) SeqLock
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+	SeqLock()
+		: m_sequence(0)
+		, m_data()
+	{ }
+
+	// only one thread may write at a time. func receives a reference to the data to be modified in place.
+	template <typename F>
+	void Write(const F& func)
+	{
+		const uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+		m_sequence.store(sequence + 1, std::memory_order_relaxed);  // odd value means a write is in progress
+		std::atomic_thread_fence(std::memory_order_release);
+
+		func(m_data);
+
+		m_sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	T Read() const
+	{
+		T result;
+		uint32_t sequenceBefore;
+		uint32_t sequenceAfter;
+		do
+		{
+			sequenceBefore = m_sequence.load(std::memory_order_acquire);
+			memcpy(&result, &m_data, sizeof(result));  // may be torn; validated by the sequence check below
+			std::atomic_thread_fence(std::memory_order_acquire);
+			sequenceAfter = m_sequence.load(std::memory_order_relaxed);
+		} while ((sequenceBefore & 1) != 0 || sequenceBefore != sequenceAfter);
+
+		return result;
+	}
+
+	// the same as Read(), but give up after maxAttempts copies in a row that overlapped a write; result is then left
+	// torn. for locks in memory shared with another process, whose writer may die halfway through a write and leave
+	// the sequence odd for good.
+	bool TryRead(T& result, unsigned int maxAttempts) const
+	{
+		for (unsigned int i = 0; i < maxAttempts; ++i)
+		{
+			const uint32_t sequenceBefore = m_sequence.load(std::memory_order_acquire);
+			memcpy(&result, &m_data, sizeof(result));  // may be torn; validated by the sequence check below
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const uint32_t sequenceAfter = m_sequence.load(std::memory_order_relaxed);
+			if ((sequenceBefore & 1) == 0 && sequenceBefore == sequenceAfter)
+				return true;
+		}
+		return false;
+	}
+
+	SeqLock(const SeqLock&) = delete;
+	SeqLock& operator = (const SeqLock&) = delete;
+
+private:
+	std::atomic<uint32_t> m_sequence;
+	T m_data;
+};
+#pragma warning(pop)
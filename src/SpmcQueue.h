@@ -0,0 +1,109 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+
+// bounded queue with one producer and any number of consumers; every entry is popped by exactly one consumer.
+// neither side ever blocks. the producer drops new entries while the queue is full, and a consumer only retries
+// when another consumer popped the same entry first.
+#pragma warning(push)
+#pragma warning(disable: 4324)  // structure was padded due to alignment specifier; m_head and m_tail get cache lines of their own
+template <typename T>
+class SpmcQueue
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+	explicit SpmcQueue(unsigned int capacity)  // rounded up to a power of 2
+		: m_slots()
+		, m_capacity(1)
+		, m_head(0)
+		, m_tail(0)
+	{
+		while (m_capacity < capacity)
+			m_capacity <<= 1;
+		m_slots = std::make_unique<Slot[]>(m_capacity);
+		for (uint64_t i = 0; i < m_capacity; ++i)
+			m_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// only one thread may push at a time. return false if the queue is full.
+	bool Push(const T& value)
+	{
+		const uint64_t position = m_tail.load(std::memory_order_relaxed);
+		Slot& slot = m_slots[position & (m_capacity - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != position)
+			return false;  // still holds an entry from the previous lap
+
+		slot.value = value;
+		slot.sequence.store(position + 1, std::memory_order_release);
+		m_tail.store(position + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// return false if the queue is empty
+	bool Pop(T& result)
+	{
+		uint64_t position = m_head.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Slot& slot = m_slots[position & (m_capacity - 1)];
+			const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence != position + 1)
+			{
+				if (sequence == position)
+					return false;  // not pushed yet
+				position = m_head.load(std::memory_order_relaxed);  // another consumer got ahead of us
+				continue;
+			}
+
+			// on failure position is reloaded with the entry the winning consumer left for us
+			if (m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+			{
+				result = slot.value;
+				slot.sequence.store(position + m_capacity, std::memory_order_release);  // hand the slot back to the producer
+				return true;
+			}
+		}
+	}
+
+	SpmcQueue(const SpmcQueue&) = delete;
+	SpmcQueue& operator = (const SpmcQueue&) = delete;
+
+private:
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence;  // position + 1 while it holds an entry; the next lap's position once it's free
+		T value;
+	};
+
+
+	std::unique_ptr<Slot[]> m_slots;
+	uint64_t m_capacity;
+	alignas(std::hardware_destructive_interference_size) std::atomic<uint64_t> m_head;  // next position to pop
+	alignas(std::hardware_destructive_interference_size) std::atomic<uint64_t> m_tail;  // next position to push; producer only
+};
+#pragma warning(pop)
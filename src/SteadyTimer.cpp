@@ -22,12 +22,60 @@
 
 
 
+namespace
+{
+
+
+uint64_t QueryFrequency()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);  // never fails on XP and later
+	return static_cast<uint64_t>(frequency.QuadPart);
+}
+
+
+}  // unnamed namespace
+
+
+
+uint64_t HighResClock::Now()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return static_cast<uint64_t>(counter.QuadPart);
+}
+
+uint64_t HighResClock::ToMicroseconds(uint64_t ticks)
+{
+	const uint64_t frequency = GetFrequency();
+
+	// split to avoid overflowing when ticks is large
+	const uint64_t seconds = ticks / frequency;
+	const uint64_t remainder = ticks % frequency;
+	return seconds * 1000000 + remainder * 1000000 / frequency;
+}
+
+uint64_t HighResClock::GetFrequency()
+{
+	static const uint64_t s_frequency = QueryFrequency();
+	return s_frequency;
+}
+
+
 SteadyTimer::SteadyTimer()
-	: m_start(GetTickCount64())
+	: m_start(HighResClock::Now())
+{
+}
+
+std::chrono::microseconds SteadyTimer::GetElapsed() const
 {
+	return std::chrono::microseconds(HighResClock::ToMicroseconds(HighResClock::Now() - m_start));
 }
 
-std::chrono::milliseconds SteadyTimer::GetElapsed() const
+std::chrono::milliseconds SteadyTimer::GetRemaining(std::chrono::milliseconds timeout) const
 {
-	return std::chrono::milliseconds(GetTickCount64() - m_start);
+	const auto elapsed = GetElapsed();
+	if (elapsed >= timeout)
+		return std::chrono::milliseconds::zero();
+	return std::chrono::ceil<std::chrono::milliseconds>(timeout - elapsed);
 }
@@ -22,13 +22,24 @@
 #include <cstdint>
 
 
+// QueryPerformanceCounter based clock for measurements where milliseconds are too coarse
+namespace HighResClock
+{
+	uint64_t Now();  // in ticks
+	uint64_t ToMicroseconds(uint64_t ticks);
+	uint64_t GetFrequency();  // ticks per second
+}
+
+
+// measures elapsed time with HighResClock, so waits don't lose up to a system timer tick (10-16 ms)
 class SteadyTimer
 {
 public:
 	SteadyTimer();
 
-	std::chrono::milliseconds GetElapsed() const;
+	std::chrono::microseconds GetElapsed() const;
+	std::chrono::milliseconds GetRemaining(std::chrono::milliseconds timeout) const;  // rounded up; zero once timeout elapsed
 
 private:
-	const uint64_t m_start;
+	const uint64_t m_start;  // HighResClock ticks
 };
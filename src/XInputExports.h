@@ -0,0 +1,101 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// export configuration sets of the XInput functions, one per DLL name the DLL is built as.
+// shared by hagr.cpp and hagrStubs.cpp, each of which adds DllMain and its own extras.
+// x64 uses undecorated names while x86 uses decorated ones
+
+#if (TARGET_XINPUT_VER_1_3 + TARGET_XINPUT_VER_9_1_0 + TARGET_XINPUT_VER_UAP) > 1
+	#error Must define at most one of the followings: TARGET_XINPUT_VER_1_3=1, TARGET_XINPUT_VER_9_1_0=1, or TARGET_XINPUT_VER_UAP=1.
+#endif
+
+#if TARGET_XINPUT_VER_1_3 == 1
+	#if defined _WIN64
+		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@2")
+		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@3")
+		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@4")
+		#pragma comment(linker, "/export:XInputEnable=_XInputEnable,@5")
+		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=_XInputGetDSoundAudioDeviceGuids,@6")
+		#pragma comment(linker, "/export:XInputGetBatteryInformation=_XInputGetBatteryInformation,@7")
+		#pragma comment(linker, "/export:XInputGetKeystroke=_XInputGetKeystroke,@8")
+	#else
+		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@2")
+		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@3")
+		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@4")
+		#pragma comment(linker, "/export:XInputEnable=__XInputEnable@4,@5")
+		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=__XInputGetDSoundAudioDeviceGuids@12,@6")
+		#pragma comment(linker, "/export:XInputGetBatteryInformation=__XInputGetBatteryInformation@12,@7")
+		#pragma comment(linker, "/export:XInputGetKeystroke=__XInputGetKeystroke@12,@8")
+	#endif
+
+#elif TARGET_XINPUT_VER_9_1_0 == 1
+	#if defined _WIN64
+		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@2")
+		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=_XInputGetDSoundAudioDeviceGuids,@3")
+		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@4")
+		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@5")
+	#else
+		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@2")
+		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=__XInputGetDSoundAudioDeviceGuids@12,@3")
+		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@4")
+		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@5")
+	#endif
+
+#elif TARGET_XINPUT_VER_UAP == 1
+	#if defined _WIN64
+		#pragma comment(linker, "/export:XInputEnable=_XInputEnable,@2")
+		#pragma comment(linker, "/export:XInputGetAudioDeviceIds=_XInputGetAudioDeviceIds,@3")
+		#pragma comment(linker, "/export:XInputGetBatteryInformation=_XInputGetBatteryInformation,@4")
+		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@5")
+		#pragma comment(linker, "/export:XInputGetKeystroke=_XInputGetKeystroke,@6")
+		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@7")
+		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@8")
+	#else
+		#pragma comment(linker, "/export:XInputEnable=__XInputEnable@4,@2")
+		#pragma comment(linker, "/export:XInputGetAudioDeviceIds=__XInputGetAudioDeviceIds@20,@3")
+		#pragma comment(linker, "/export:XInputGetBatteryInformation=__XInputGetBatteryInformation@12,@4")
+		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@5")
+		#pragma comment(linker, "/export:XInputGetKeystroke=__XInputGetKeystroke@12,@6")
+		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@7")
+		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@8")
+	#endif
+
+#else  // xinput1_4.dll, which hagr.vcxproj builds
+	#if defined _WIN64
+		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@2")
+		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@3")
+		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@4")
+		#pragma comment(linker, "/export:XInputEnable=_XInputEnable,@5")
+		#pragma comment(linker, "/export:XInputGetAudioDeviceIds=_XInputGetAudioDeviceIds,@6")
+		#pragma comment(linker, "/export:XInputGetBatteryInformation=_XInputGetBatteryInformation,@7")
+		#pragma comment(linker, "/export:XInputGetKeystroke=_XInputGetKeystroke,@8")
+		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=_XInputGetDSoundAudioDeviceGuids,@9")
+	#else
+		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@2")
+		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@3")
+		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@4")
+		#pragma comment(linker, "/export:XInputEnable=__XInputEnable@4,@5")
+		#pragma comment(linker, "/export:XInputGetAudioDeviceIds=__XInputGetAudioDeviceIds@20,@6")
+		#pragma comment(linker, "/export:XInputGetBatteryInformation=__XInputGetBatteryInformation@12,@7")
+		#pragma comment(linker, "/export:XInputGetKeystroke=__XInputGetKeystroke@12,@8")
+		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=__XInputGetDSoundAudioDeviceGuids@12,@9")
+	#endif
+
+#endif
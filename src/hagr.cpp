@@ -27,7 +27,13 @@
 #include <hidusage.h>
 #include <xinput.h>
 
+#include "hagr.h"
+#include "Broker.h"
+#include "Config.h"
 #include "Pro.h"
+#include "ProRegistry.h"
+#include "RawInputFilter.h"
+#include "SteadyTimer.h"
 
 
 
@@ -35,25 +41,120 @@ namespace
 {
 
 
+#if HAGR_DIRECT_BINDING
+
+// with direct binding every XInput DLL carries the whole implementation, and a process may load more than one of them,
+// e.g. xinput1_3.dll for the game and xinput1_4.dll for an overlay. the first Hagr module used serves the process and
+// the others forward their calls to it, so the controllers are only opened once.
+struct DispatchTable
+{
+	size_t size;  // sizeof(DispatchTable) of the module which filled it; different sizes mean different builds
+	decltype(XInputGetState)* getState;
+	decltype(XInputSetState)* setState;
+	decltype(XInputGetCapabilities)* getCapabilities;
+	void (__stdcall* enable)(BOOL enable);  // XInputEnable() is deprecated in newer SDKs
+	decltype(XInputGetAudioDeviceIds)* getAudioDeviceIds;
+	decltype(XInputGetBatteryInformation)* getBatteryInformation;
+	decltype(XInputGetKeystroke)* getKeystroke;
+	DWORD (__stdcall* getDSoundAudioDeviceGuids)(DWORD dwUserIndex, GUID* pDSoundRenderGuid, GUID* pDSoundCaptureGuid);  // removed in newer SDKs
+	PFN_HAGR_GET_STATS getStats;
+	PFN_HAGR_GET_STATE_EX getStateEx;
+	PFN_HAGR_READ_STATE_HISTORY readStateHistory;
+	PFN_HAGR_READ_MOTION readMotion;
+};
+
+const DispatchTable* GetForwardTable();  // null if this module serves the process
+
+// hand the call over to the module serving the process unless it's this one
+#define HAGR_FORWARD(func, ...)	do { if (const DispatchTable* forwardTable = GetForwardTable()) return forwardTable->func(__VA_ARGS__); } while (false)
+
+#else
+
+#define HAGR_FORWARD(func, ...)	((void)0)
+
+#endif  // HAGR_DIRECT_BINDING
+
+
 // Unity may be pulling data from raw input interface provided by User32.dll.
-// it may thus interfere with Hagr so we must disable it.
-class RawInputDisabler
+// it may thus interfere with Hagr so we must disable it, or at least hide the Pro controllers from it.
+class RawInputGuard
 {
 public:
-	RawInputDisabler()
+	RawInputGuard()
 	{
-		// unregister raw input for joystick devices (HID code of Pro is a joystick rather than a gamepad)
-		RAWINPUTDEVICE inputDev { HID_USAGE_PAGE_GENERIC, HID_USAGE_GENERIC_JOYSTICK, RIDEV_REMOVE, nullptr };
-		RegisterRawInputDevices(&inputDev, 1, sizeof(inputDev));
+		switch (Config::Get().rawInputMode)
+		{
+		case Config::RawInputMode::Unregister:
+		{
+			// unregister raw input for joystick devices (HID code of Pro is a joystick rather than a gamepad)
+			RAWINPUTDEVICE inputDev { HID_USAGE_PAGE_GENERIC, HID_USAGE_GENERIC_JOYSTICK, RIDEV_REMOVE, nullptr };
+			RegisterRawInputDevices(&inputDev, 1, sizeof(inputDev));
+			break;
+		}
+		case Config::RawInputMode::Filter:
+			InstallRawInputFilter();  // other joysticks, e.g. wheels and flight sticks, keep working through raw input
+			break;
+		case Config::RawInputMode::Keep:
+			break;
+		}
 	}
 };
 
 
-ProAgent& GetProAgent()
+// return null unless this process reads the controllers through hagrBroker.exe. decided on first use, and given up
+// on if the broker exits.
+BrokerClient* GetBrokerClient()
+{
+	static RawInputGuard s_rawInputGuard;
+	static BrokerClient s_brokerClient;  // only maps the broker's shared memory; nothing happens if it isn't there
+	// once the broker has exited, the process falls back to opening the controllers itself, and stays with that
+	return Config::Get().useBroker && s_brokerClient.IsValid() && !s_brokerClient.HasBrokerExited() ? &s_brokerClient : nullptr;
+}
+
+
+// return null if no agent serves dwUserIndex, including when the broker serves this process.
+// the registry is only created the first time the broker doesn't serve the process, which may be long after start-up
+ProAgent* GetProAgent(DWORD dwUserIndex)
+{
+	if (GetBrokerClient() != nullptr)
+		return nullptr;
+
+	static ProRegistry s_proRegistry;
+	return s_proRegistry.GetAgent(dwUserIndex);
+}
+
+
+// ProAgent::IsDeviceValid() of whichever side serves this process. a device that is being brought up when the
+// registry starts is waited for to get its first state
+bool IsUserConnected(DWORD dwUserIndex)
+{
+	if (const BrokerClient* brokerClient = GetBrokerClient())
+		return brokerClient->IsDeviceValid(dwUserIndex);
+
+	const ProAgent* proAgent = GetProAgent(dwUserIndex);
+	if (proAgent == nullptr)
+		return false;
+
+	proAgent->WaitForFirstCachedState(ProAgent::k_firstStateTimeout);
+	return proAgent->IsDeviceValid();
+}
+
+
+// both return the same as ProAgent's methods of the same name
+bool GetCachedState(DWORD dwUserIndex, __out XINPUT_STATE& result, __out uint64_t& publishTicks)
+{
+	if (const BrokerClient* brokerClient = GetBrokerClient())
+		return brokerClient->GetCachedState(dwUserIndex, result, publishTicks);
+
+	return GetProAgent(dwUserIndex)->GetCachedState(result, publishTicks);
+}
+
+bool GetBatteryInfo(DWORD dwUserIndex, __out XINPUT_BATTERY_INFORMATION& result)
 {
-	static RawInputDisabler s_rawInputDisabler;
-	static ProAgent s_proAgent;
-	return s_proAgent;
+	if (const BrokerClient* brokerClient = GetBrokerClient())
+		return brokerClient->GetBatteryInfo(dwUserIndex, result);
+
+	return GetProAgent(dwUserIndex)->GetBatteryInfo(result);
 }
 
 
@@ -68,17 +169,16 @@ DWORD __stdcall _XInputGetState(
 	DWORD dwUserIndex,
 	__out XINPUT_STATE* pState)
 {
-	ProAgent& proAgent = GetProAgent();
+	HAGR_FORWARD(getState, dwUserIndex, pState);
 
-	if (!proAgent.IsDeviceValid() || dwUserIndex > 0)
+	if (!IsUserConnected(dwUserIndex))
 	{
 		dbgPrint("XInputGetState disconnected %d\n", dwUserIndex);
 		return ERROR_DEVICE_NOT_CONNECTED;
 	}
 
-	proAgent.WaitForFirstCachedState();
-
-	const bool result = proAgent.GetCachedState(*pState);
+	uint64_t unusedPublishTicks;
+	const bool result = GetCachedState(dwUserIndex, *pState, unusedPublishTicks);
 	dbgPrint("XInputGetState %d %04X %08X\n", result, pState->dwPacketNumber, pState->Gamepad.wButtons);
 
 	// some games stop pulling states once an non-zero value is returned.
@@ -92,15 +192,22 @@ DWORD __stdcall _XInputGetState(
 
 DWORD __stdcall _XInputSetState(
 	DWORD dwUserIndex,
-	[[maybe_unused]] XINPUT_VIBRATION* pVibration)
+	XINPUT_VIBRATION* pVibration)
 {
-	ProAgent& proAgent = GetProAgent();
+	HAGR_FORWARD(setState, dwUserIndex, pVibration);
 
 	dbgPrint("XInputSetState %d\n", dwUserIndex);
 
-	if (!proAgent.IsDeviceValid() || dwUserIndex > 0)
+	if (!IsUserConnected(dwUserIndex))
 		return ERROR_DEVICE_NOT_CONNECTED;
 
+	if (pVibration == nullptr)
+		return NO_ERROR;
+
+	if (BrokerClient* brokerClient = GetBrokerClient())
+		brokerClient->SetVibration(dwUserIndex, *pVibration);
+	else
+		GetProAgent(dwUserIndex)->SetVibration(*pVibration);
 	return NO_ERROR;
 }
 
@@ -110,11 +217,11 @@ DWORD __stdcall _XInputGetCapabilities(
 	[[maybe_unused]] DWORD dwFlags,
 	__out XINPUT_CAPABILITIES* pCapabilities)
 {
-	ProAgent& proAgent = GetProAgent();
+	HAGR_FORWARD(getCapabilities, dwUserIndex, dwFlags, pCapabilities);
 
 	dbgPrint("XInputGetCapabilities\n");
 
-	if (!proAgent.IsDeviceValid() || dwUserIndex > 0)
+	if (!IsUserConnected(dwUserIndex))
 		return ERROR_DEVICE_NOT_CONNECTED;
 
 	// values read from a real Xbox One controller connected with USB cable
@@ -137,6 +244,8 @@ DWORD __stdcall _XInputGetCapabilities(
 
 void __stdcall _XInputEnable(BOOL enable)
 {
+	HAGR_FORWARD(enable, enable);
+
 	dbgPrint("XInputEnable %d\n", enable);
 }
 
@@ -148,11 +257,11 @@ DWORD __stdcall _XInputGetAudioDeviceIds(
 	[[maybe_unused]] __out_ecount_opt(*pCaptureCount) LPWSTR pCaptureDeviceId,
 	[[maybe_unused]] __inout_opt UINT* pCaptureCount)
 {
-	ProAgent& proAgent = GetProAgent();
+	HAGR_FORWARD(getAudioDeviceIds, dwUserIndex, pRenderDeviceId, pRenderCount, pCaptureDeviceId, pCaptureCount);
 
 	dbgPrint("XInputGetAudioDeviceIds\n");
 
-	if (!proAgent.IsDeviceValid() || dwUserIndex > 0)
+	if (!IsUserConnected(dwUserIndex))
 		return ERROR_DEVICE_NOT_CONNECTED;
 
 	return ERROR_DEVICE_NOT_CONNECTED;
@@ -164,17 +273,15 @@ DWORD __stdcall _XInputGetBatteryInformation(
 	BYTE devType,
 	__out XINPUT_BATTERY_INFORMATION* pBatteryInformation)
 {
-	ProAgent& proAgent = GetProAgent();
+	HAGR_FORWARD(getBatteryInformation, dwUserIndex, devType, pBatteryInformation);
 
-	if (!proAgent.IsDeviceValid() || dwUserIndex > 0 || devType != BATTERY_DEVTYPE_GAMEPAD)
+	if (!IsUserConnected(dwUserIndex) || devType != BATTERY_DEVTYPE_GAMEPAD)
 	{
 		dbgPrint("XInputGetBatteryInformation disconnected %d\n", dwUserIndex);
 		return ERROR_DEVICE_NOT_CONNECTED;
 	}
 
-	proAgent.WaitForFirstCachedState();
-
-	const bool result = proAgent.GetBatteryInfo(*pBatteryInformation);
+	const bool result = GetBatteryInfo(dwUserIndex, *pBatteryInformation);
 	dbgPrint("XInputGetBatteryInformation %d %02X %02X\n", result, pBatteryInformation->BatteryType, pBatteryInformation->BatteryLevel);
 
 	// for the same reason as in XInputGetState(), we fake the battery state
@@ -190,16 +297,30 @@ DWORD __stdcall _XInputGetBatteryInformation(
 DWORD __stdcall _XInputGetKeystroke(
 	DWORD dwUserIndex,
 	[[maybe_unused]] __reserved DWORD dwReserved,
-	[[maybe_unused]] __out XINPUT_KEYSTROKE* pKeystroke)
+	__out XINPUT_KEYSTROKE* pKeystroke)
 {
-	ProAgent& proAgent = GetProAgent();
+	HAGR_FORWARD(getKeystroke, dwUserIndex, dwReserved, pKeystroke);
 
 	dbgPrint("XInputGetKeystroke\n");
 
-	if (!proAgent.IsDeviceValid() || dwUserIndex > 0)
-		return ERROR_DEVICE_NOT_CONNECTED;
+	// XUSER_INDEX_ANY takes the first queued keystroke of any connected controller
+	const DWORD firstUserIndex = dwUserIndex == XUSER_INDEX_ANY ? 0 : dwUserIndex;
+	const DWORD lastUserIndex = dwUserIndex == XUSER_INDEX_ANY ? XUSER_MAX_COUNT - 1 : dwUserIndex;
+
+	// keystrokes are generated by agents in this process only; with the broker there's never any
+	bool isAnyConnected = false;
+	for (DWORD userIndex = firstUserIndex; userIndex <= lastUserIndex; ++userIndex)
+	{
+		if (!IsUserConnected(userIndex))
+			continue;
+
+		isAnyConnected = true;
+		ProAgent* proAgent = GetProAgent(userIndex);
+		if (proAgent != nullptr && proAgent->PopKeystroke(*pKeystroke))
+			return NO_ERROR;
+	}
 
-	return ERROR_EMPTY;  // we basically don't support this function
+	return isAnyConnected ? ERROR_EMPTY : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
@@ -208,15 +329,214 @@ DWORD __stdcall _XInputGetDSoundAudioDeviceGuids(
 	[[maybe_unused]] __out GUID* pDSoundRenderGuid,
 	[[maybe_unused]] __out GUID* pDSoundCaptureGuid)
 {
+	HAGR_FORWARD(getDSoundAudioDeviceGuids, dwUserIndex, pDSoundRenderGuid, pDSoundCaptureGuid);
+
 	dbgPrint("XInputGetDSoundAudioDeviceGuids\n");
 
 	return ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
+DWORD __stdcall HagrGetStats(
+	DWORD dwUserIndex,
+	__out HAGR_STATS* pStats)
+{
+	HAGR_FORWARD(getStats, dwUserIndex, pStats);
+
+	if (pStats == nullptr || pStats->dwSize < sizeof(HAGR_STATS))
+		return ERROR_BAD_ARGUMENTS;
+
+	// the counters live in the broker process
+	if (GetBrokerClient() != nullptr)
+		return ERROR_NOT_SUPPORTED;
+
+	// counters are reported even while the device is disconnected
+	ProAgent* proAgent = GetProAgent(dwUserIndex);
+	if (proAgent == nullptr)
+		return ERROR_DEVICE_NOT_CONNECTED;
+
+	proAgent->GetStats(*pStats);
+	return NO_ERROR;
+}
+
+
+DWORD __stdcall HagrGetStateEx(
+	DWORD dwUserIndex,
+	__inout HAGR_STATE_EX* pState)
+{
+	HAGR_FORWARD(getStateEx, dwUserIndex, pState);
+
+	if (pState == nullptr || pState->dwSize < sizeof(HAGR_STATE_EX))
+		return ERROR_BAD_ARGUMENTS;
+
+	if (!IsUserConnected(dwUserIndex))
+		return ERROR_DEVICE_NOT_CONNECTED;
+
+	uint64_t publishTicks;
+	const bool result = GetCachedState(dwUserIndex, pState->state, publishTicks);
+	pState->timestampMicroseconds = publishTicks != 0 ? HighResClock::ToMicroseconds(publishTicks) : 0;
+	pState->ageMicroseconds = publishTicks != 0 ? HighResClock::ToMicroseconds(HighResClock::Now() - publishTicks) : 0;
+
+	// the same neutral state as XInputGetState(); the age still tells how stale the real one is
+	if (!result)
+		ZeroMemory(&pState->state, sizeof(pState->state));
+	return NO_ERROR;
+}
+
+
+DWORD __stdcall HagrReadStateHistory(
+	DWORD dwUserIndex,
+	__inout ULONGLONG* pCursor,
+	__out_ecount(*pCount) HAGR_TIMED_STATE* pStates,
+	__inout DWORD* pCount)
+{
+	HAGR_FORWARD(readStateHistory, dwUserIndex, pCursor, pStates, pCount);
+
+	if (pCursor == nullptr || pCount == nullptr || (pStates == nullptr && *pCount != 0))
+		return ERROR_BAD_ARGUMENTS;
+
+	if (GetBrokerClient() != nullptr)
+	{
+		*pCount = 0;
+		return ERROR_NOT_SUPPORTED;  // the history lives in the broker process
+	}
+
+	ProAgent* proAgent = GetProAgent(dwUserIndex);
+	if (proAgent == nullptr || !proAgent->IsDeviceValid())
+	{
+		*pCount = 0;
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	return proAgent->ReadStateHistory(*pCursor, pStates, *pCount) ? NO_ERROR : ERROR_NOT_SUPPORTED;
+}
+
+
+DWORD __stdcall HagrReadMotion(
+	DWORD dwUserIndex,
+	__inout ULONGLONG* pCursor,
+	__out_ecount(*pCount) HAGR_MOTION_SAMPLE* pSamples,
+	__inout DWORD* pCount)
+{
+	HAGR_FORWARD(readMotion, dwUserIndex, pCursor, pSamples, pCount);
+
+	if (pCursor == nullptr || pCount == nullptr || (pSamples == nullptr && *pCount != 0))
+		return ERROR_BAD_ARGUMENTS;
+
+	if (GetBrokerClient() != nullptr)
+	{
+		*pCount = 0;
+		return ERROR_NOT_SUPPORTED;  // the broker doesn't share motion
+	}
+
+	ProAgent* proAgent = GetProAgent(dwUserIndex);
+	if (proAgent == nullptr || !proAgent->IsDeviceValid())
+	{
+		*pCount = 0;
+		return ERROR_DEVICE_NOT_CONNECTED;
+	}
+
+	proAgent->ReadMotion(*pCursor, pSamples, *pCount);
+	return NO_ERROR;
+}
+
+
+#if HAGR_DIRECT_BINDING
+
+// the DispatchTable other Hagr modules of this process forward to
+const void* __stdcall HagrGetDispatchTable();
+
+#endif  // HAGR_DIRECT_BINDING
+
+
 }  // extern "C"
 
 
+
+#if HAGR_DIRECT_BINDING
+
+namespace
+{
+
+
+const DispatchTable k_dispatchTable = {
+	sizeof(DispatchTable),
+	_XInputGetState,
+	_XInputSetState,
+	_XInputGetCapabilities,
+	_XInputEnable,
+	_XInputGetAudioDeviceIds,
+	_XInputGetBatteryInformation,
+	_XInputGetKeystroke,
+	_XInputGetDSoundAudioDeviceGuids,
+	HagrGetStats,
+	HagrGetStateEx,
+	HagrReadStateHistory,
+	HagrReadMotion,
+};
+
+
+HMODULE GetThisModule()
+{
+	HMODULE module = nullptr;
+	GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCWSTR>(&GetThisModule), &module);
+	return module;
+}
+
+
+// return null if this module serves the process. the first module to get here claims the process in a section named after it.
+// the claim is never given up, so the serving module is pinned for the others calling into it.
+HMODULE FindServingModule()
+{
+	wchar_t sectionName[64];
+	swprintf_s(sectionName, L"Local\\HagrProcess.%lu", GetCurrentProcessId());
+
+	// the handle is deliberately leaked to keep the section alive for the modules coming later.
+	// it's as large as a page anyway, so we have plenty of room for the single pointer in it.
+	HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(void*), sectionName);
+	void* view = section != nullptr ? MapViewOfFile(section, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(void*)) : nullptr;
+	if (view == nullptr)
+		return nullptr;  // serve the process on our own; at worst the controllers are opened by two modules
+
+	HMODULE thisModule = GetThisModule();
+	void* servingModule = InterlockedCompareExchangePointer(static_cast<void* volatile*>(view), thisModule, nullptr);  // a new section is zero-filled
+	if (servingModule != nullptr && servingModule != thisModule)
+		return static_cast<HMODULE>(servingModule);
+
+	HMODULE pinnedModule;
+	GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, reinterpret_cast<LPCWSTR>(&GetThisModule), &pinnedModule);
+	return nullptr;
+}
+
+
+const DispatchTable* GetForwardTable()
+{
+	// decided once, on first use. that's never under the loader lock unlike what DllMain() would be
+	static const DispatchTable* const s_forwardTable = [] () -> const DispatchTable* {
+		HMODULE servingModule = FindServingModule();
+		if (servingModule == nullptr)
+			return nullptr;
+
+		using PFN_HAGR_GET_DISPATCH_TABLE = decltype(&HagrGetDispatchTable);
+		auto getDispatchTable = reinterpret_cast<PFN_HAGR_GET_DISPATCH_TABLE>(GetProcAddress(servingModule, "HagrGetDispatchTable"));
+		const auto* table = getDispatchTable != nullptr ? static_cast<const DispatchTable*>(getDispatchTable()) : nullptr;
+		return table != nullptr && table->size == sizeof(DispatchTable) ? table : nullptr;  // serve on our own if builds differ
+	}();
+	return s_forwardTable;
+}
+
+
+}  // unnames namespace
+
+
+const void* __stdcall HagrGetDispatchTable()
+{
+	return &k_dispatchTable;
+}
+
+#endif  // HAGR_DIRECT_BINDING
+
+
 __declspec(dllexport) BOOL __stdcall DllMain(
 	[[maybe_unused]] HINSTANCE hinstDLL,
 	DWORD fdwReason,
@@ -242,22 +562,23 @@ __declspec(dllexport) BOOL __stdcall DllMain(
 // x64 uses undecorated names while x86 uses decorated ones
 #if defined _WIN64
 	#pragma comment(linker, "/export:DllMain,@1")
-	#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@2")
-	#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@3")
-	#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@4")
-	#pragma comment(linker, "/export:XInputEnable=_XInputEnable,@5")
-	#pragma comment(linker, "/export:XInputGetAudioDeviceIds=_XInputGetAudioDeviceIds,@6")
-	#pragma comment(linker, "/export:XInputGetBatteryInformation=_XInputGetBatteryInformation,@7")
-	#pragma comment(linker, "/export:XInputGetKeystroke=_XInputGetKeystroke,@8")
-	#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=_XInputGetDSoundAudioDeviceGuids,@9")
+	#pragma comment(linker, "/export:HagrGetStats,@100")
+	#pragma comment(linker, "/export:HagrReadStateHistory,@101")
+	#pragma comment(linker, "/export:HagrGetStateEx,@102")
+	#pragma comment(linker, "/export:HagrReadMotion,@103")
+	#if HAGR_DIRECT_BINDING
+		#pragma comment(linker, "/export:HagrGetDispatchTable,@199")
+	#endif
 #else
 	#pragma comment(linker, "/export:DllMain=_DllMain@12,@1")
-	#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@2")
-	#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@3")
-	#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@4")
-	#pragma comment(linker, "/export:XInputEnable=__XInputEnable@4,@5")
-	#pragma comment(linker, "/export:XInputGetAudioDeviceIds=__XInputGetAudioDeviceIds@20,@6")
-	#pragma comment(linker, "/export:XInputGetBatteryInformation=__XInputGetBatteryInformation@12,@7")
-	#pragma comment(linker, "/export:XInputGetKeystroke=__XInputGetKeystroke@12,@8")
-	#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=__XInputGetDSoundAudioDeviceGuids@12,@9")
+	#pragma comment(linker, "/export:HagrGetStats=_HagrGetStats@8,@100")
+	#pragma comment(linker, "/export:HagrReadStateHistory=_HagrReadStateHistory@16,@101")
+	#pragma comment(linker, "/export:HagrGetStateEx=_HagrGetStateEx@8,@102")
+	#pragma comment(linker, "/export:HagrReadMotion=_HagrReadMotion@16,@103")
+	#if HAGR_DIRECT_BINDING
+		#pragma comment(linker, "/export:HagrGetDispatchTable=_HagrGetDispatchTable@0,@199")
+	#endif
 #endif
+
+// the XInput functions of whichever DLL this is built as; xinput1_4.dll unless TARGET_XINPUT_VER_* says otherwise
+#include "XInputExports.h"
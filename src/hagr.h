@@ -0,0 +1,112 @@
+/*
+ *  hagr - bridging Nintendo Switch Pro controller and XInput
+ *  Copyright (C) 2020 Mifan Bang <https://debug.tw>.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// public interface of Hagr beyond XInput. tools such as overlays can load the Hagr DLL that a game uses and
+// query it with GetProcAddress(). everything here is plain C so it can be used from any language.
+
+#include <windows.h>
+#include <xinput.h>
+
+
+
+// latency histograms use logarithmic buckets. bucket i counts samples in [2^i, 2^(i+1)) microseconds,
+// except that bucket 0 also counts samples below 1 us and the last bucket counts everything above.
+#define HAGR_HISTOGRAM_BUCKETS 20
+
+// motion samples kept per controller for HagrReadMotion(); over a second's worth at any report rate
+#define HAGR_MOTION_DEPTH 512
+
+
+typedef struct _HAGR_STATS
+{
+	DWORD dwSize;  // must be set to sizeof(HAGR_STATS) by the caller
+
+	// reports
+	ULONGLONG reportsReceived;  // full state reports read from the device
+	ULONGLONG reportsDropped;  // reports missing according to gaps in the device's 8-bit report timestamp
+	ULONGLONG reportsCoalesced;  // reports read together with a newer one and thus never published
+
+	// device sessions
+	ULONGLONG reattachCount;  // times a device was opened and brought up
+	ULONGLONG initDeviceCount;  // times the full initialization sequence had to run
+	ULONGLONG initDeviceTotalMicroseconds;
+
+	DWORD publishLatency[HAGR_HISTOGRAM_BUCKETS];  // from a read's completion being dispatched to its states being published
+	DWORD cacheAge[HAGR_HISTOGRAM_BUCKETS];  // age of the published states as seen by XInputGetState()
+} HAGR_STATS;
+
+
+typedef struct _HAGR_STATE_EX
+{
+	DWORD dwSize;  // must be set to sizeof(HAGR_STATE_EX) by the caller
+	XINPUT_STATE state;  // exactly what XInputGetState() would return
+	ULONGLONG timestampMicroseconds;  // when the state was published; QueryPerformanceCounter() time in microseconds, 0 if never
+	ULONGLONG ageMicroseconds;  // how long before this call the state was published
+} HAGR_STATE_EX;
+
+
+typedef struct _HAGR_TIMED_STATE
+{
+	ULONGLONG timestampMicroseconds;  // when the state was published; QueryPerformanceCounter() time in microseconds
+	XINPUT_STATE state;
+} HAGR_TIMED_STATE;
+
+
+typedef struct _HAGR_MOTION_SAMPLE
+{
+	ULONGLONG timestampMicroseconds;  // when the sample was taken, estimated; QueryPerformanceCounter() time in microseconds
+	float acceleration[3];  // in G, along the controller's own X, Y and Z axes
+	float angularVelocity[3];  // in degrees per second, around the same axes
+} HAGR_MOTION_SAMPLE;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// return ERROR_SUCCESS, ERROR_DEVICE_NOT_CONNECTED if the user index is out of range, ERROR_NOT_SUPPORTED if
+// hagrBroker.exe serves this process, or ERROR_BAD_ARGUMENTS.
+// counters are kept per user index and survive reconnects.
+DWORD __stdcall HagrGetStats(DWORD dwUserIndex, HAGR_STATS* pStats);
+typedef DWORD (__stdcall *PFN_HAGR_GET_STATS)(DWORD dwUserIndex, HAGR_STATS* pStats);
+
+// XInputGetState() plus the age of the state. return the same error codes as XInputGetState() or ERROR_BAD_ARGUMENTS.
+DWORD __stdcall HagrGetStateEx(DWORD dwUserIndex, HAGR_STATE_EX* pState);
+typedef DWORD (__stdcall *PFN_HAGR_GET_STATE_EX)(DWORD dwUserIndex, HAGR_STATE_EX* pState);
+
+// copy up to *pCount states published after *pCursor, oldest first. on return *pCount holds the number of states
+// copied and *pCursor is advanced past them; start with a cursor of 0. every caller keeps its own cursor, and states
+// older than StateHistoryDepth reports are lost if the caller doesn't keep up.
+// return ERROR_SUCCESS, ERROR_DEVICE_NOT_CONNECTED, ERROR_NOT_SUPPORTED if the history is disabled or hagrBroker.exe
+// serves this process, or ERROR_BAD_ARGUMENTS.
+DWORD __stdcall HagrReadStateHistory(DWORD dwUserIndex, ULONGLONG* pCursor, HAGR_TIMED_STATE* pStates, DWORD* pCount);
+typedef DWORD (__stdcall *PFN_HAGR_READ_STATE_HISTORY)(DWORD dwUserIndex, ULONGLONG* pCursor, HAGR_TIMED_STATE* pStates, DWORD* pCount);
+
+// same as HagrReadStateHistory(), but for the motion sensors; the controller sends three samples with every report.
+// the first call turns the sensors on, so it returns no samples, and the ones that follow return them once the
+// controller starts sending them. samples older than HAGR_MOTION_DEPTH are lost if the caller doesn't keep up.
+// return ERROR_SUCCESS, ERROR_DEVICE_NOT_CONNECTED, ERROR_NOT_SUPPORTED if hagrBroker.exe serves this process,
+// or ERROR_BAD_ARGUMENTS.
+DWORD __stdcall HagrReadMotion(DWORD dwUserIndex, ULONGLONG* pCursor, HAGR_MOTION_SAMPLE* pSamples, DWORD* pCount);
+typedef DWORD (__stdcall *PFN_HAGR_READ_MOTION)(DWORD dwUserIndex, ULONGLONG* pCursor, HAGR_MOTION_SAMPLE* pSamples, DWORD* pCount);
+
+#ifdef __cplusplus
+}
+#endif
@@ -43,14 +43,21 @@
 namespace
 {
 
-	decltype(XInputGetState)* g_fpGetState = nullptr;
-	decltype(XInputSetState)* g_fpSetState = nullptr;
-	decltype(XInputGetCapabilities)* g_fpGetCapabilities = nullptr;
-	decltype(XInputEnable_NoDeprecation)* g_fpEnable = nullptr;
-	decltype(XInputGetAudioDeviceIds)* g_fpGetAudioDeviceIds = nullptr;
-	decltype(XInputGetBatteryInformation)* g_fpGetBatteryInformation = nullptr;
-	decltype(XInputGetKeystroke)* g_fpGetKeystroke = nullptr;
-	decltype(XInputGetDSoundAudioDeviceGuids)* g_fpGetDSoundAudioDeviceGuids = nullptr;
+	// entry points of the DLL which owns Hagr implementation
+	struct ImplFuncs
+	{
+		decltype(XInputGetState)* getState;
+		decltype(XInputSetState)* setState;
+		decltype(XInputGetCapabilities)* getCapabilities;
+		decltype(XInputEnable_NoDeprecation)* enable;
+		decltype(XInputGetAudioDeviceIds)* getAudioDeviceIds;
+		decltype(XInputGetBatteryInformation)* getBatteryInformation;
+		decltype(XInputGetKeystroke)* getKeystroke;
+		decltype(XInputGetDSoundAudioDeviceGuids)* getDSoundAudioDeviceGuids;
+	};
+
+	ImplFuncs g_implFuncs = { };
+	INIT_ONCE g_implFuncsInitOnce = INIT_ONCE_STATIC_INIT;
 
 	template <typename T>
 	void AssignFuncPtr(T& funcPtr, FARPROC farproc)
@@ -58,6 +65,31 @@ namespace
 		funcPtr = reinterpret_cast<T>(farproc);
 	}
 
+	BOOL CALLBACK BindImplFuncs([[maybe_unused]] PINIT_ONCE initOnce, [[maybe_unused]] void* parameter, [[maybe_unused]] void** context)
+	{
+		constexpr wchar_t pathHagrImplDll[] = L"xinput1_4.dll";  // the DLL which owns Hagr implementation
+
+		if (HMODULE hMod = LoadLibraryW(pathHagrImplDll))
+		{
+			AssignFuncPtr(g_implFuncs.getState, GetProcAddress(hMod, "XInputGetState"));
+			AssignFuncPtr(g_implFuncs.setState, GetProcAddress(hMod, "XInputSetState"));
+			AssignFuncPtr(g_implFuncs.getCapabilities, GetProcAddress(hMod, "XInputGetCapabilities"));
+			AssignFuncPtr(g_implFuncs.enable, GetProcAddress(hMod, "XInputEnable"));
+			AssignFuncPtr(g_implFuncs.getAudioDeviceIds, GetProcAddress(hMod, "XInputGetAudioDeviceIds"));
+			AssignFuncPtr(g_implFuncs.getBatteryInformation, GetProcAddress(hMod, "XInputGetBatteryInformation"));
+			AssignFuncPtr(g_implFuncs.getKeystroke, GetProcAddress(hMod, "XInputGetKeystroke"));
+			AssignFuncPtr(g_implFuncs.getDSoundAudioDeviceGuids, GetProcAddress(hMod, "XInputGetDSoundAudioDeviceGuids"));
+		}
+		return TRUE;  // not retried on failure; the functions stay null and report no device
+	}
+
+	// bound on the first call rather than in DllMain() so LoadLibraryW() never runs under the loader lock
+	const ImplFuncs& GetImplFuncs()
+	{
+		InitOnceExecuteOnce(&g_implFuncsInitOnce, BindImplFuncs, nullptr, nullptr);
+		return g_implFuncs;
+	}
+
 }  // unnamed namespace
 
 
@@ -68,26 +100,29 @@ extern "C"
 
 DWORD __stdcall _XInputGetState(DWORD dwUserIndex, __out XINPUT_STATE* pState)
 {
-	return g_fpGetState ? g_fpGetState(dwUserIndex, pState) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().getState;
+	return func ? func(dwUserIndex, pState) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
 DWORD __stdcall _XInputSetState(DWORD dwUserIndex, XINPUT_VIBRATION* pVibration)
 {
-	return g_fpSetState ? g_fpSetState(dwUserIndex, pVibration) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().setState;
+	return func ? func(dwUserIndex, pVibration) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
 DWORD __stdcall _XInputGetCapabilities(DWORD dwUserIndex, DWORD dwFlags, __out XINPUT_CAPABILITIES* pCapabilities)
 {
-	return g_fpGetCapabilities ? g_fpGetCapabilities(dwUserIndex, dwFlags, pCapabilities) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().getCapabilities;
+	return func ? func(dwUserIndex, dwFlags, pCapabilities) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
 void __stdcall _XInputEnable(BOOL enable)
 {
-	if (g_fpEnable)
-		g_fpEnable(enable);
+	if (auto* func = GetImplFuncs().enable)
+		func(enable);
 }
 
 
@@ -98,7 +133,8 @@ DWORD __stdcall _XInputGetAudioDeviceIds(
 	__out_ecount_opt(*pCaptureCount) LPWSTR pCaptureDeviceId,
 	__inout_opt UINT* pCaptureCount)
 {
-	return g_fpGetAudioDeviceIds ? g_fpGetAudioDeviceIds(dwUserIndex, pRenderDeviceId, pRenderCount, pCaptureDeviceId, pCaptureCount) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().getAudioDeviceIds;
+	return func ? func(dwUserIndex, pRenderDeviceId, pRenderCount, pCaptureDeviceId, pCaptureCount) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
@@ -107,7 +143,8 @@ DWORD __stdcall _XInputGetBatteryInformation(
 	BYTE devType,
 	__out XINPUT_BATTERY_INFORMATION* pBatteryInformation)
 {
-	return g_fpGetBatteryInformation ? g_fpGetBatteryInformation(dwUserIndex, devType, pBatteryInformation) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().getBatteryInformation;
+	return func ? func(dwUserIndex, devType, pBatteryInformation) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
@@ -116,7 +153,8 @@ DWORD __stdcall _XInputGetKeystroke(
 	__reserved DWORD dwReserved,
 	__out XINPUT_KEYSTROKE* pKeystroke)
 {
-	return g_fpGetKeystroke ? g_fpGetKeystroke(dwUserIndex, dwReserved, pKeystroke) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().getKeystroke;
+	return func ? func(dwUserIndex, dwReserved, pKeystroke) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
@@ -125,32 +163,16 @@ DWORD __stdcall _XInputGetDSoundAudioDeviceGuids(
 	__out GUID* pDSoundRenderGuid,
 	__out GUID* pDSoundCaptureGuid)
 {
-	return g_fpGetDSoundAudioDeviceGuids ? g_fpGetDSoundAudioDeviceGuids(dwUserIndex, pDSoundRenderGuid, pDSoundCaptureGuid) : ERROR_DEVICE_NOT_CONNECTED;
+	auto* func = GetImplFuncs().getDSoundAudioDeviceGuids;
+	return func ? func(dwUserIndex, pDSoundRenderGuid, pDSoundCaptureGuid) : ERROR_DEVICE_NOT_CONNECTED;
 }
 
 
 }  // extern "C"
 
 
-__declspec(dllexport) BOOL __stdcall DllMain([[maybe_unused]] HINSTANCE hinstDLL, DWORD fdwReason, [[maybe_unused]] void* lpvReserved)
+__declspec(dllexport) BOOL __stdcall DllMain([[maybe_unused]] HINSTANCE hinstDLL, [[maybe_unused]] DWORD fdwReason, [[maybe_unused]] void* lpvReserved)
 {
-	constexpr wchar_t pathHagrImplDll[] = L"xinput1_4.dll";  // the DLL which owns Hagr implementation
-
-	if (fdwReason == DLL_PROCESS_ATTACH)
-	{
-		if (HMODULE hMod = LoadLibraryW(pathHagrImplDll))
-		{
-			AssignFuncPtr(g_fpGetState, GetProcAddress(hMod, "XInputGetState"));
-			AssignFuncPtr(g_fpSetState, GetProcAddress(hMod, "XInputSetState"));
-			AssignFuncPtr(g_fpGetCapabilities, GetProcAddress(hMod, "XInputGetCapabilities"));
-			AssignFuncPtr(g_fpEnable, GetProcAddress(hMod, "XInputEnable"));
-			AssignFuncPtr(g_fpGetAudioDeviceIds, GetProcAddress(hMod, "XInputGetAudioDeviceIds"));
-			AssignFuncPtr(g_fpGetBatteryInformation, GetProcAddress(hMod, "XInputGetBatteryInformation"));
-			AssignFuncPtr(g_fpGetKeystroke, GetProcAddress(hMod, "XInputGetKeystroke"));
-			AssignFuncPtr(g_fpGetDSoundAudioDeviceGuids, GetProcAddress(hMod, "XInputGetDSoundAudioDeviceGuids"));
-		}
-	}
-
 	return TRUE;
 }
 
@@ -163,61 +185,10 @@ __declspec(dllexport) BOOL __stdcall DllMain([[maybe_unused]] HINSTANCE hinstDLL
 	#error Must define exactly one of the followings: TARGET_XINPUT_VER_1_3=1, TARGET_XINPUT_VER_9_1=1, or TARGET_XINPUT_VER_UAP=1.
 #endif
 
-#if TARGET_XINPUT_VER_1_3 == 1
-	#if defined _WIN64
-		#pragma comment(linker, "/export:DllMain,@1")
-		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@2")
-		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@3")
-		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@4")
-		#pragma comment(linker, "/export:XInputEnable=_XInputEnable,@5")
-		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=_XInputGetDSoundAudioDeviceGuids,@6")
-		#pragma comment(linker, "/export:XInputGetBatteryInformation=_XInputGetBatteryInformation,@7")
-		#pragma comment(linker, "/export:XInputGetKeystroke=_XInputGetKeystroke,@8")
-	#else
-		#pragma comment(linker, "/export:_DllMain@12,@1")
-		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@2")
-		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@3")
-		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@4")
-		#pragma comment(linker, "/export:XInputEnable=__XInputEnable@4,@5")
-		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=__XInputGetDSoundAudioDeviceGuids@12,@6")
-		#pragma comment(linker, "/export:XInputGetBatteryInformation=__XInputGetBatteryInformation@12,@7")
-		#pragma comment(linker, "/export:XInputGetKeystroke=__XInputGetKeystroke@12,@8")
-	#endif
-
-#elif TARGET_XINPUT_VER_9_1_0 == 1
-	#if defined _WIN64
-		#pragma comment(linker, "/export:DllMain,@1")
-		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@2")
-		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=_XInputGetDSoundAudioDeviceGuids,@3")
-		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@4")
-		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@5")
-	#else
-		#pragma comment(linker, "/export:_DllMain@12,@1")
-		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@2")
-		#pragma comment(linker, "/export:XInputGetDSoundAudioDeviceGuids=__XInputGetDSoundAudioDeviceGuids@12,@3")
-		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@4")
-		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@5")
-	#endif
-
-#elif TARGET_XINPUT_VER_UAP == 1
-	#if defined _WIN64
-		#pragma comment(linker, "/export:DllMain,@1")
-		#pragma comment(linker, "/export:XInputEnable=_XInputEnable,@2")
-		#pragma comment(linker, "/export:XInputGetAudioDeviceIds=_XInputGetAudioDeviceIds,@3")
-		#pragma comment(linker, "/export:XInputGetBatteryInformation=_XInputGetBatteryInformation,@4")
-		#pragma comment(linker, "/export:XInputGetCapabilities=_XInputGetCapabilities,@5")
-		#pragma comment(linker, "/export:XInputGetKeystroke=_XInputGetKeystroke,@6")
-		#pragma comment(linker, "/export:XInputGetState=_XInputGetState,@7")
-		#pragma comment(linker, "/export:XInputSetState=_XInputSetState,@8")
-	#else
-		#pragma comment(linker, "/export:_DllMain@12,@1")
-		#pragma comment(linker, "/export:XInputEnable=__XInputEnable@4,@2")
-		#pragma comment(linker, "/export:XInputGetAudioDeviceIds=__XInputGetAudioDeviceIds@20,@3")
-		#pragma comment(linker, "/export:XInputGetBatteryInformation=__XInputGetBatteryInformation@12,@4")
-		#pragma comment(linker, "/export:XInputGetCapabilities=__XInputGetCapabilities@12,@5")
-		#pragma comment(linker, "/export:XInputGetKeystroke=__XInputGetKeystroke@12,@6")
-		#pragma comment(linker, "/export:XInputGetState=__XInputGetState@8,@7")
-		#pragma comment(linker, "/export:XInputSetState=__XInputSetState@8,@8")
-	#endif
-
+#if defined _WIN64
+	#pragma comment(linker, "/export:DllMain,@1")
+#else
+	#pragma comment(linker, "/export:_DllMain@12,@1")
 #endif
+
+#include "XInputExports.h"